@@ -0,0 +1,814 @@
+/** @file audioBENCH.cc
+	@brief Micro benchmarks for the codec, audio buffer, queue, network and metering paths
+	@author Andreas-Joachim Peters
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <math.h>
+#include "audiobuffer.hpp"
+#include "audioring.hpp"
+#include "audiorate.hpp"
+
+#define SAMPLE_RATE  (48000)
+#define FRAMES_PER_BUFFER (120)
+#define NUM_CHANNELS    (2)
+typedef short SAMPLE;
+
+// count heap allocations to prove the steady state is allocation free
+static std::atomic<uint64_t> n_alloc(0);
+
+void* operator new(size_t size)
+{
+    n_alloc++;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+// once these are inlined into a delete expression GCC sees free() on a pointer from
+// operator new and warns, without knowing that the replacement above uses malloc
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+#pragma GCC diagnostic pop
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// one result per line: key=value pairs, or with --json one JSON object per line
+static bool json = false;
+
+class benchresult {
+public:
+    benchresult(const char* bench) { add("bench", bench); }
+
+    benchresult& add(const char* key, const char* value) {
+        return field(key, std::string(json ? "\"" : "") + value + (json ? "\"" : ""));
+    }
+
+    template<typename T>
+    benchresult& add(const char* key, T value) {
+        static_assert(std::is_integral<T>::value, "use add(key, value, precision) for floating point");
+        return field(key, std::is_signed<T>::value ? std::to_string((long long) value) : std::to_string((unsigned long long) value));
+    }
+
+    benchresult& add(const char* key, double value, int precision) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.*f", precision, value);
+        return field(key, buf);
+    }
+
+    void print() {
+        printf(json ? "{%s}\n" : "%s\n", line.c_str());
+        fflush(stdout);
+    }
+
+private:
+    benchresult& field(const char* key, const std::string& value) {
+        if (!line.empty()) {
+            line += json ? ", " : " ";
+        }
+        line += json ? (std::string("\"") + key + "\": " + value) : (std::string(key) + "=" + value);
+        return *this;
+    }
+
+    std::string line;
+};
+
+static void report(const char* bench, const char* impl, size_t batch, size_t ops, uint64_t t_ns, std::vector<uint64_t>& lat)
+{
+    std::sort(lat.begin(), lat.end());
+    double avg = 0;
+    for (auto l : lat) {
+        avg += l;
+    }
+    avg = lat.size() ? avg / lat.size() : 0;
+    benchresult(bench)
+        .add("impl", impl)
+        .add("batch", batch)
+        .add("ops", ops)
+        .add("mops", ops / (t_ns / 1000.0), 3)
+        .add("lat_avg_ns", avg, 0)
+        .add("lat_p50_ns", lat.size() ? lat[lat.size()/2] : 0)
+        .add("lat_p99_ns", lat.size() ? lat[lat.size()*99/100] : 0)
+        .add("lat_max_ns", lat.size() ? lat.back() : 0)
+        .print();
+}
+
+// ---------------------------------------------------------------------------
+// queue: producer -> consumer handoff of shared buffers
+// ---------------------------------------------------------------------------
+
+#define QUEUE_DEPTH 256
+#define QUEUE_POOL  4096
+
+struct queuebench {
+    queuebench(size_t _ops) : ops(_ops), stamps(_ops) {
+        manager.configure(QUEUE_POOL, SAMPLE_RATE, NUM_CHANNELS, FRAMES_PER_BUFFER, sizeof(SAMPLE));
+        manager.reserve(QUEUE_POOL);
+        for (size_t i = 0; i < QUEUE_POOL; ++i) {
+            pool.push_back(manager.get_buffer());
+        }
+    }
+
+    size_t ops;
+    std::vector<uint64_t> stamps;
+    std::vector<audiobuffermanager::shared_buffer> pool;
+    audiobuffermanager manager;
+};
+
+static void bench_audioqueue(size_t ops)
+{
+    queuebench qb(ops);
+    audioqueue q;
+    std::vector<uint64_t> lat;
+    lat.reserve(ops);
+
+    uint64_t t1 = now_ns();
+    std::thread producer([&]() {
+        for (size_t i = 0; i < ops; ++i) {
+            while (q.output_size() >= QUEUE_DEPTH) {
+                std::this_thread::yield();
+            }
+            audiobuffermanager::shared_buffer audio = qb.pool[i % QUEUE_POOL];
+            audio->set_frameindex(i);
+            qb.stamps[i] = now_ns();
+            q.add_output(audio);
+        }
+    });
+
+    for (size_t i = 0; i < ops; ++i) {
+        while (!q.output_size()) {
+            std::this_thread::yield();
+        }
+        audiobuffermanager::shared_buffer audio = q.get_output();
+        lat.push_back(now_ns() - qb.stamps[audio->frame()]);
+    }
+    uint64_t t2 = now_ns();
+    producer.join();
+    report("queue", "audioqueue", 1, ops, t2 - t1, lat);
+}
+
+static void bench_audioringqueue(size_t ops, size_t batch)
+{
+    queuebench qb(ops);
+    audioringqueue<QUEUE_DEPTH> q;
+    std::vector<uint64_t> lat;
+    lat.reserve(ops);
+
+    uint64_t t1 = now_ns();
+    std::thread producer([&]() {
+        std::vector<audiobuffermanager::shared_buffer> vec(batch);
+        for (size_t i = 0; i < ops; ) {
+            size_t n = std::min(batch, ops - i);
+            for (size_t j = 0; j < n; ++j) {
+                vec[j] = qb.pool[(i + j) % QUEUE_POOL];
+                vec[j]->set_frameindex(i + j);
+                qb.stamps[i + j] = now_ns();
+            }
+            size_t done = 0;
+            while (done < n) {
+                size_t k = q.add_output(vec.data() + done, n - done);
+                if (!k) {
+                    std::this_thread::yield();
+                }
+                done += k;
+            }
+            i += n;
+        }
+    });
+
+    std::vector<audiobuffermanager::shared_buffer> vec(batch);
+    for (size_t i = 0; i < ops; ) {
+        size_t n = q.get_output(vec.data(), batch);
+        if (!n) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint64_t t = now_ns();
+        for (size_t j = 0; j < n; ++j) {
+            lat.push_back(t - qb.stamps[vec[j]->frame()]);
+            vec[j] = nullptr;
+        }
+        i += n;
+    }
+    uint64_t t2 = now_ns();
+    producer.join();
+    report("queue", "audioringqueue", batch, ops, t2 - t1, lat);
+}
+
+static int bench_queue(size_t ops)
+{
+    bench_audioqueue(ops);
+    for (size_t batch : {1, 8, 32}) {
+        bench_audioringqueue(ops, batch);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// slab: get/put cost and the no-malloc guarantee of audiobuffermanager
+// ---------------------------------------------------------------------------
+
+#define SLAB_FRAMES 1024
+
+static int bench_slab(size_t ops)
+{
+    audiobuffermanager manager;
+    manager.configure(SLAB_FRAMES, SAMPLE_RATE, NUM_CHANNELS, FRAMES_PER_BUFFER, sizeof(SAMPLE));
+    manager.reserve(SLAB_FRAMES);
+    std::vector<uint64_t> lat;
+    lat.reserve(ops);
+
+    // single thread get/put
+    uint64_t a1 = n_alloc;
+    uint64_t t1 = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        uint64_t t = now_ns();
+        audiobuffermanager::shared_buffer audio = manager.get_buffer();
+        manager.put_buffer(audio);
+        lat.push_back(now_ns() - t);
+    }
+    uint64_t t2 = now_ns();
+    uint64_t a2 = n_alloc;
+    report("slab", "get_put", 1, ops, t2 - t1, lat);
+
+    // contended: two threads allocating, handing over and releasing frames
+    audioring<audiobuffermanager::shared_buffer, 256> ring;
+    std::atomic<bool> go(false);
+    std::atomic<size_t> exhausted(0);
+    std::vector<uint64_t> stamps(ops);
+    lat.clear();
+
+    std::thread producer([&]() {
+        while (!go) {
+            std::this_thread::yield();
+        }
+        for (size_t i = 0; i < ops; ++i) {
+            audiobuffermanager::shared_buffer audio = manager.get_buffer();
+            if (!audio) {
+                exhausted++;
+                continue;
+            }
+            audio->set_frameindex(i);
+            stamps[i] = now_ns();
+            while (!ring.push(audio)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    std::thread consumer([&]() {
+        while (!go) {
+            std::this_thread::yield();
+        }
+        size_t n = 0;
+        while (n + exhausted < ops) {
+            audiobuffermanager::shared_buffer audio;
+            if (ring.pop(audio)) {
+                // get in the producer until the pop here, the release below is not in it
+                lat.push_back(now_ns() - stamps[audio->frame()]);
+                n++;
+                // interleave an own get/put with the producer
+                audiobuffermanager::shared_buffer tmp = manager.get_buffer();
+                tmp = nullptr;
+                audio = nullptr;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint64_t a3 = n_alloc;
+    t1 = now_ns();
+    go = true;
+    producer.join();
+    consumer.join();
+    t2 = now_ns();
+    uint64_t a4 = n_alloc;
+    report("slab", "handoff", 1, ops, t2 - t1, lat);
+
+    bool ok = (a1 == a2) && (a3 == a4) && (manager.available() == manager.allocated());
+
+    // contended: every thread gets and puts frames of the same free list
+    for (size_t threads : {2, 4, 8}) {
+        std::vector<std::vector<uint64_t>> lats(threads);
+        std::vector<std::thread> workers;
+        go = false;
+        for (size_t k = 0; k < threads; ++k) {
+            lats[k].reserve(ops / threads);
+            workers.emplace_back([&, k]() {
+                while (!go) {
+                    std::this_thread::yield();
+                }
+                for (size_t i = 0; i < ops / threads; ++i) {
+                    uint64_t t = now_ns();
+                    audiobuffermanager::shared_buffer audio = manager.get_buffer();
+                    manager.put_buffer(audio);
+                    lats[k].push_back(now_ns() - t);
+                }
+            });
+        }
+        t1 = now_ns();
+        go = true;
+        for (auto& w : workers) {
+            w.join();
+        }
+        t2 = now_ns();
+        lat.clear();
+        for (auto& l : lats) {
+            lat.insert(lat.end(), l.begin(), l.end());
+        }
+        std::string impl = "contended-" + std::to_string(threads);
+        report("slab", impl.c_str(), 1, (ops / threads) * threads, t2 - t1, lat);
+    }
+    benchresult("slab")
+        .add("check", "nomalloc")
+        .add("allocs", (a2 - a1) + (a4 - a3))
+        .add("frames", manager.allocated())
+        .add("available", manager.available())
+        .add("exhausted", manager.exhausted())
+        .add("result", ok ? "ok" : "failed")
+        .print();
+    return ok ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// codec: wav2mpeg/mpeg2wav cost per bitrate and complexity
+// ---------------------------------------------------------------------------
+
+#define CODEC_FRAMES 20000   /* default frames per setting, 50 s of audio */
+
+static int bench_codec(size_t frames)
+{
+    // one second of a stereo two tone signal with a little noise, played in a loop
+    std::vector<int16_t> signal(SAMPLE_RATE * NUM_CHANNELS);
+    uint32_t lcg = 4711;
+    for (size_t i = 0; i < SAMPLE_RATE; ++i) {
+        lcg = lcg * 1664525u + 1013904223u;
+        int noise = (int) (lcg >> 24) - 128;
+        signal[2*i]   = (int16_t) (8000 * sin(2 * M_PI * 440 * i / SAMPLE_RATE) + noise);
+        signal[2*i+1] = (int16_t) (8000 * sin(2 * M_PI * 660 * i / SAMPLE_RATE) + noise);
+    }
+    const size_t period = SAMPLE_RATE / FRAMES_PER_BUFFER;
+
+    audiobuffermanager manager;
+    manager.configure(2, SAMPLE_RATE, NUM_CHANNELS, FRAMES_PER_BUFFER, sizeof(SAMPLE));
+    manager.reserve(2);
+
+    std::vector<uint64_t> enc, dec;
+    enc.reserve(frames);
+    dec.reserve(frames);
+
+    for (int bitrate : {32000, 64000, 128000, 192000}) {
+        for (int complexity : {0, 5, 10}) {
+            audioencoder encoder;
+            audiodecoder decoder;
+            if (encoder.configure(SAMPLE_RATE, NUM_CHANNELS, bitrate) ||
+                decoder.configure(SAMPLE_RATE, NUM_CHANNELS) ||
+                (opus_encoder_ctl(encoder.get(), OPUS_SET_COMPLEXITY(complexity)) != OPUS_OK)) {
+                return -1;
+            }
+            audiobuffermanager::shared_buffer audio = manager.get_buffer();
+            enc.clear();
+            dec.clear();
+            uint64_t bytes = 0;
+            size_t errors = 0;
+            for (size_t i = 0; i < frames; ++i) {
+                audio->store((const char*) &signal[(i % period) * FRAMES_PER_BUFFER * NUM_CHANNELS]);
+                uint64_t t1 = now_ns();
+                int len = audio->wav2mpeg(encoder);
+                uint64_t t2 = now_ns();
+                int pcm = (len > 0) ? audio->mpeg2wav(decoder) : -1;
+                uint64_t t3 = now_ns();
+                if (pcm != FRAMES_PER_BUFFER) {
+                    errors++;
+                    continue;
+                }
+                bytes += len;
+                enc.push_back(t2 - t1);
+                dec.push_back(t3 - t2);
+            }
+            manager.put_buffer(audio);
+
+            std::sort(enc.begin(), enc.end());
+            std::sort(dec.begin(), dec.end());
+            double enc_avg = 0, dec_avg = 0;
+            for (size_t i = 0; i < enc.size(); ++i) {
+                enc_avg += enc[i];
+                dec_avg += dec[i];
+            }
+            enc_avg = enc.size() ? enc_avg / enc.size() : 0;
+            dec_avg = dec.size() ? dec_avg / dec.size() : 0;
+            double frame_ns = 1000000000.0 * FRAMES_PER_BUFFER / SAMPLE_RATE;
+            benchresult("codec")
+                .add("bitrate", bitrate)
+                .add("complexity", complexity)
+                .add("frames", frames)
+                .add("errors", errors)
+                .add("bytes_per_frame", enc.size() ? (double) bytes / enc.size() : 0, 1)
+                .add("enc_avg_ns", enc_avg, 0)
+                .add("enc_p99_ns", enc.size() ? enc[enc.size()*99/100] : 0)
+                .add("dec_avg_ns", dec_avg, 0)
+                .add("dec_p99_ns", dec.size() ? dec[dec.size()*99/100] : 0)
+                .add("realtime_x", (enc_avg + dec_avg) > 0 ? frame_ns / (enc_avg + dec_avg) : 0, 1)
+                .print();
+        }
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// socket: loopback packet rate with sendto/recvfrom vs sendmmsg/recvmmsg
+// ---------------------------------------------------------------------------
+
+#define SOCKET_PORT 18080
+#define SOCKET_PAYLOAD 60
+
+enum socketmode {
+    eSendto,    // one system call per datagram on both ends, the baseline
+    eSendmmsg,
+    eGso
+};
+
+static void bench_socket_batch(size_t ops, int batch, socketmode mode)
+{
+    const bool gso = (mode == eGso);
+    audiosocket rx;
+    audiosocket tx;
+    if (rx.bind(SOCKET_PORT) || tx.connect("127.0.0.1", "bench", SOCKET_PORT)) {
+        return;
+    }
+    if (gso && tx.enable_gso()) {
+        rx.disconnect();
+        tx.disconnect();
+        return;
+    }
+
+    int rcvbuf = 8*1024*1024;
+    setsockopt(rx.fd(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct timeval tmo = {0, 200000};
+    setsockopt(rx.fd(), SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+
+    // whole batches only
+    ops = ((ops + batch - 1) / batch) * batch;
+
+    std::atomic<size_t> received(0);
+    uint64_t t_last_rx = 0;
+    std::thread receiver([&]() {
+        static audiopacket_t udpaudio[AUDIO_MAX_BATCH];
+        while (received < ops) {
+            int n = (mode == eSendto) ? ((rx.receive(udpaudio) < 0) ? -1 : 1) : rx.receive(udpaudio, batch);
+            if (n <= 0) {
+                break;
+            }
+            received += n;
+            t_last_rx = now_ns();
+        }
+    });
+
+    std::vector<audiopacket_t> packets(batch);
+    unsigned char payload[SOCKET_PAYLOAD] = {0};
+
+    uint64_t t1 = now_ns();
+    for (size_t i = 0; i < ops; i += batch) {
+        for (int j = 0; j < batch; ++j) {
+            int len = audiowire::encode(&packets[j], 0, 1, i + j, 0, payload, SOCKET_PAYLOAD);
+            if (mode == eSendto) {
+                tx.send(packets[j].data, len);
+            } else {
+                tx.queue(packets[j].data, len);
+            }
+        }
+        if (mode != eSendto) {
+            tx.flush();
+        }
+    }
+    uint64_t t2 = now_ns();
+    receiver.join();
+
+    benchresult("socket")
+        .add("impl", (mode == eSendto) ? "sendto/recvfrom" : gso ? "sendmmsg+gso/recvmmsg" : "sendmmsg/recvmmsg")
+        .add("batch", batch)
+        .add("sent", ops)
+        .add("received", received.load())
+        .add("tx_kpps", ops / ((t2 - t1) / 1000000.0), 1)
+        .add("rx_kpps", received / ((t_last_rx - t1) / 1000000.0), 1)
+        .print();
+    rx.disconnect();
+    tx.disconnect();
+}
+
+static int bench_socket(size_t ops)
+{
+    bench_socket_batch(ops, 1, eSendto);
+    for (int batch : {1, 2, 4, 8, 16, 32, 64}) {
+        bench_socket_batch(ops, batch, eSendmmsg);
+    }
+    for (int batch : {8, 64}) {
+        bench_socket_batch(ops, batch, eGso);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// wire: header size and encode/parse cost, previous audio_t layout vs audiowire
+// ---------------------------------------------------------------------------
+
+// the datagram layout before the versioned wire format: raw host order struct
+struct legacy_audio_t {
+    uint64_t frame;
+    uint64_t len;
+    uint64_t c_s;
+    uint64_t c_us;
+    char name[32];
+    unsigned char buffer[1440];
+};
+
+#define WIRE_PAYLOAD 60        // typical Opus frame of 2.5 ms
+#define WIRE_PPS     400
+#define WIRE_IPUDP   28
+
+static void report_wire(const char* impl, size_t header, size_t ops, uint64_t t_enc, uint64_t t_parse)
+{
+    size_t datagram = header + WIRE_PAYLOAD;
+    benchresult("wire")
+        .add("impl", impl)
+        .add("header", header)
+        .add("datagram", datagram)
+        .add("kbps_at_400pps", (datagram + WIRE_IPUDP) * WIRE_PPS * 8 / 1000.0, 1)
+        .add("payload_share", (double) WIRE_PAYLOAD / (datagram + WIRE_IPUDP), 3)
+        .add("enc_ns", (double) t_enc / ops, 1)
+        .add("parse_ns", (double) t_parse / ops, 1)
+        .print();
+}
+
+static int bench_wire(size_t ops)
+{
+    unsigned char payload[WIRE_PAYLOAD];
+    memset(payload, 0x55, sizeof(payload));
+    volatile uint64_t sink = 0;
+
+    {
+        static legacy_audio_t packet;
+        uint64_t t1 = now_ns();
+        for (size_t i = 0; i < ops; ++i) {
+            packet.frame = i;
+            snprintf(packet.name, sizeof(packet.name), "%s", "participant");
+            packet.len = WIRE_PAYLOAD;
+            packet.c_s = i;
+            packet.c_us = i;
+            memcpy(packet.buffer, payload, WIRE_PAYLOAD);
+            sink += packet.frame;
+        }
+        uint64_t t2 = now_ns();
+        for (size_t i = 0; i < ops; ++i) {
+            size_t bytes = 64 + WIRE_PAYLOAD;
+            if (bytes == packet.len + 64) {
+                sink += packet.frame + packet.buffer[i % WIRE_PAYLOAD];
+            }
+        }
+        uint64_t t3 = now_ns();
+        report_wire("audio_t", 64, ops, t2 - t1, t3 - t2);
+    }
+
+    {
+        static audiopacket_t packet;
+        audiowire_t wire;
+        uint64_t t1 = now_ns();
+        for (size_t i = 0; i < ops; ++i) {
+            sink += audiowire::encode(&packet, 0, 4711, i, i * 120, payload, WIRE_PAYLOAD);
+        }
+        uint64_t t2 = now_ns();
+        for (size_t i = 0; i < ops; ++i) {
+            if (!audiowire::parse(&packet, wire)) {
+                sink += wire.seq + wire.payload[i % wire.len];
+            }
+        }
+        uint64_t t3 = now_ns();
+        report_wire("audiowire", AUDIO_WIRE_HEADER, ops, t2 - t1, t3 - t2);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// meter: level metering kernels against the old byte sum of music()
+// ---------------------------------------------------------------------------
+
+#define METER_FRAMES 64         // distinct frames cycled through, stays in L1
+
+static size_t legacy_music(const unsigned char* pcm, size_t bytes)
+{
+    size_t music_sum = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        music_sum += pcm[i];
+    }
+    return music_sum;
+}
+
+static void report_meter(const char* impl, size_t ops, uint64_t t_ns, uint64_t t_legacy)
+{
+    benchresult("meter")
+        .add("impl", impl)
+        .add("channels", NUM_CHANNELS)
+        .add("frames", FRAMES_PER_BUFFER)
+        .add("ops", ops)
+        .add("ns_per_frame", (double) t_ns / ops, 1)
+        .add("speedup", t_ns ? (double) t_legacy / t_ns : 0, 2)
+        .print();
+}
+
+static int bench_meter(size_t ops)
+{
+    const size_t n = FRAMES_PER_BUFFER * NUM_CHANNELS;
+    std::vector<int16_t> pcm(METER_FRAMES * n);
+    for (size_t i = 0; i < pcm.size(); ++i) {
+        pcm[i] = (int16_t) (8000 * sin(i * 0.01) + (rand() % 200 - 100));
+    }
+    volatile uint64_t sink = 0;
+
+    uint64_t t1 = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        sink += legacy_music((const unsigned char*) &pcm[(i % METER_FRAMES) * n], n * sizeof(int16_t));
+    }
+    uint64_t t_legacy = now_ns() - t1;
+    report_meter("music", ops, t_legacy, t_legacy);
+
+    struct {
+        const char* name;
+        audiometer::kernel_t kernel;
+    } kernels[] = {
+        {"scalar", audiometer::scalar},
+        {"sse2", audiometer::sse2},
+        {"avx2", audiometer::avx2},
+    };
+    for (auto& k : kernels) {
+        if ((k.kernel == audiometer::avx2) && strcmp(audiometer::isa(), "avx2")) {
+            continue;
+        }
+        int32_t peak[NUM_CHANNELS];
+        int64_t energy[NUM_CHANNELS];
+        uint64_t t2 = now_ns();
+        for (size_t i = 0; i < ops; ++i) {
+            k.kernel(&pcm[(i % METER_FRAMES) * n], FRAMES_PER_BUFFER, NUM_CHANNELS, peak, energy);
+            sink += peak[0] + energy[1];
+        }
+        report_meter(k.name, ops, now_ns() - t2, t_legacy);
+    }
+
+    // what the capture path pays per frame: dispatched kernel, rms and the VAD decision
+    audiolevel_t level;
+    audiovad vad;
+    uint64_t t3 = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        audiometer::measure(&pcm[(i % METER_FRAMES) * n], FRAMES_PER_BUFFER, NUM_CHANNELS, level);
+        sink += vad.update(level);
+    }
+    std::string impl = std::string("measure+vad/") + audiometer::isa();
+    report_meter(impl.c_str(), ops, now_ns() - t3, t_legacy);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// dtx: receiver report loss over talk spurts, silence with keepalives and real loss
+// ---------------------------------------------------------------------------
+
+#define DTX_TALK_FRAMES    200   /* 0.5 s */
+#define DTX_SILENT_FRAMES  300   /* 0.75 s, a keepalive every AUDIO_DTX_KEEPALIVE_MS */
+#define DTX_LOST_FRAMES    5     /* dropped in the last talk spurt, they must be reported */
+
+static int bench_dtx(size_t ops)
+{
+    const size_t keepalive = AUDIO_DTX_KEEPALIVE_MS * SAMPLE_RATE / (1000 * FRAMES_PER_BUFFER);
+    const size_t report = AUDIO_REPORT_MS * SAMPLE_RATE / (1000 * FRAMES_PER_BUFFER);
+    const size_t cycle = DTX_TALK_FRAMES + DTX_SILENT_FRAMES;
+    const size_t cycles = std::max(ops / cycle, (size_t) 2);
+    audioreceiverstats rx;
+    rx.configure(1000.0 * FRAMES_PER_BUFFER / SAMPLE_RATE);
+
+    // the sender's view: every frame uses a sequence number, silent ones are not sent
+    uint64_t lost = 0;
+    uint32_t fraction_max = 0;
+    uint64_t frame = 0;
+    size_t silent = 0;
+    uint64_t t1 = now_ns();
+    for (size_t c = 0; c <= cycles; ++c) {
+        bool last = (c == cycles);
+        for (size_t i = 0; i < cycle; ++i, ++frame) {
+            if (i < DTX_TALK_FRAMES) {
+                silent = 0;
+                if (!last || (i < 100) || (i >= 100 + DTX_LOST_FRAMES)) {
+                    rx.received(frame);
+                }
+            } else if (!last) {
+                if (!(silent++ % keepalive)) {
+                    rx.skipped(frame);
+                }
+            }
+            if (!((frame + 1) % report)) {
+                audioreport_t r = rx.report(0);
+                if (!last) {
+                    lost = r.lost;
+                    fraction_max = std::max(fraction_max, (uint32_t) r.fraction_lost);
+                }
+            }
+            if (last && (i == DTX_TALK_FRAMES - 1)) {
+                break;
+            }
+        }
+    }
+    uint64_t t2 = now_ns();
+    audioreport_t r = rx.report(0);
+    bool ok = !lost && !fraction_max && (r.lost == DTX_LOST_FRAMES);
+    benchresult("dtx")
+        .add("check", "talk-silence-talk")
+        .add("cycles", cycles)
+        .add("frames", frame)
+        .add("ns_per_frame", (double) (t2 - t1) / frame, 1)
+        .add("lost_in_dtx", lost)
+        .add("fraction_lost_max", fraction_max)
+        .add("lost_real", r.lost)
+        .add("lost_expected", DTX_LOST_FRAMES)
+        .add("result", ok ? "ok" : "failed")
+        .print();
+    return ok ? 0 : 1;
+}
+
+static void usage()
+{
+    fprintf(stderr,"usage: audioBENCH [--json] <codec|queue|slab|socket|wire|meter|dtx|all> [ops]\n"
+                   "       --json prints one JSON object per result line\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int arg = 1;
+    if ((argc > arg) && (std::string(argv[arg]) == "--json")) {
+        json = true;
+        arg++;
+    }
+    if (argc <= arg) {
+        usage();
+        return -1;
+    }
+
+    std::string bench = argv[arg];
+    size_t ops = (argc > arg + 1) ? strtoul(argv[arg + 1], 0, 10) : 0;
+    bool all = (bench == "all");
+    int rc = 0;
+
+    if (all || (bench == "codec")) {
+        rc |= bench_codec(ops ? ops : CODEC_FRAMES);
+    }
+
+    if (all || (bench == "queue")) {
+        rc |= bench_queue(ops ? ops : 1000000);
+    }
+
+    if (all || (bench == "slab")) {
+        rc |= bench_slab(ops ? ops : 1000000);
+    }
+
+    if (all || (bench == "socket")) {
+        rc |= bench_socket(ops ? ops : 1000000);
+    }
+
+    if (all || (bench == "wire")) {
+        rc |= bench_wire(ops ? ops : 1000000);
+    }
+
+    if (all || (bench == "meter")) {
+        rc |= bench_meter(ops ? ops : 1000000);
+    }
+
+    if (all || (bench == "dtx")) {
+        rc |= bench_dtx(ops ? ops : 100000);
+    }
+
+    if (!all && (bench != "codec") && (bench != "queue") && (bench != "slab") && (bench != "socket") && (bench != "wire") && (bench != "meter") && (bench != "dtx")) {
+        usage();
+        return -1;
+    }
+    return rc ? 1 : 0;
+}
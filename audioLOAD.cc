@@ -0,0 +1,537 @@
+/** @file audioLOAD.cc
+	@brief Simulate many audioMUX clients from one process and measure what audioSERV sustains
+	@author Andreas-Joachim Peters
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <math.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "audiobuffer.hpp"
+#include "audioclock.hpp"
+#include "audiorecord.hpp"
+#include "audiostats.hpp"
+
+#define SAMPLE_RATE       (48000)
+#define MPEG_BIT_RATE     192000
+#define FRAMES_PER_BUFFER (120)
+#define NUM_CHANNELS      (2)
+#define CONTENT_FRAMES    (400)    /* synthetic content loop, one second */
+#define RECEIVE_BATCH     (32)
+#define MAX_CATCHUP       (4)      /* send ticks made up after a late wakeup */
+#define LOAD_ID_BASE      (0x4000) /* participant ids of the virtual clients */
+#define PING_INTERVAL_MS  (1000)
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int)
+{
+    running = 0;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: audioLOAD [options]\n"
+            "  --server HOST:PORT     audioSERV (127.0.0.1:8080)\n"
+            "  --clients N            virtual clients at the last step (32)\n"
+            "  --step N               clients added per step (all at once)\n"
+            "  --room-size N          clients per room, at least 2 (8)\n"
+            "  --threads N            send/receive threads (2)\n"
+            "  --warmup S             seconds before each measurement (2)\n"
+            "  --duration S           seconds measured per step (10)\n"
+            "  --replay FILE          send the tracks of an audioSERV recording instead of synthetic content\n"
+            "  --max-loss PERC        capacity criterion (1)\n"
+            "  --max-latency MS       capacity criterion on the p99 round trip (20)\n"
+            "  --json                 one JSON object per step\n");
+}
+
+// one encoded frame loop a client plays from
+typedef std::vector<std::vector<unsigned char>> content_t;
+
+// a participant without a sound card
+struct vclient {
+    audiosocket sock;
+    uint16_t room;
+    const content_t* content;
+    size_t cursor;
+    uint32_t timestamp;
+    uint64_t rxframe;           // unwrapped sequence of the mix, receive thread only
+    bool rxstarted;
+    std::atomic<uint64_t> n_sent;
+    std::atomic<uint64_t> n_received;   // mix frames
+    std::atomic<uint64_t> n_missing;    // sequence gaps in the mix
+    std::atomic<uint64_t> n_send_errors;
+
+    vclient() : room(0), content(0), cursor(0), timestamp(0), rxframe(0), rxstarted(false),
+                n_sent(0), n_received(0), n_missing(0), n_send_errors(0) {}
+};
+
+std::vector<std::unique_ptr<vclient>> clients;
+std::atomic<size_t> active(0);              // clients sending, the first <active> ones
+std::atomic<audiohistogram*> latency(0);    // round trip of the current step
+std::atomic<uint64_t> overruns(0);          // generator ticks later than one frame
+audioclock clock_s;
+
+// a chord with a little noise, loud enough that no voice activity detection skips it
+static int synthesize(content_t& content)
+{
+    audioencoder encoder;
+    if (encoder.configure(SAMPLE_RATE, NUM_CHANNELS, MPEG_BIT_RATE)) {
+        return -1;
+    }
+    std::vector<int16_t> pcm(FRAMES_PER_BUFFER * NUM_CHANNELS);
+    unsigned char data[AUDIO_WIRE_PAYLOAD];
+    const double f[3] = { 220.0, 277.2, 329.6 };
+    uint32_t noise = 1;
+    size_t n = 0;
+    for (size_t k = 0; k < CONTENT_FRAMES; ++k) {
+        for (size_t i = 0; i < FRAMES_PER_BUFFER; ++i, ++n) {
+            double t = (double) n / SAMPLE_RATE;
+            double s = 0;
+            for (int v = 0; v < 3; ++v) {
+                s += sin(2 * M_PI * f[v] * t);
+            }
+            noise = noise * 1664525u + 1013904223u;
+            s = 0.08 * s + 0.01 * ((int32_t) noise / 2147483648.0);
+            for (int c = 0; c < NUM_CHANNELS; ++c) {
+                pcm[i * NUM_CHANNELS + c] = (int16_t) (s * 32767);
+            }
+        }
+        int len = encoder.encode(pcm.data(), FRAMES_PER_BUFFER, data, sizeof(data));
+        if (len <= 0) {
+            fprintf(stderr,"error: cannot encode the synthetic content\n");
+            return -1;
+        }
+        content.emplace_back(data, data + len);
+    }
+    return 0;
+}
+
+// the audio frames of every track of a recording, the DTX pauses left out
+static int load(const char* path, std::vector<content_t>& tracks)
+{
+    audiorecording rec;
+    if (rec.open(path)) {
+        return -1;
+    }
+    if ((rec.header().framesize != FRAMES_PER_BUFFER) || (rec.header().samplingrate != SAMPLE_RATE)) {
+        fprintf(stderr,"error: %s has frames of %u samples at %u Hz\n", path, rec.header().framesize, rec.header().samplingrate);
+        return -1;
+    }
+    std::map<uint16_t, content_t> byid;
+    for (int64_t offset = rec.next(0); offset >= 0; offset = rec.next(rec.skip(offset))) {
+        audiowire_t wire;
+        audiowire_t frames[AUDIO_WIRE_MAX_FRAMES];
+        if (audiowire::parse(rec.datagram(offset), rec.record(offset)->bytes, wire) ||
+            (wire.flags & AUDIO_WIRE_FLAG_DTX)) {
+            continue;
+        }
+        int k = audiowire::split(wire, frames, AUDIO_WIRE_MAX_FRAMES, FRAMES_PER_BUFFER);
+        for (int j = 0; j < k; ++j) {
+            if (frames[j].len) {
+                byid[rec.record(offset)->id].emplace_back(frames[j].payload, frames[j].payload + frames[j].len);
+            }
+        }
+    }
+    for (auto& it : byid) {
+        tracks.push_back(std::move(it.second));
+    }
+    if (tracks.empty()) {
+        fprintf(stderr,"error: %s has no audio\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// one frame of client <c>, stamped like audiocapture does
+static void sendframe(vclient& c, audiopacket_t& packet)
+{
+    const std::vector<unsigned char>& frame = (*c.content)[c.cursor];
+    c.cursor = (c.cursor + 1) % c.content->size();
+    uint64_t capture = clock_s.is_synced() ? clock_s.to_server(audioclock::now()) : 0;
+    int len = audiowire::encode(&packet, 0, c.sock.id(), c.sock.nextseq(), c.timestamp,
+                                frame.data(), frame.size(), capture, c.room);
+    c.timestamp += FRAMES_PER_BUFFER;
+    if ((len > 0) && (c.sock.send(packet.data, len) == len)) {
+        c.n_sent.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        c.n_send_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// the mix returned to client <c>
+static void receivemix(vclient& c, std::vector<audiopacket_t>& packets)
+{
+    int n;
+    while ((n = c.sock.receive(packets.data(), RECEIVE_BATCH)) > 0) {
+        uint64_t t4 = audioclock::now();
+        for (int i = 0; i < n; ++i) {
+            audiowire_t wire;
+            if (audiowire::parse(&packets[i], wire)) {
+                continue;
+            }
+            if (wire.flags & AUDIO_WIRE_FLAG_PONG) {
+                clock_s.pong(wire, t4);
+                continue;
+            }
+            if (wire.flags & (AUDIO_WIRE_FLAG_REPORT | AUDIO_WIRE_FLAG_DTX)) {
+                continue;
+            }
+            audiowire_t frames[AUDIO_WIRE_MAX_FRAMES];
+            int k = audiowire::split(wire, frames, AUDIO_WIRE_MAX_FRAMES, FRAMES_PER_BUFFER,
+                                     1000000000ull * FRAMES_PER_BUFFER / SAMPLE_RATE);
+            for (int j = 0; j < k; ++j) {
+                uint64_t frame = audiowire::unwrap(frames[j].seq, c.rxframe);
+                if (c.rxstarted && (frame > c.rxframe + 1)) {
+                    c.n_missing.fetch_add(frame - c.rxframe - 1, std::memory_order_relaxed);
+                }
+                if (!c.rxstarted || (frame > c.rxframe)) {
+                    c.rxframe = frame;
+                    c.rxstarted = true;
+                }
+                c.n_received.fetch_add(1, std::memory_order_relaxed);
+                // the mix carries the oldest capture time it contains: send, queue, mix, encode and back
+                audiohistogram* h = latency.load(std::memory_order_acquire);
+                if (h && frames[j].capture && clock_s.is_synced()) {
+                    uint64_t now = clock_s.to_server(t4);
+                    if (now > frames[j].capture) {
+                        h->record(now - frames[j].capture);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// periodic timer on the monotonic clock, registered with <epfd>; returns the fd or -1
+static int addtimer(int epfd, long period_ns)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct itimerspec period;
+    period.it_interval.tv_sec = period.it_value.tv_sec = period_ns / 1000000000l;
+    period.it_interval.tv_nsec = period.it_value.tv_nsec = period_ns % 1000000000l;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = ~0ull;
+    if (timerfd_settime(fd, 0, &period, 0) || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// clients <id>, <id>+threads, ... : their sockets and the frame clock of their sends
+static void worker(int id, int threads)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        fprintf(stderr,"error: worker %d: epoll_create1 failed errno=%d\n", id, errno);
+        running = 0;
+        return;
+    }
+    for (size_t i = id; i < clients.size(); i += threads) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i]->sock.fd(), &ev)) {
+            fprintf(stderr,"error: worker %d: cannot poll client %lu errno=%d\n", id, i, errno);
+            running = 0;
+            return;
+        }
+    }
+    int timerfd = addtimer(epfd, 1000000000l * FRAMES_PER_BUFFER / SAMPLE_RATE);
+    if (timerfd < 0) {
+        fprintf(stderr,"error: worker %d: cannot arm the frame timer errno=%d\n", id, errno);
+        running = 0;
+        return;
+    }
+
+    std::vector<audiopacket_t> packets(RECEIVE_BATCH);
+    audiopacket_t out;
+    uint64_t lastping = 0;
+    struct epoll_event events[64];
+    while (running) {
+        int n = epoll_wait(epfd, events, 64, 100);
+        for (int e = 0; e < n; ++e) {
+            if (events[e].data.u64 != ~0ull) {
+                receivemix(*clients[events[e].data.u64], packets);
+                continue;
+            }
+            uint64_t ticks = 0;
+            if (read(timerfd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+                continue;
+            }
+            if (ticks > 1) {
+                overruns.fetch_add(ticks - 1, std::memory_order_relaxed);
+            }
+            if (ticks > MAX_CATCHUP) {
+                ticks = MAX_CATCHUP;
+            }
+            size_t a = active.load(std::memory_order_acquire);
+            for (uint64_t t = 0; t < ticks; ++t) {
+                for (size_t i = id; i < a; i += threads) {
+                    sendframe(*clients[i], out);
+                }
+            }
+            // the first client keeps the clock of all in sync with the server
+            uint64_t now = audioclock::now();
+            if (!id && a && (now - lastping >= PING_INTERVAL_MS * 1000000ull)) {
+                int len = audioclock::ping(&out, clients[0]->sock.id(), (uint32_t) (now / 1000000ull));
+                if (len > 0) {
+                    clients[0]->sock.send(out.data, len);
+                }
+                lastping = now;
+            }
+        }
+    }
+    close(timerfd);
+    close(epfd);
+}
+
+// totals over all clients at one point in time
+struct snapshot {
+    uint64_t t_ns;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t missing;
+    uint64_t send_errors;
+    uint64_t overruns;
+    std::vector<uint64_t> mix;   // server mix histogram, empty without /dev/shm/audioserv
+
+    void take(audiostats& server) {
+        t_ns = audioclock::now();
+        sent = received = missing = send_errors = 0;
+        for (auto& c : clients) {
+            sent += c->n_sent.load(std::memory_order_relaxed);
+            received += c->n_received.load(std::memory_order_relaxed);
+            missing += c->n_missing.load(std::memory_order_relaxed);
+            send_errors += c->n_send_errors.load(std::memory_order_relaxed);
+        }
+        overruns = ::overruns.load(std::memory_order_relaxed);
+        mix.clear();
+        if (server.get()) {
+            // summed over the mixer threads of all workers
+            std::unique_ptr<audiohistogram> h(new audiohistogram());
+            server.merge(audiostats::eMix, *h);
+            for (size_t b = 0; b < AUDIO_HIST_BUCKETS; ++b) {
+                mix.push_back(h->counts[b].load(std::memory_order_relaxed));
+            }
+        }
+    }
+};
+
+// percentile of the server mix cost between two snapshots, in ms
+static double mixpercentile(const snapshot& a, const snapshot& b, double q)
+{
+    if (a.mix.empty() || (a.mix.size() != b.mix.size())) {
+        return -1;
+    }
+    uint64_t total = 0;
+    for (size_t i = 0; i < a.mix.size(); ++i) {
+        total += b.mix[i] - a.mix[i];
+    }
+    uint64_t rank = (uint64_t) (q * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; total && (i < a.mix.size()); ++i) {
+        seen += b.mix[i] - a.mix[i];
+        if (seen > rank) {
+            return ((i + 1 < a.mix.size()) ? audiohistogram::lower(i + 1) - 1 : audiohistogram::lower(i)) / 1000000.0;
+        }
+    }
+    return 0;
+}
+
+// clients of the first <n> that get a mix: the rooms fill in order, the only member
+// of the last one gets DTX keepalives
+static size_t listeners(size_t n, size_t roomsize)
+{
+    return ((n % roomsize) == 1) ? n - 1 : n;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string server = "127.0.0.1";
+    int serverport = 8080;
+    size_t nclients = 32;
+    size_t step = 0;
+    size_t roomsize = 8;
+    int threads = 2;
+    double warmup = 2;
+    double duration = 10;
+    const char* replaypath = 0;
+    double max_loss = 1;
+    double max_latency = 20;
+    bool json = false;
+
+    static struct option options[] = {
+        {"server", required_argument, 0, 's'},
+        {"clients", required_argument, 0, 'c'},
+        {"step", required_argument, 0, 'S'},
+        {"room-size", required_argument, 0, 'r'},
+        {"threads", required_argument, 0, 't'},
+        {"warmup", required_argument, 0, 'w'},
+        {"duration", required_argument, 0, 'd'},
+        {"replay", required_argument, 0, 'P'},
+        {"max-loss", required_argument, 0, 'l'},
+        {"max-latency", required_argument, 0, 'L'},
+        {"json", no_argument, 0, 'j'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int o;
+    while ((o = getopt_long(argc, argv, "h", options, 0)) != -1) {
+        switch (o) {
+        case 's': {
+            std::string s = optarg;
+            size_t colon = s.find(':');
+            server = s.substr(0, colon);
+            if (colon != std::string::npos) {
+                serverport = atoi(s.c_str() + colon + 1);
+            }
+            break;
+        }
+        case 'c': nclients = strtoul(optarg, 0, 10); break;
+        case 'S': step = strtoul(optarg, 0, 10); break;
+        case 'r': roomsize = strtoul(optarg, 0, 10); break;
+        case 't': threads = atoi(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'P': replaypath = optarg; break;
+        case 'l': max_loss = atof(optarg); break;
+        case 'L': max_latency = atof(optarg); break;
+        case 'j': json = true; break;
+        default: usage(); return -1;
+        }
+    }
+    if (!step || (step > nclients)) {
+        step = nclients;
+    }
+    if ((nclients < 2) || (roomsize < 2) || (threads < 1) || (duration <= 0)) {
+        // a lone participant only gets DTX keepalives, there is no mix to measure
+        usage();
+        return -1;
+    }
+
+    content_t synthetic;
+    std::vector<content_t> tracks;
+    if (replaypath ? load(replaypath, tracks) : synthesize(synthetic)) {
+        return -1;
+    }
+    if (!replaypath) {
+        tracks.push_back(std::move(synthetic));
+    }
+
+    for (size_t i = 0; i < nclients; ++i) {
+        std::unique_ptr<vclient> c(new vclient());
+        std::string name = "load-" + std::to_string(i);
+        if (c->sock.connect(server, name, serverport) || c->sock.set_nonblocking()) {
+            fprintf(stderr,"error: cannot open the socket of client %lu\n", i);
+            return -1;
+        }
+        c->sock.set_id(LOAD_ID_BASE + i);
+        c->room = 1 + i / roomsize;
+        c->sock.set_room(c->room);
+        c->content = &tracks[i % tracks.size()];
+        // not all clients on the same frame of the content
+        c->cursor = (i * 37) % c->content->size();
+        clients.push_back(std::move(c));
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    audiolog::instance().start();
+
+    // the server's mix histogram when it runs on this machine
+    audiostats serverstats;
+    if (!access("/dev/shm/audioserv", R_OK)) {
+        serverstats.attach("audioserv");
+    }
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back(worker, t, threads);
+    }
+
+    std::vector<std::unique_ptr<audiohistogram>> histograms;
+    size_t capacity = 0;
+    for (size_t n = step; running && (n <= nclients); n += step) {
+        active.store(n, std::memory_order_release);
+        usleep((useconds_t) (warmup * 1000000));
+
+        histograms.emplace_back(new audiohistogram());
+        audiohistogram* h = histograms.back().get();
+        snapshot a;
+        a.take(serverstats);
+        latency.store(h, std::memory_order_release);
+        usleep((useconds_t) (duration * 1000000));
+        latency.store(0, std::memory_order_release);
+        snapshot b;
+        b.take(serverstats);
+        if (!running) {
+            break;
+        }
+
+        double seconds = (b.t_ns - a.t_ns) / 1e9;
+        double expected = seconds * listeners(n, roomsize) * SAMPLE_RATE / FRAMES_PER_BUFFER;
+        uint64_t received = b.received - a.received;
+        double loss = expected ? 100.0 * (1.0 - received / expected) : 0;
+        if (loss < 0) {
+            loss = 0;
+        }
+        double p50 = h->percentile(0.5) / 1000000.0;
+        double p99 = h->percentile(0.99) / 1000000.0;
+        double mix99 = mixpercentile(a, b, 0.99);
+        // a generator that falls behind its own frame clock measures itself, not the server
+        bool behind = (b.overruns - a.overruns) > 0.01 * seconds * threads * SAMPLE_RATE / FRAMES_PER_BUFFER;
+        bool ok = h->total.load() && (loss <= max_loss) && (p99 <= max_latency) && !behind;
+        if (ok) {
+            capacity = n;
+        }
+
+        printf(json ? "{\"clients\": %lu, \"rooms\": %lu, \"room_size\": %lu, \"sent_pps\": %.0f, \"received_fps\": %.0f, "
+                      "\"loss_perc\": %.3f, \"gaps\": %lu, \"latency_p50_ms\": %.3f, \"latency_p99_ms\": %.3f, \"latency_max_ms\": %.3f, "
+                      "\"server_mix_p99_ms\": %.3f, \"send_errors\": %lu, \"overruns\": %lu, \"ok\": %d}\n"
+                    : "step: clients=%lu rooms=%lu room-size=%lu sent-pps=%.0f received-fps=%.0f loss=%.3f%% gaps=%lu "
+                      "latency-p50=%.3fms latency-p99=%.3fms latency-max=%.3fms server-mix-p99=%.3fms send-errors=%lu overruns=%lu ok=%d\n",
+               n, (n + roomsize - 1) / roomsize, roomsize,
+               (b.sent - a.sent) / seconds,
+               received / seconds,
+               loss,
+               b.missing - a.missing,
+               p50, p99, h->max.load() / 1000000.0,
+               mix99,
+               b.send_errors - a.send_errors,
+               b.overruns - a.overruns,
+               ok);
+        fflush(stdout);
+    }
+
+    running = 0;
+    for (auto& t : workers) {
+        t.join();
+    }
+    if (!json) {
+        printf("capacity: %lu clients in rooms of %lu (loss<=%.1f%% latency-p99<=%.1fms)\n",
+               capacity, roomsize, max_loss, max_latency);
+    }
+    return 0;
+}
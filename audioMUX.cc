@@ -8,19 +8,29 @@
 #include <stdlib.h>
 #include "portaudio.h"
 #include "audiobuffer.hpp"
-#include <sys/time.h>
+#include "jitterbuffer.hpp"
+#include "audiocapture.hpp"
+#include "audiorate.hpp"
+#include "audioresampler.hpp"
+#include "audioclock.hpp"
+#include "audiostats.hpp"
 #include <thread>
 
 /* #define SAMPLE_RATE  (17932) // Test failure to open with this value. */
 #define SAMPLE_RATE  (48000)
 #define MPEG_BIT_RATE 192000
 #define FRAMES_PER_BUFFER (120)
-#define NUM_SECONDS     (5)
 #define NUM_CHANNELS    (2)
+#define JITTER_MIN_FRAMES (2)
+#define JITTER_MAX_FRAMES (40)
+#define RECEIVE_BATCH   (16)   /* datagrams per recvmmsg */
+#define EXPECTED_LOSS_PERC (0) /* in-band FEC for this packet loss, 0 disables it; needs frames of >= 10ms (SILK/hybrid), not the 2.5ms CELT ones */
+#define AGGREGATE_FRAMES (1)  /* opus frames per datagram, more saves packets and adds latency */
+#define DTX             (1)  /* no frames while the microphone is silent, only keepalives */
+#define ENCODER_CPU     (-1) /* pin the encoder thread to this cpu, -1 to leave it unpinned */
+#define MONITOR_GAIN    (0.0) /* own input mixed into the output, no network hop; 0 disables */
 /* #define DITHER_FLAG     (paDitherOff) */
 #define DITHER_FLAG     (0) /**/
-/** Set to 1 if you want to capture the recording to a file. */
-#define WRITE_TO_FILE   (0)
 
 /* Select sample format. */
 
@@ -31,286 +41,215 @@ typedef short SAMPLE;
 
 
 audiobuffermanager audiomanager_w;
-audioqueue audioq_w;
-audiocodec audiocoder_w;
+audioencoder audioencoder_w;
+audiosocket audiosock;
+audioclock clock_w;  // our monotonic clock against the server's
+audiocapture audiocap_w(audiomanager_w, audioencoder_w, audiosock);
 
 audiobuffermanager audiomanager_r;
-audioqueue audioq_r;
-audiocodec audiocoder_r;
-
-audiosocket audiosock;
+audiodecoder audiodecoder_r;
+jitterbuffer jitter_r(audiomanager_r);
+audioreceiverstats rxstats_r;
+audiodrift drift_r;
+audioresampler resampler_r;
 
-double interval(struct timeval& tv1, struct timeval& tv2)
-{
-    return (((tv2.tv_sec-tv1.tv_sec)*1000000) + (tv2.tv_usec-tv1.tv_usec))/1000.0;
-}
+audiostats stats;  // exported to /dev/shm/audiomux, see audioSTAT
 
+// ADC to DAC of the current period, the fixed round trip through the sound card
+static double device_rtt = 0;
 
-/* This routine will be called by the PortAudio engine when audio is needed.
-** It may be called at interrupt level on some machines so don't do anything
-** that could mess up the system like calling malloc() or free().
-*/
-static int recordCallback( const void *inputBuffer, void *outputBuffer,
-                           unsigned long framesPerBuffer,
-                           const PaStreamCallbackTimeInfo* timeInfo,
-                           PaStreamCallbackFlags statusFlags,
-                           void *userData )
+// receive path: fill one period of output from the jitter buffer, resampled onto our clock
+static void playout(SAMPLE* wptr, unsigned long framesPerBuffer, const PaStreamCallbackTimeInfo* timeInfo)
 {
-    struct timezone tz;
-    struct timeval tv1,tv2,tv3,tv4;
-    static size_t frameindex = 0;
     static size_t callbacks=0;
-    const SAMPLE *rptr = (const SAMPLE*)inputBuffer;
-    long framesToCalc;
-    long i;
-    int finished;
-    
-    
-    (void) outputBuffer; /* Prevent unused variable warnings. */
-    (void) timeInfo;
-    (void) statusFlags;
-    (void) userData;
+    callbacks++;
 
+    // capture (on the far end) to playout (here) latency, on the server clock
+    static double latency=0, latency_sum=0, latency_max=0;
+    static uint64_t latencies=0;
+    const uint64_t t1 = audioclock::now();
+    const bool synced = clock_w.is_synced();
+    const uint64_t now = synced ? clock_w.to_server(t1) : 0;
+    // frames pushed now reach the DAC after what the resampler still holds and the device latency
+    double outlatency = 1000.0 * resampler_r.buffered() / SAMPLE_RATE;
+    if (timeInfo && (timeInfo->outputBufferDacTime > timeInfo->currentTime)) {
+        outlatency += 1000.0 * (timeInfo->outputBufferDacTime - timeInfo->currentTime);
+    }
 
-    framesToCalc = framesPerBuffer;
-    finished = paContinue;
+    // play the remote clock on ours: consume slightly more or less than one frame per period
+    // the buffer is empty on purpose during DTX, that is no depth error
+    double ratio = drift_r.played(framesPerBuffer,
+                                  jitter_r.silent() ? jitter_r.target_depth() : jitter_r.depth(),
+                                  jitter_r.target_depth());
 
-    gettimeofday(&tv1,&tz);
-    
-    frameindex += framesToCalc;
-    
-    callbacks++;
-    audiobuffermanager::shared_buffer audio = audiomanager_w.get_buffer();
-    audio->set_frameindex(frameindex);
-    audio->store((char*)inputBuffer);
-    //audioq_w.add_output(audio);
-    gettimeofday(&tv2,&tz);
-    int code_len = audio->wav2mpeg(audiocoder_w);
-    gettimeofday(&tv3,&tz);
-    int decode_len = 0; //audio->mpeg2wav(audiocoder_w);
-    gettimeofday(&tv4,&tz);
-
-    int send_len = audio->mpeg2udp(audiosock);
-    
-    audiomanager_w.put_buffer(audio);
-    //audioq_w.add_output(audio);
-    
-    /*
-    audiobuffermanager::shared_buffer audio_r = audiomanager_w.get_buffer();
-    struct audio_t* udpaudio = audiosock.receive();
-    
-    if (udpaudio) {
-        printf("%lu %lu\n", udpaudio->frame, udpaudio->len);
-        if (!audio_r->udp2mpeg(udpaudio)) {
-            if (audio_r->mpeg2wav(audiocoder_w) == audio_r->getFramesize()) {
-                // add it for playback
-                printf("adding to queue\n");
-                audioq_w.add_output(audio_r);
+    while (resampler_r.buffered() < resampler_r.needed(framesPerBuffer, ratio)) {
+        // never wait here: the jitter buffer returns nullptr while buffering, lost frames come back concealed
+        audiobuffermanager::shared_buffer audio = jitter_r.playout(audiodecoder_r);
+        size_t pushed = audio ? resampler_r.push((const int16_t*) audio->ptr(), audio->getFramesize())
+                              : resampler_r.push_silence(FRAMES_PER_BUFFER);
+        if (audio && synced && audio->capture() && (audio->capture() < now)) {
+            latency = (now - audio->capture()) / 1000000.0 + outlatency;
+            latency_sum += latency;
+            latencies++;
+            if (latency > latency_max) {
+                latency_max = latency;
             }
         }
+        if (!pushed) {
+            break;
+        }
     }
-    */
+
+    size_t produced = resampler_r.pull(wptr, framesPerBuffer, ratio);
 
     if (!(callbacks%400)) {
-        printf("output-queue: %lu len=%d decode-len=%d sent-len=%d music=%lx t_store:%.03f t_enc:%.03f t_dec=%.03f\n",
-               audioq_w.output_size(),
-               code_len,
-               decode_len,
-               send_len,
-               audio->music(),
-               interval(tv2,tv1),
-               interval(tv3,tv2),
-               interval(tv4,tv3)
-               );
+        AUDIO_INFO("jitter: depth=%lu target=%lu jitter=%.03f drift=%.01fppm ratio=%.06f played=%lu missing=%lu late=%lu skipped=%lu underrun=%lu recovered=%lu concealed=%lu lost=%lu silent=%lu",
+               jitter_r.depth(),
+               jitter_r.target_depth(),
+               jitter_r.jitter_ms(),
+               drift_r.ppm(),
+               ratio,
+               jitter_r.n_played.load(),
+               jitter_r.n_missing.load(),
+               jitter_r.n_late.load(),
+               jitter_r.n_skipped.load(),
+               jitter_r.n_underrun.load(),
+               jitter_r.n_recovered.load(),
+               jitter_r.n_concealed.load(),
+               jitter_r.n_lost.load(),
+               jitter_r.n_silent.load());
+        AUDIO_INFO("clock: synced=%d offset=%.03fms rtt=%.03fms device_rtt=%.03fms latency=%.03f latency_avg=%.03f latency_max=%.03f",
+               synced,
+               clock_w.offset() / 1000000.0,
+               clock_w.rtt_ms(),
+               device_rtt,
+               latency,
+               latencies ? latency_sum / latencies : 0,
+               latency_max);
+    }
+
+    if (produced < framesPerBuffer) {
+        // play some silence
+        memset(wptr + produced * NUM_CHANNELS, 0, (framesPerBuffer - produced) * NUM_CHANNELS * sizeof(SAMPLE));
+    }
+
+    stats.record(audiostats::ePlayout, audioclock::now() - t1);
+    stats.set(audiostats::eBuffersQueued, audiomanager_r.queued());
+    stats.set(audiostats::eBuffersInflight, audiomanager_r.inflight());
+    stats.set(audiostats::eQueueDepth, jitter_r.depth());
+    stats.set(audiostats::eUnderruns, jitter_r.n_underrun.load());
+    stats.set(audiostats::eDrops, jitter_r.n_late.load() + jitter_r.n_overflow.load() + jitter_r.n_skipped.load());
+    stats.set(audiostats::eConcealed, jitter_r.n_recovered.load() + jitter_r.n_concealed.load());
+}
+
+// our own input on top of the mix, without the network hop
+static void monitor(SAMPLE* wptr, const SAMPLE* rptr, unsigned long framesPerBuffer)
+{
+    const int gain = (int) (MONITOR_GAIN * 32768);
+    for (unsigned long i = 0; i < framesPerBuffer * NUM_CHANNELS; ++i) {
+        int v = wptr[i] + ((rptr[i] * gain) >> 15);
+        wptr[i] = (v > 32767) ? 32767 : (v < -32768) ? -32768 : v;
     }
-    
-    return finished;
 }
 
-/* This routine will be called by the PortAudio engin
- e when audio is needed.
+/* This routine will be called by the PortAudio engine when audio is needed.
 ** It may be called at interrupt level on some machines so don't do anything
 ** that could mess up the system like calling malloc() or free().
 */
-static int playCallback( const void *inputBuffer, void *outputBuffer,
-                         unsigned long framesPerBuffer,
-                         const PaStreamCallbackTimeInfo* timeInfo,
-                         PaStreamCallbackFlags statusFlags,
-                         void *userData )
+static int duplexCallback( const void *inputBuffer, void *outputBuffer,
+                           unsigned long framesPerBuffer,
+                           const PaStreamCallbackTimeInfo* timeInfo,
+                           PaStreamCallbackFlags statusFlags,
+                           void *userData )
 {
-    static size_t frameindex=0;
-    SAMPLE *rptr = 0;//&data->recordedSamples[frameindex * NUM_CHANNELS];
-    SAMPLE *wptr = (SAMPLE*)outputBuffer;
-    unsigned int i;
-    int finished;
-    unsigned int framesLeft = frameindex;
-
-    (void) inputBuffer; /* Prevent unused variable warnings. */
-    (void) timeInfo;
+    static const SAMPLE silence[FRAMES_PER_BUFFER * NUM_CHANNELS] = { SAMPLE_SILENCE };
     (void) statusFlags;
     (void) userData;
 
-    audiobuffermanager::shared_buffer audio;
-    //fprintf(stdout, "info: queue size = %lu\n", audioq_w.output_size());
-    
-    while (audioq_w.output_size()<1000) {
-        Pa_Sleep(10);
-        //fprintf(stdout, "info: queue size = %lu\n", audioq_w.output_size());
-    }
-    
-    if (0)
-    while (audioq_w.output_size()>100) {
-        // drop some frames
-        audio = audioq_w.get_output();
-        audiomanager_w.put_buffer(audio);
-    }
-    
-    if (audioq_w.output_size()) {
-        fprintf(stdout, "info: queue size = %lu\n", audioq_w.output_size());
-        // we have some audio to play
-        audio = audioq_w.get_output();
-        
-        if (audio) {
-            switch(audio->type) {
-                case audiobuffer::eWAV:
-                    fprintf(stderr,"info: found wav\n");
-                    break;
-                case audiobuffer::eMPEG:
-                    fprintf(stderr,"info: found mpeg\n");
-                    if (audio->mpeg2wav(audiocoder_w) != audio->getFramesize()) {
-                        audiomanager_w.put_buffer(audio);
-                        // play silence
-                        audio = nullptr;
-                    }
-                    break;
-                default:
-                    audiomanager_w.put_buffer(audio);
-                    // play silence
-                    audio = nullptr;
-                    break;
-                    
-            }
-        }
-        if (audio) {
-            // copy the audio buffer
-            memcpy(outputBuffer, audio->ptr(), audio->size());
-            fprintf(stdout,"age=%.02f\n", audio->age_in_ms());
-        }
+    // no input in this period (e.g. an underflow): send silence, so the frame clock keeps going
+    const SAMPLE* rptr = inputBuffer ? (const SAMPLE*) inputBuffer : silence;
+    SAMPLE* wptr = (SAMPLE*) outputBuffer;
+
+    if (timeInfo && (timeInfo->outputBufferDacTime > timeInfo->inputBufferAdcTime)) {
+        device_rtt = 1000.0 * (timeInfo->outputBufferDacTime - timeInfo->inputBufferAdcTime);
     }
-    
-    if (!audio) {
-        // play some silence
-        for( i=0; i<framesPerBuffer; i++ )
-        {
-            *wptr++ = 0;
-            if( NUM_CHANNELS == 2 ) *wptr++ = 0;
-            //*wptr++ = *rptr++;  /* left */
-            //if( NUM_CHANNELS == 2 ) *wptr++ = *rptr++;  /* right */
-        }
+
+    // the same period in both directions: this input goes to the send path (only a copy
+    // into a preallocated slot, the encoder thread does the rest) ...
+    if (inputBuffer || (framesPerBuffer == FRAMES_PER_BUFFER)) {
+        audiocap_w.capture(rptr, framesPerBuffer);
     }
-    frameindex+= framesPerBuffer;
-    finished = paContinue;
 
-    return finished;
+    // ... and the receive path fills this output
+    playout(wptr, framesPerBuffer, timeInfo);
+
+    if ((MONITOR_GAIN > 0) && inputBuffer) {
+        monitor(wptr, rptr, framesPerBuffer);
+    }
+    return paContinue;
 }
 
-void recorder()
+void duplex()
 {
     PaStreamParameters  inputParameters;
+    PaStreamParameters  outputParameters;
     PaStream*           stream;
+    const PaStreamInfo* info;
     PaError             err = paNoError;
-    
+
     inputParameters.device = Pa_GetDefaultInputDevice(); /* default input device */
     if (inputParameters.device == paNoDevice) {
         fprintf(stderr,"Error: No default input device.\n");
-        goto done_rec;
+        goto done;
     }
-    inputParameters.channelCount = 2;                    /* stereo input */
+    inputParameters.channelCount = NUM_CHANNELS;
     inputParameters.sampleFormat = PA_SAMPLE_TYPE;
     inputParameters.suggestedLatency = Pa_GetDeviceInfo( inputParameters.device )->defaultLowInputLatency;
     inputParameters.hostApiSpecificStreamInfo = NULL;
 
-    /* Record some audio. -------------------------------------------- */
+    outputParameters.device = Pa_GetDefaultOutputDevice(); /* default output device */
+    if (outputParameters.device == paNoDevice) {
+        fprintf(stderr,"Error: No default output device.\n");
+        goto done;
+    }
+    outputParameters.channelCount = NUM_CHANNELS;
+    outputParameters.sampleFormat = PA_SAMPLE_TYPE;
+    outputParameters.suggestedLatency = Pa_GetDeviceInfo( outputParameters.device )->defaultLowOutputLatency;
+    outputParameters.hostApiSpecificStreamInfo = NULL;
+
+    /* One stream for both directions: input and output run on the same device clock and period. */
     err = Pa_OpenStream(
               &stream,
               &inputParameters,
-              NULL,                  /* &outputParameters, */
+              &outputParameters,
               SAMPLE_RATE,
               FRAMES_PER_BUFFER,
               paClipOff,      /* we won't output out of range samples so don't bother clipping them */
-              recordCallback,
+              duplexCallback,
               0 );
-    if( err != paNoError ) goto done_rec;
+    if( err != paNoError ) goto done;
+
+    info = Pa_GetStreamInfo( stream );
+    if (info) {
+        AUDIO_INFO("device: input-latency=%.03fms output-latency=%.03fms round-trip=%.03fms rate=%.0f",
+                   1000.0 * info->inputLatency,
+                   1000.0 * info->outputLatency,
+                   1000.0 * (info->inputLatency + info->outputLatency),
+                   info->sampleRate);
+    }
 
     err = Pa_StartStream( stream );
-    if( err != paNoError ) goto done_rec;
-    printf("\n=== Now recording!! Please speak into the microphone. ===\n"); fflush(stdout);
+    if( err != paNoError ) goto done;
+    printf("\n=== Now recording and playing back!! Please speak into the microphone. ===\n"); fflush(stdout);
 
     while( ( err = Pa_IsStreamActive( stream ) ) == 1 )
     {
         Pa_Sleep(1000);
     }
-    if( err < 0 ) goto done_rec;
+    if( err < 0 ) goto done;
 
     err = Pa_CloseStream( stream );
-    
-    
-done_rec:
-    Pa_Terminate();
-    
-    if( err != paNoError )
-    {
-        fprintf( stderr, "An error occured while using the portaudio stream\n" );
-        fprintf( stderr, "Error number: %d\n", err );
-        fprintf( stderr, "Error message: %s\n", Pa_GetErrorText( err ) );
-        err = 1;          /* Always return 0 or 1, but no other return codes. */
-    }
-}
 
-void player()
-{
-    PaStreamParameters  outputParameters;
-    PaStream*           stream;
-    PaError             err = paNoError;
- 
-    outputParameters.device = Pa_GetDefaultOutputDevice(); /* default output device */
-    if (outputParameters.device == paNoDevice) {
-        fprintf(stderr,"Error: No default output device.\n");
-        goto done;
-    }
-    outputParameters.channelCount = 2;                     /* stereo output */
-    outputParameters.sampleFormat =  PA_SAMPLE_TYPE;
-    outputParameters.suggestedLatency = Pa_GetDeviceInfo( outputParameters.device )->defaultLowOutputLatency;
-    outputParameters.hostApiSpecificStreamInfo = NULL;
-    
-    printf("\n=== Now playing back. ===\n"); fflush(stdout);
-    err = Pa_OpenStream(
-                        &stream,
-                        NULL, /* no input */
-                        &outputParameters,
-                        SAMPLE_RATE,
-                        FRAMES_PER_BUFFER,
-                        paClipOff,      /* we won't output out of range samples so don't bother clipping them */
-                        playCallback,
-                        0 );
-    if( err != paNoError ) goto done;
-    
-    if( stream )
-    {
-        err = Pa_StartStream( stream );
-        if( err != paNoError ) goto done;
-        
-        printf("Waiting for playback to finish.\n"); fflush(stdout);
-        
-        while( ( err = Pa_IsStreamActive( stream ) ) == 1 ) Pa_Sleep(100);
-        if( err < 0 ) goto done;
-        
-        err = Pa_CloseStream( stream );
-        if( err != paNoError ) goto done;
-        
-        printf("Done.\n"); fflush(stdout);
-    }
-    
 done:
     Pa_Terminate();
 
@@ -331,48 +270,135 @@ void udpreceiver()
         exit(-1);
     }
     */
-    size_t lastframe=0;
+    static audiopacket_t udpaudio[RECEIVE_BATCH];
+    uint64_t lastframe=0;
+    audiopacket_t rr;
+    audiopacket_t ping;
+    uint32_t reports=0;
+    uint32_t pings=0;
+    struct timespec lastreport;
+    clock_gettime(CLOCK_MONOTONIC, &lastreport);
+    uint64_t lastping = 0;
     do {
-        audiobuffermanager::shared_buffer audio = audiomanager_w.get_buffer();
-        struct audio_t* udpaudio = audiosock.receive();
-        if (udpaudio) {
-            fprintf(stdout,"frame=%lu last-frame=%lu diff=%d\n", udpaudio->frame, lastframe, udpaudio->frame-lastframe);
-            lastframe = udpaudio->frame;
-            if (!audio->udp2mpeg(udpaudio)) {
-                if (audio->mpeg2wav(audiocoder_r) == audio->getFramesize()) {
-                    // add it for playback
-                    audioq_w.add_output(audio);
+        int n = audiosock.receive(udpaudio, RECEIVE_BATCH);
+        uint64_t t4 = audioclock::now();
+        if (n <= 0) {
+            AUDIO_LOG_RATE(AUDIO_LOG_WARNING, 1, "udpreceive failed ...");
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            audiowire_t wire;
+            if (audiowire::parse(&udpaudio[i], wire)) {
+                continue;
+            }
+            if (wire.flags & AUDIO_WIRE_FLAG_PONG) {
+                clock_w.pong(wire, t4);
+                continue;
+            }
+            if (wire.flags & AUDIO_WIRE_FLAG_REPORT) {
+                // how our uplink arrives at the server
+                audioreport_t report;
+                if (!audiowire::parse(wire, report)) {
+                    audiocap_w.rate.update(report);
+                }
+                continue;
+            }
+            if (wire.flags & AUDIO_WIRE_FLAG_DTX) {
+                // nobody talks: the frames up to this one were skipped, they play as silence
+                uint64_t frame = audiowire::unwrap(wire.seq, lastframe);
+                rxstats_r.skipped(frame);
+                jitter_r.silence(frame);
+                drift_r.arrived(frame);
+                lastframe = frame;
+                continue;
+            }
+            audiowire_t frames[AUDIO_WIRE_MAX_FRAMES];
+            int k = audiowire::split(wire, frames, AUDIO_WIRE_MAX_FRAMES, FRAMES_PER_BUFFER, 1000000000ull * FRAMES_PER_BUFFER / SAMPLE_RATE);
+            for (int j = 0; j < k; ++j) {
+                uint64_t frame = audiowire::unwrap(frames[j].seq, lastframe);
+                rxstats_r.received(frame);
+                drift_r.arrived(frame);
+                AUDIO_DEBUG("frame=%lu last-frame=%lu diff=%ld", frame, lastframe, (long)(frame-lastframe));
+                lastframe = frame;
+                audiobuffermanager::shared_buffer audio = audiomanager_r.get_buffer();
+                if (!audio) {
+                    // buffer slab exhausted
+                    continue;
+                }
+                if (audio->udp2mpeg(frames[j], frame) || jitter_r.put(audio)) {
+                    // late, duplicate or overflow
+                    audiomanager_r.put_buffer(audio);
                 }
             }
-        } else {
-            fprintf(stdout,"udpreceive failed ...\n");
+        }
+        stats.record(audiostats::eReceive, audioclock::now() - t4);
+
+        // tell the server how its mix arrives here
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - lastreport.tv_sec)*1000l + (now.tv_nsec - lastreport.tv_nsec)/1000000l >= AUDIO_REPORT_MS) {
+            audioreport_t report = rxstats_r.report(jitter_r.n_late.load());
+            int len = audiowire::encode(&rr, audiosock.id(), reports++, report, audiosock.room());
+            if (len > 0) {
+                audiosock.send(rr.data, len);
+            }
+            lastreport = now;
+        }
+
+        // keep the clock offset fresh
+        if (t4 - lastping >= AUDIO_PING_MS * 1000000ull) {
+            int len = audioclock::ping(&ping, audiosock.id(), pings++);
+            if (len > 0) {
+                audiosock.send(ping.data, len);
+            }
+            lastping = t4;
         }
     } while(1);
 }
 
-int main(void)
+int main(int argc, char* argv[])
 {
+    // audioMUX [server-ip] [name] [port] [room], e.g. 127.0.0.1 to go through audioNET
+    std::string server = (argc > 1) ? argv[1] : "5.189.186.79";
+    std::string name = (argc > 2) ? argv[2] : "Andi";
+    int port = (argc > 3) ? atoi(argv[3]) : 8080;
+    std::string room = (argc > 4) ? argv[4] : "";
+
+    audiolog::instance().start();
     audiomanager_w.configure(SAMPLE_RATE/FRAMES_PER_BUFFER, SAMPLE_RATE, NUM_CHANNELS, FRAMES_PER_BUFFER, sizeof(SAMPLE) );
     audiomanager_w.reserve(SAMPLE_RATE/FRAMES_PER_BUFFER);
-    audiocoder_w.configure(SAMPLE_RATE, NUM_CHANNELS, MPEG_BIT_RATE );
+    audioencoder_w.configure(SAMPLE_RATE, NUM_CHANNELS, MPEG_BIT_RATE, EXPECTED_LOSS_PERC );
+    audiocap_w.configure(NUM_CHANNELS, FRAMES_PER_BUFFER, ENCODER_CPU, AGGREGATE_FRAMES);
+    audiocap_w.set_clock(&clock_w);
+    audiocap_w.vad.configure(1000.0 * FRAMES_PER_BUFFER / SAMPLE_RATE);
+    audiocap_w.set_dtx(DTX);
+    audiocap_w.set_stats(&stats);
+    stats.open("audiomux");
+    audiocap_w.rate.configure(AUDIO_RATE_MIN, MPEG_BIT_RATE, MPEG_BIT_RATE, EXPECTED_LOSS_PERC, 1000.0 * FRAMES_PER_BUFFER / SAMPLE_RATE);
     
     audiomanager_r.configure(SAMPLE_RATE/FRAMES_PER_BUFFER, SAMPLE_RATE, NUM_CHANNELS, FRAMES_PER_BUFFER, sizeof(SAMPLE) );
     audiomanager_r.reserve(SAMPLE_RATE/FRAMES_PER_BUFFER);
-    audiocoder_r.configure(SAMPLE_RATE, NUM_CHANNELS, MPEG_BIT_RATE );
+    audiodecoder_r.configure(SAMPLE_RATE, NUM_CHANNELS );
+    jitter_r.configure(JITTER_MIN_FRAMES, JITTER_MAX_FRAMES, 1000.0 * FRAMES_PER_BUFFER / SAMPLE_RATE);
+    rxstats_r.configure(1000.0 * FRAMES_PER_BUFFER / SAMPLE_RATE);
+    drift_r.configure(FRAMES_PER_BUFFER);
+    jitter_r.set_stats(&stats);
+    resampler_r.configure(NUM_CHANNELS, 8 * FRAMES_PER_BUFFER);
      
-    if (audiosock.connect("5.189.186.79", "Andi")) {
+    if (audiosock.connect(server, name, port)) {
         exit(-1);
     }
+    // everyone naming the same room hears each other, no room is the default room
+    audiosock.set_room(room.empty() ? 0 : audiowire::id(room));
     
     if( Pa_Initialize() != paNoError ) {
         fprintf(stderr,"error: failed to initialize port audio\n");
         exit(-1);
     }
     
+    audiocap_w.start();
     std::thread updReceiverThread(udpreceiver);
-    std::thread recorderThread(recorder);
-    std::thread playerThread(player);
-    recorderThread.join();
-    playerThread.join();
+    std::thread duplexThread(duplex);
+    duplexThread.join();
 }
 
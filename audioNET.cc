@@ -0,0 +1,301 @@
+/** @file audioNET.cc
+	@brief UDP relay between audioMUX and audioSERV that impairs the traffic reproducibly
+	@author Andreas-Joachim Peters
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+#include "audiobuffer.hpp"
+#include "audioimpair.hpp"
+
+#define RELAY_BATCH     (32)
+#define RELAY_SESSIONS  (64)     /* client addresses relayed at the same time */
+#define RELAY_REPORT_S  (5)
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int)
+{
+    running = 0;
+}
+
+// a client address and the socket that relays it to the server
+struct session {
+    struct sockaddr_in client;
+    audiosocket upstream;
+};
+
+// a datagram waiting for its release time
+struct pending {
+    uint64_t release;
+    uint64_t order;            // ties keep arrival order
+    audiosocket* sock;
+    struct sockaddr_in dest;
+    bool upstream;
+    std::vector<unsigned char> data;
+
+    bool operator>(const pending& o) const {
+        return (release != o.release) ? (release > o.release) : (order > o.order);
+    }
+};
+
+typedef std::priority_queue<pending, std::vector<pending>, std::greater<pending>> pendingqueue;
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: audioNET [options]\n"
+            "  --listen PORT             port audioMUX sends to (8081)\n"
+            "  --server HOST:PORT        audioSERV (127.0.0.1:8080)\n"
+            "  --seed N                  generator seed (1)\n"
+            "  --delay MS                one-way delay\n"
+            "  --jitter MS               delay spread\n"
+            "  --dist uniform|normal|pareto\n"
+            "  --loss P                  random loss probability\n"
+            "  --ge P,R[,LOSSBAD[,LOSSGOOD]]  Gilbert-Elliott burst loss\n"
+            "  --reorder P[,MS]          hold back a packet by MS (10) with probability P\n"
+            "  --dup P                   duplicate with probability P\n"
+            "  --rate KBPS[,QUEUEMS]     link rate and drop tail queue (200ms)\n"
+            "  --direction up|down|both  which way to impair (both)\n"
+            "  --record FILE             write the decisions of this run\n"
+            "  --replay FILE             take the decisions from a recording\n");
+}
+
+static void report(const char* dir, const audioimpair& m)
+{
+    printf("relay: dir=%s packets=%lu lost=%lu burst=%lu duplicated=%lu reordered=%lu queue-dropped=%lu\n",
+           dir, m.n_packets, m.n_lost, m.n_burst, m.n_duplicated, m.n_reordered, m.n_queue_dropped);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    audioimpairconfig config;
+    uint64_t seed = 1;
+    int listenport = 8081;
+    std::string server = "127.0.0.1";
+    int serverport = 8080;
+    std::string direction = "both";
+    const char* recordpath = 0;
+    const char* replaypath = 0;
+
+    static struct option options[] = {
+        {"listen", required_argument, 0, 'l'},
+        {"server", required_argument, 0, 's'},
+        {"seed", required_argument, 0, 'S'},
+        {"delay", required_argument, 0, 'd'},
+        {"jitter", required_argument, 0, 'j'},
+        {"dist", required_argument, 0, 'D'},
+        {"loss", required_argument, 0, 'p'},
+        {"ge", required_argument, 0, 'g'},
+        {"reorder", required_argument, 0, 'o'},
+        {"dup", required_argument, 0, 'u'},
+        {"rate", required_argument, 0, 'r'},
+        {"direction", required_argument, 0, 'w'},
+        {"record", required_argument, 0, 'R'},
+        {"replay", required_argument, 0, 'P'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", options, 0)) != -1) {
+        switch (c) {
+        case 'l': listenport = atoi(optarg); break;
+        case 's': {
+            std::string s = optarg;
+            size_t colon = s.find(':');
+            server = s.substr(0, colon);
+            if (colon != std::string::npos) {
+                serverport = atoi(s.c_str() + colon + 1);
+            }
+            break;
+        }
+        case 'S': seed = strtoull(optarg, 0, 10); break;
+        case 'd': config.delay_ms = atof(optarg); break;
+        case 'j': config.jitter_ms = atof(optarg); break;
+        case 'D':
+            if (!strcmp(optarg, "uniform")) config.distribution = audioimpairconfig::eUniform;
+            else if (!strcmp(optarg, "normal")) config.distribution = audioimpairconfig::eNormal;
+            else if (!strcmp(optarg, "pareto")) config.distribution = audioimpairconfig::ePareto;
+            else { usage(); return -1; }
+            break;
+        case 'p': config.loss_good = atof(optarg); break;
+        case 'g':
+            if (sscanf(optarg, "%lf,%lf,%lf,%lf", &config.ge_p, &config.ge_r, &config.loss_bad, &config.loss_good) < 2) {
+                usage();
+                return -1;
+            }
+            break;
+        case 'o': sscanf(optarg, "%lf,%lf", &config.reorder, &config.reorder_ms); break;
+        case 'u': config.duplicate = atof(optarg); break;
+        case 'r': sscanf(optarg, "%lf,%lf", &config.rate_kbps, &config.queue_ms); break;
+        case 'w': direction = optarg; break;
+        case 'R': recordpath = optarg; break;
+        case 'P': replaypath = optarg; break;
+        default:
+            usage();
+            return (c == 'h') ? 0 : -1;
+        }
+    }
+
+    // each direction has its own generator, so the uplink does not shift the downlink's decisions
+    audioimpairconfig clean;
+    audioimpair up, down;
+    up.configure((direction == "down") ? clean : config, seed);
+    down.configure((direction == "up") ? clean : config, seed ^ 0x5a5a5a5a5a5a5a5aull);
+    if (replaypath && (up.replay(replaypath, 'u') || down.replay(replaypath, 'd'))) {
+        return -1;
+    }
+    FILE* trace = 0;
+    if (recordpath && !(trace = fopen(recordpath, "w"))) {
+        fprintf(stderr,"error: cannot write trace %s\n", recordpath);
+        return -1;
+    }
+
+    audiosocket listener;
+    if (listener.bind(listenport)) {
+        return -1;
+    }
+    struct sockaddr_in serveraddr;
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(serverport);
+    serveraddr.sin_addr.s_addr = inet_addr(server.c_str());
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    printf("relay: listening on %d, forwarding to %s:%d, %s=%s\n", listenport, server.c_str(), serverport,
+           replaypath ? "replay" : "seed", replaypath ? replaypath : std::to_string(seed).c_str());
+    fflush(stdout);
+
+    std::vector<std::unique_ptr<session>> sessions;
+    pendingqueue queue;
+    uint64_t order = 0;
+    std::vector<audiopacket_t> packets(RELAY_BATCH);
+    uint64_t lastreport = audioclock::now();
+
+    while (running) {
+        uint64_t now = audioclock::now();
+        while (!queue.empty() && (queue.top().release <= now)) {
+            const pending& p = queue.top();
+            if (p.upstream) {
+                p.sock->send((void*) p.data.data(), p.data.size());
+            } else {
+                p.sock->sendto((void*) p.data.data(), p.data.size(), p.dest);
+            }
+            queue.pop();
+        }
+
+        std::vector<struct pollfd> fds(1 + sessions.size());
+        fds[0].fd = listener.fd();
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            fds[i + 1].fd = sessions[i]->upstream.fd();
+            fds[i + 1].events = POLLIN;
+        }
+        struct timespec timeout = {0, 100000000};
+        if (!queue.empty()) {
+            uint64_t wait = queue.top().release - now;
+            timeout.tv_sec = wait / 1000000000ull;
+            timeout.tv_nsec = wait % 1000000000ull;
+        }
+        if (ppoll(fds.data(), fds.size(), &timeout, 0) <= 0) {
+            continue;
+        }
+        now = audioclock::now();
+
+        // client -> server
+        if (fds[0].revents & POLLIN) {
+            int n = listener.receive(packets.data(), RELAY_BATCH);
+            for (int i = 0; i < n; ++i) {
+                session* s = 0;
+                for (auto& it : sessions) {
+                    if ((it->client.sin_addr.s_addr == packets[i].peer.sin_addr.s_addr) && (it->client.sin_port == packets[i].peer.sin_port)) {
+                        s = it.get();
+                        break;
+                    }
+                }
+                if (!s) {
+                    if (sessions.size() >= RELAY_SESSIONS) {
+                        continue;
+                    }
+                    sessions.emplace_back(new session());
+                    s = sessions.back().get();
+                    s->client = packets[i].peer;
+                    if (s->upstream.connect(server, "relay", serverport)) {
+                        sessions.pop_back();
+                        continue;
+                    }
+                    printf("relay: new client %s:%d\n", inet_ntoa(s->client.sin_addr), ntohs(s->client.sin_port));
+                }
+                audioimpairdecision d = up.decide();
+                if (trace) {
+                    audioimpair::record(trace, 'u', d);
+                }
+                for (int k = 0; k < d.copies; ++k) {
+                    pending p;
+                    if (up.schedule(d, packets[i].bytes, now, p.release)) {
+                        continue;
+                    }
+                    p.order = order++;
+                    p.sock = &s->upstream;
+                    p.dest = serveraddr;
+                    p.upstream = true;
+                    p.data.assign(packets[i].data, packets[i].data + packets[i].bytes);
+                    queue.push(std::move(p));
+                }
+            }
+        }
+
+        // server -> client
+        for (size_t j = 1; j < fds.size(); ++j) {
+            if (!(fds[j].revents & POLLIN)) {
+                continue;
+            }
+            session* s = sessions[j - 1].get();
+            int n = s->upstream.receive(packets.data(), RELAY_BATCH);
+            for (int i = 0; i < n; ++i) {
+                audioimpairdecision d = down.decide();
+                if (trace) {
+                    audioimpair::record(trace, 'd', d);
+                }
+                for (int k = 0; k < d.copies; ++k) {
+                    pending p;
+                    if (down.schedule(d, packets[i].bytes, now, p.release)) {
+                        continue;
+                    }
+                    p.order = order++;
+                    p.sock = &listener;
+                    p.dest = s->client;
+                    p.upstream = false;
+                    p.data.assign(packets[i].data, packets[i].data + packets[i].bytes);
+                    queue.push(std::move(p));
+                }
+            }
+        }
+
+        if (now - lastreport >= RELAY_REPORT_S * 1000000000ull) {
+            report("up", up);
+            report("down", down);
+            lastreport = now;
+        }
+    }
+
+    report("up", up);
+    report("down", down);
+    if (trace) {
+        fclose(trace);
+    }
+    listener.disconnect();
+    return 0;
+}
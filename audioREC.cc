@@ -0,0 +1,346 @@
+/** @file audioREC.cc
+	@brief Convert an audioSERV room recording into one Ogg Opus file per participant
+	@author Andreas-Joachim Peters
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "audiorecord.hpp"
+
+#define REORDER_FRAMES  (32)     /* frames held back to put reordered datagrams in place */
+#define RESTART_FRAMES  (4000)   /* a larger sequence jump is a restarted sender */
+#define PAGE_BYTES      (4096)   /* Ogg page payload before a page is written */
+
+void usage()
+{
+    fprintf(stderr,"usage: audioREC [-l] <recording> [start-s]\n"
+                   "       writes <recording>-<participant>.opus per track, from <start-s> seconds on\n"
+                   "       -l lists the tracks only\n");
+}
+
+// Ogg pages of one logical stream (RFC 3533); packets never span pages
+class oggstream {
+public:
+    oggstream(FILE* _f, uint32_t _serial) : f(_f), serial(_serial), pageno(0), granule(0), bos(true) {}
+
+    void packet(const unsigned char* data, size_t len, uint64_t _granule) {
+        size_t segments = len / 255 + 1;
+        if (lacing.size() + segments > 255) {
+            page(false);
+        }
+        for (size_t n = len; ; n -= 255) {
+            lacing.push_back((n >= 255) ? 255 : n);
+            if (n < 255) {
+                break;
+            }
+        }
+        body.insert(body.end(), data, data + len);
+        granule = _granule;
+        if (body.size() >= PAGE_BYTES) {
+            page(false);
+        }
+    }
+
+    // write what is buffered, the header packets each get a page of their own
+    void page(bool eos) {
+        if (lacing.empty() && !eos) {
+            return;
+        }
+        unsigned char h[27 + 255];
+        memcpy(h, "OggS", 4);
+        h[4] = 0;
+        h[5] = (bos ? 0x02 : 0) | (eos ? 0x04 : 0);
+        for (int i = 0; i < 8; ++i) {
+            h[6 + i] = granule >> (8*i);
+        }
+        for (int i = 0; i < 4; ++i) {
+            h[14 + i] = serial >> (8*i);
+            h[18 + i] = pageno >> (8*i);
+            h[22 + i] = 0;
+        }
+        h[26] = lacing.size();
+        memcpy(h + 27, lacing.data(), lacing.size());
+        size_t hlen = 27 + lacing.size();
+        uint32_t crc = crc32(0, h, hlen);
+        crc = crc32(crc, body.data(), body.size());
+        for (int i = 0; i < 4; ++i) {
+            h[22 + i] = crc >> (8*i);
+        }
+        fwrite(h, 1, hlen, f);
+        fwrite(body.data(), 1, body.size(), f);
+        pageno++;
+        bos = false;
+        lacing.clear();
+        body.clear();
+    }
+
+private:
+    // the Ogg CRC: polynomial 0x04c11db7, not reflected, no final xor
+    static uint32_t crc32(uint32_t crc, const unsigned char* p, size_t n) {
+        static uint32_t table[256];
+        if (!table[1]) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t r = i << 24;
+                for (int k = 0; k < 8; ++k) {
+                    r = (r & 0x80000000u) ? (r << 1) ^ 0x04c11db7u : (r << 1);
+                }
+                table[i] = r;
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            crc = (crc << 8) ^ table[((crc >> 24) ^ p[i]) & 0xff];
+        }
+        return crc;
+    }
+
+    FILE* f;
+    uint32_t serial;
+    uint32_t pageno;
+    uint64_t granule;
+    bool bos;
+    std::vector<uint8_t> lacing;
+    std::vector<unsigned char> body;
+};
+
+// one participant: frames back in sequence, gaps and DTX filled with empty Opus frames
+struct track {
+    track(FILE* f, uint16_t _id) : id(_id), ogg(f, 0x61756d00u | _id), started(false), next(0), last(0),
+                                    shift(0), highest(0), t_last(0), toc(0), samples(0), frames(0),
+                                    filled(0), datagrams(0), file(f) {}
+
+    uint16_t id;
+    oggstream ogg;
+    bool started;
+    uint64_t next;        // next frame to write
+    uint64_t last;        // unwrap reference
+    int64_t shift;        // maps the sender's frames onto the track after a restart
+    uint64_t highest;     // including the frames a DTX keepalive skipped
+    uint64_t t_last;
+    unsigned char toc;    // of the last packet, the fill frames repeat its mode
+    uint64_t samples;     // per frame at 48 kHz, the Opus granule rate
+    uint64_t frames;
+    uint64_t filled;
+    uint64_t datagrams;
+    FILE* file;
+    std::map<uint64_t, std::vector<unsigned char>> pending;
+};
+
+// TOC of a CELT fullband frame of the recorded frame size, until the track has its own
+static unsigned char toc(const audiorecordhdr_t& h)
+{
+    uint64_t us = 1000000ull * h.framesize / h.samplingrate;
+    int config = (us <= 2500) ? 28 : (us <= 5000) ? 29 : (us <= 10000) ? 30 : 31;
+    return (config << 3) | ((h.channels > 1) ? 0x04 : 0);
+}
+
+static void emit(track& t, const unsigned char* data, size_t len)
+{
+    t.ogg.packet(data, len, (t.next + 1) * t.samples);
+    t.next++;
+}
+
+// an Opus packet of one empty frame decodes as lost, the decoder conceals or fades to silence
+static void fill(track& t, uint64_t upto)
+{
+    unsigned char empty = t.toc & 0xfc;
+    while (t.next < upto) {
+        emit(t, &empty, 1);
+        t.filled++;
+    }
+}
+
+static void drain(track& t, size_t keep)
+{
+    while (t.pending.size() > keep) {
+        auto it = t.pending.begin();
+        fill(t, it->first);
+        t.toc = it->second[0];
+        emit(t, it->second.data(), it->second.size());
+        t.frames++;
+        t.pending.erase(it);
+    }
+}
+
+static void header(track& t, const audiorecordhdr_t& h)
+{
+    unsigned char head[19];
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1;
+    head[9] = h.channels;
+    head[10] = head[11] = 0;                 // pre-skip unknown, the encoder lookahead plays along
+    uint32_t rate = h.samplingrate;
+    for (int i = 0; i < 4; ++i) {
+        head[12 + i] = rate >> (8*i);
+    }
+    head[16] = head[17] = 0;                 // gain
+    head[18] = 0;                            // mono or stereo, no mapping table
+    t.ogg.packet(head, sizeof(head), 0);
+    t.ogg.page(false);
+
+    std::string vendor = "audiomux";
+    std::vector<std::string> comments = {
+        "ROOM=" + std::to_string(h.room),
+        "PARTICIPANT=" + std::to_string(t.id)
+    };
+    std::vector<unsigned char> tags(8);
+    memcpy(tags.data(), "OpusTags", 8);
+    auto put32 = [&tags](uint32_t v) {
+        for (int i = 0; i < 4; ++i) {
+            tags.push_back(v >> (8*i));
+        }
+    };
+    put32(vendor.size());
+    tags.insert(tags.end(), vendor.begin(), vendor.end());
+    put32(comments.size());
+    for (auto& c : comments) {
+        put32(c.size());
+        tags.insert(tags.end(), c.begin(), c.end());
+    }
+    t.ogg.packet(tags.data(), tags.size(), 0);
+    t.ogg.page(false);
+}
+
+int main(int argc, char* argv[])
+{
+    bool list = false;
+    int c;
+    while ((c = getopt(argc, argv, "lh")) != -1) {
+        switch (c) {
+        case 'l': list = true; break;
+        default: usage(); return -1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return -1;
+    }
+    std::string path = argv[optind];
+    double start_s = (optind + 1 < argc) ? atof(argv[optind + 1]) : 0;
+
+    audiorecording rec;
+    if (rec.open(path.c_str())) {
+        return -1;
+    }
+    const audiorecordhdr_t& h = rec.header();
+    if (!h.samplingrate || !h.framesize) {
+        fprintf(stderr,"error: %s has no frame format\n", path.c_str());
+        return -1;
+    }
+    const uint64_t frame_ns = 1000000000ull * h.framesize / h.samplingrate;
+    // every track starts at the same point in time, the later ones with silence
+    const uint64_t t_origin = h.t_start + (uint64_t) (start_s * 1e9);
+    int64_t offset = start_s ? rec.seek(t_origin) : rec.next(0);
+
+    std::string prefix = path;
+    if ((prefix.size() > 4) && (prefix.compare(prefix.size() - 4, 4, ".rec") == 0)) {
+        prefix.resize(prefix.size() - 4);
+    }
+
+    std::map<uint16_t, std::unique_ptr<track>> tracks;
+    uint64_t records = 0;
+    uint64_t malformed = 0;
+    for (; offset >= 0; offset = rec.next(rec.skip(offset))) {
+        const audiorecord_t* r = rec.record(offset);
+        records++;
+        audiowire_t wire;
+        audiowire_t frames[AUDIO_WIRE_MAX_FRAMES];
+        int k = 0;
+        if (audiowire::parse(rec.datagram(offset), r->bytes, wire) ||
+            (!(wire.flags & AUDIO_WIRE_FLAG_DTX) &&
+             ((k = audiowire::split(wire, frames, AUDIO_WIRE_MAX_FRAMES, h.framesize)) < 1))) {
+            malformed++;
+            continue;
+        }
+
+        auto it = tracks.find(r->id);
+        if (it == tracks.end()) {
+            FILE* f = 0;
+            if (!list) {
+                std::string name = prefix + "-" + std::to_string(r->id) + ".opus";
+                f = fopen(name.c_str(), "w");
+                if (!f) {
+                    fprintf(stderr,"error: cannot create %s\n", name.c_str());
+                    return -1;
+                }
+            }
+            it = tracks.emplace(r->id, std::unique_ptr<track>(new track(f, r->id))).first;
+            it->second->samples = 48000ull * h.framesize / h.samplingrate;
+            it->second->toc = toc(h);
+            if (f) {
+                header(*it->second, h);
+            }
+        }
+        track& t = *it->second;
+        t.datagrams++;
+
+        uint64_t first = audiowire::unwrap(wire.seq, t.last);
+        t.last = first;
+        if (!t.started) {
+            // the first frame lands where its receive time puts it
+            uint64_t at = (r->t_ns > t_origin) ? (r->t_ns - t_origin) / frame_ns : 0;
+            t.shift = (int64_t) at - (int64_t) first;
+            t.next = 0;
+            t.started = true;
+        } else {
+            int64_t mapped = (int64_t) first + t.shift;
+            if ((mapped + RESTART_FRAMES < (int64_t) t.next) || (mapped > (int64_t) t.highest + RESTART_FRAMES)) {
+                // the sender restarted: continue where the receive time says
+                uint64_t at = t.highest + 1 + ((r->t_ns > t.t_last) ? (r->t_ns - t.t_last) / frame_ns : 0);
+                t.shift = (int64_t) at - (int64_t) first;
+            }
+        }
+        t.t_last = r->t_ns;
+
+        // signed: a datagram sent before the track's first record maps in front of the track
+        int64_t mapped = (int64_t) first + t.shift;
+        if (wire.flags & AUDIO_WIRE_FLAG_DTX) {
+            // the frames up to this one were skipped, the next fill covers them
+            if ((mapped >= (int64_t) t.next) && ((uint64_t) mapped > t.highest)) {
+                t.highest = mapped;
+            }
+            continue;
+        }
+        for (int j = 0; j < k; ++j, ++mapped) {
+            if ((mapped < (int64_t) t.next) || !frames[j].len) {
+                continue;
+            }
+            uint64_t frame = mapped;
+            if (t.pending.count(frame)) {
+                continue;
+            }
+            if (frame > t.highest) {
+                t.highest = frame;
+            }
+            if (!list) {
+                t.pending.emplace(frame, std::vector<unsigned char>(frames[j].payload, frames[j].payload + frames[j].len));
+            } else {
+                t.frames++;
+            }
+        }
+        if (!list) {
+            drain(t, REORDER_FRAMES);
+        }
+    }
+
+    fprintf(stdout,"recording: room=%u rate=%u channels=%u frame=%u records=%lu malformed=%lu tracks=%lu\n",
+            h.room, h.samplingrate, h.channels, h.framesize, records, malformed, tracks.size());
+    for (auto& it : tracks) {
+        track& t = *it.second;
+        if (!list) {
+            drain(t, 0);
+            // a trailing silence is part of the track
+            fill(t, t.highest + 1);
+            t.ogg.page(true);
+            fclose(t.file);
+        }
+        fprintf(stdout,"track: participant=%u datagrams=%lu frames=%lu filled=%lu length=%.03fs\n",
+                t.id, t.datagrams, t.frames, t.filled, (t.highest + 1) * frame_ns / 1e9);
+    }
+    return 0;
+}
@@ -1,63 +1,238 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include "portaudio.h"
 #include "audiobuffer.hpp"
+#include "audioroom.hpp"
+#include "audioclock.hpp"
+#include "audiostats.hpp"
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <thread>
+#include <vector>
+#include <memory>
 
 #define SAMPLE_RATE  (48000)
 #define MPEG_BIT_RATE 192000
 #define FRAMES_PER_BUFFER (120)
 #define NUM_CHANNELS    (2)
+#define RECEIVE_BATCH   (32)   /* datagrams per recvmmsg */
+#define WORKERS         (0)    /* receive and mix workers pinned per core, 0: one per cpu */
+#define MAX_QUEUE       (8)    /* frames per participant before the mixer drops */
+#define MAX_ROOMS       (64)   /* simultaneous rooms */
+#define ROOM_PARTICIPANTS (32) /* preallocated codec states per room */
+#define ROOM_BUFFERS    (1024) /* slab per room, enough for all participant queues */
+#define EVICT_INTERVAL_S (1)   /* idle session sweep and room rebalancing */
+#define MAX_CATCHUP     (4)    /* mix ticks made up after a late wakeup */
+#define RECORD_DIR      ""     /* record every room into this directory, "" disables */
+#define HOUSEKEEPING_MS (100)  /* preallocation of the recordings, well ahead of the tail; new rooms wake it up */
 typedef short SAMPLE;
 
-audiobuffermanager audiomanager;
-audioqueue audioq;
-audiocodec audiocoder;
-audiosocket audiosock;
+std::vector<std::unique_ptr<audiosocket>> audiosock;  // one per worker, receives its steered participants and sends the mixes of its rooms
+audiorooms rooms;
+audiostats stats;  // exported to /dev/shm/audioserv, see audioSTAT
 
-void udpreceiver()
+// one batch of datagrams of a worker socket
+void udpreceive(int worker, std::vector<audiopacket_t>& udpaudio)
 {
-    size_t lastframe=0;
-    do {
-        audiobuffermanager::shared_buffer audio = audiomanager.get_buffer();
-        struct audio_t* udpaudio = audiosock.receive();
-        if (udpaudio) {
-            fprintf(stdout,"frame=%lu last-frame=%lu diff=%d\n", udpaudio->frame, lastframe, udpaudio->frame-lastframe);
-            lastframe = udpaudio->frame;
-            audio->udp2mpeg(udpaudio);
-            audioq.add_output(audio);
-        } else {
-            fprintf(stdout,"udpreceive failed ...\n");
+    audiopacket_t pong;
+    int n = audiosock[worker]->receive(udpaudio.data(), RECEIVE_BATCH);
+    // receive time of the whole batch, the clients measure the rest as round trip
+    uint64_t t2 = audioclock::now();
+    if (n <= 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            AUDIO_LOG_RATE(AUDIO_LOG_WARNING, 1, "udpreceive failed errno=%d", errno);
         }
-    } while(1);
+        return;
+    }
+    for (int i = 0; i < n; ++i) {
+        audiowire_t wire;
+        if (audiowire::parse(&udpaudio[i], wire)) {
+            continue;
+        }
+        if (wire.flags & AUDIO_WIRE_FLAG_PING) {
+            int len = audioclock::answer(&pong, wire, t2);
+            if (len > 0) {
+                audiosock[worker]->sendto(pong.data, len, udpaudio[i].peer);
+            }
+            continue;
+        }
+        // only audio frames open a room: a report or a keepalive of a room that is not open
+        // is dropped without allocating a slab and codec states for it
+        const bool audio = !(wire.flags & (AUDIO_WIRE_FLAG_REPORT | AUDIO_WIRE_FLAG_PONG | AUDIO_WIRE_FLAG_DTX));
+        audiorooms::shared_room room = audio ? rooms.room(wire.room) : rooms.find(wire.room);
+        if (!room) {
+            continue;
+        }
+        if (wire.flags & AUDIO_WIRE_FLAG_REPORT) {
+            room->mixer.report(wire, udpaudio[i].peer);
+            continue;
+        }
+        AUDIO_DEBUG("room=%u id=%u frame=%u", wire.room, wire.id, wire.seq);
+        // the datagram as it came, a copy into preallocated space
+        room->recorder.record(udpaudio[i], wire.id, t2);
+        room->mixer.add(wire, udpaudio[i].peer);
+    }
+    stats.record(audiostats::eReceive, audioclock::now() - t2);
 }
 
-void udpsender()
+// periodic timer on the monotonic clock, registered with <epfd>; returns the fd or -1
+int addtimer(int epfd, long period_ns)
 {
-    while (!audioq.output_size()) {
-        Pa_Sleep(2);
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct itimerspec period;
+    period.it_interval.tv_sec = period.it_value.tv_sec = period_ns / 1000000000l;
+    period.it_interval.tv_nsec = period.it_value.tv_nsec = period_ns % 1000000000l;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (timerfd_settime(fd, 0, &period, 0) || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        close(fd);
+        return -1;
     }
-    audiobuffermanager::shared_buffer audio = audioq.get_output();
-    audio->mpeg2udp(audiosock);
+    return fd;
 }
 
+// expirations since the last read, 0 if none
+uint64_t expired(int fd)
+{
+    uint64_t expirations = 0;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return 0;
+    }
+    return expirations;
+}
+
+void worker(int id, int ncpu)
+{
+    // each participant is steered to one worker, so it stays a single producer for its
+    // queues; each room is mixed by one worker, the single consumer
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % ncpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        AUDIO_ERROR("worker %d: epoll_create1 failed errno=%d", id, errno);
+        return;
+    }
 
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = audiosock[id]->fd();
+    if (audiosock[id]->set_nonblocking() ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev)) {
+        AUDIO_ERROR("worker %d: cannot poll socket errno=%d", id, errno);
+        close(epfd);
+        return;
+    }
+
+    // one mix per frame period, the timer keeps the deadlines absolute
+    int mixfd = addtimer(epfd, 1000000000l * FRAMES_PER_BUFFER / SAMPLE_RATE);
+    if (mixfd < 0) {
+        AUDIO_ERROR("worker %d: cannot arm the mix timer errno=%d", id, errno);
+        close(epfd);
+        return;
+    }
+    // the first worker also sweeps idle sessions and rebalances the rooms
+    int sweepfd = -1;
+    if (!id) {
+        sweepfd = addtimer(epfd, EVICT_INTERVAL_S * 1000000000l);
+        if (sweepfd < 0) {
+            AUDIO_ERROR("worker %d: cannot arm the eviction timer errno=%d", id, errno);
+        }
+    }
+
+    std::vector<audiopacket_t> udpaudio(RECEIVE_BATCH);
+    struct epoll_event events[3];
+    do {
+        int n = epoll_wait(epfd, events, 3, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                AUDIO_LOG_RATE(AUDIO_LOG_WARNING, 1, "worker %d: epoll_wait failed errno=%d", id, errno);
+            }
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == mixfd) {
+                // catch up after a late wakeup, beyond MAX_CATCHUP the ticks are lost
+                uint64_t ticks = expired(mixfd);
+                if (ticks > MAX_CATCHUP) {
+                    AUDIO_LOG_RATE(AUDIO_LOG_WARNING, 1, "worker %d: skipped %lu mix ticks", id, ticks - MAX_CATCHUP);
+                    ticks = MAX_CATCHUP;
+                }
+                for (uint64_t t = 0; t < ticks; ++t) {
+                    rooms.mix(id, *audiosock[id]);
+                }
+            } else if (events[i].data.fd == sweepfd) {
+                if (expired(sweepfd)) {
+                    rooms.sweep(AUDIO_SESSION_TIMEOUT_MS);
+                    rooms.rebalance();
+                }
+            } else {
+                // level triggered: a full batch leaves the socket readable for the next round
+                udpreceive(id, udpaudio);
+            }
+        }
+    } while(1);
+}
+
+// building rooms and the file system calls of the recordings stay off the receive and mix workers
+void housekeeping()
+{
+    do {
+        rooms.housekeeping(HOUSEKEEPING_MS);
+    } while(1);
+}
 
 int main()
 {
-    if (audiosock.bind()) {
-        exit(-1);
+    audiolog::instance().start();
+    int ncpu = std::thread::hardware_concurrency();
+    int workers = WORKERS ? WORKERS : ncpu;
+    if (ncpu < 1) {
+        ncpu = 1;
+    }
+    if ((workers < 1) || (workers > CPU_SETSIZE)) {
+        workers = 1;
+    }
+    
+    for (int i = 0; i < workers; ++i) {
+        audiosock.emplace_back(new audiosocket());
+        if (audiosock[i]->bind(8080, workers > 1)) {
+            exit(-1);
+        }
     }
-        
-    audiomanager.configure(SAMPLE_RATE/FRAMES_PER_BUFFER, SAMPLE_RATE, NUM_CHANNELS, FRAMES_PER_BUFFER, sizeof(SAMPLE) );
-    audiomanager.reserve(SAMPLE_RATE/FRAMES_PER_BUFFER);
-    audiocoder.configure(SAMPLE_RATE, NUM_CHANNELS, MPEG_BIT_RATE );
+    if (workers > 1) {
+        // without the program the kernel hashes the 4-tuple, still one worker per participant
+        audiosock[0]->steer(workers);
+    }
+    AUDIO_INFO("%d workers on %d cpus", workers, ncpu);
+
+    rooms.configure(workers, MAX_ROOMS, SAMPLE_RATE, NUM_CHANNELS, FRAMES_PER_BUFFER, MPEG_BIT_RATE,
+                    MAX_QUEUE, ROOM_PARTICIPANTS, ROOM_BUFFERS);
+    stats.open("audioserv");
+    rooms.set_stats(&stats);
+    if (strlen(RECORD_DIR)) {
+        rooms.set_recording(RECORD_DIR);
+    }
+    std::thread(housekeeping).detach();
     
-    std::thread updReceiverThread(udpreceiver);
-    std::thread udpSenderThread(udpsender);
+    std::vector<std::thread> workerThreads;
+    for (int i = 0; i < workers; ++i) {
+        workerThreads.emplace_back(worker, i, ncpu);
+    }
     
-    updReceiverThread.join();
-    udpSenderThread.join();
+    for (auto& t : workerThreads) {
+        t.join();
+    }
 }
@@ -0,0 +1,41 @@
+/** @file audioSTAT.cc
+	@brief Print the latency histograms and counters exported by audioMUX or audioSERV
+	@author Andreas-Joachim Peters
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "audiostats.hpp"
+
+void usage()
+{
+    fprintf(stderr,"usage: audioSTAT [audiomux|audioserv|<segment>] [interval-s]\n"
+                   "       prints the segment once, or every <interval-s> seconds\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* name = (argc > 1) ? argv[1] : "audiomux";
+    int interval = (argc > 2) ? atoi(argv[2]) : 0;
+
+    if ((argc > 1) && (argv[1][0] == '-')) {
+        usage();
+        return -1;
+    }
+
+    audiostats stats;
+    if (stats.attach(name)) {
+        return -1;
+    }
+
+    do {
+        fprintf(stdout,"=== %s pid=%u\n", name, stats.get()->pid);
+        stats.print(stdout);
+        fflush(stdout);
+        if (interval > 0) {
+            sleep(interval);
+        }
+    } while (interval > 0);
+    return 0;
+}
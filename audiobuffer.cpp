@@ -6,79 +6,268 @@
 //
 
 #include "audiobuffer.hpp"
+#include <new>
+#include <linux/filter.h>
+#include <fcntl.h>
 
 
 
 int
-audiocodec::configure(int samplingrate, int channels, int bitrate)
+audiocodec::configure(int samplingrate, int channels, int bitrate, int loss_perc)
 {
+    int err = decoder.configure(samplingrate, channels);
+    if (err) {
+        return err;
+    }
+    return encoder.configure(samplingrate, channels, bitrate, loss_perc);
+}
+
+int
+audioencoder::configure(int samplingrate, int channels, int bitrate, int loss_perc)
+{
+    release();
+    
     int err=0;
-    decoder = opus_decoder_create(samplingrate, channels, &err);
+    state = opus_encoder_create(samplingrate, channels, OPUS_APPLICATION_RESTRICTED_LOWDELAY, &err);
     
     if(err!=OPUS_OK) {
-        fprintf(stderr,"error: failed to create decoder\n");
+        fprintf(stderr,"error: failed to create encoder\n");
+        state = 0;
         return err;
     }
     
-    encoder = opus_encoder_create(samplingrate, channels, OPUS_APPLICATION_RESTRICTED_LOWDELAY, &err);
+    if(opus_encoder_ctl(get(), OPUS_SET_BITRATE(bitrate)) != OPUS_OK) {
+        fprintf(stderr,"error: failed to set encoder bit rate\n");
+    }
+    
+    if (loss_perc && set_fec(loss_perc)) {
+        fprintf(stderr,"error: failed to enable in-band FEC\n");
+    }
+    return 0;
+}
+
+void
+audioencoder::release()
+{
+    if (!state) {
+        return;
+    }
+    if (arena) {
+        arena->checkin(*this);
+    } else {
+        opus_encoder_destroy(get());
+    }
+    state = 0;
+    arena = 0;
+}
+
+int
+audiodecoder::configure(int samplingrate, int channels)
+{
+    release();
+    
+    int err=0;
+    state = opus_decoder_create(samplingrate, channels, &err);
     
     if(err!=OPUS_OK) {
-        fprintf(stderr,"error: failed to create encoder\n");
+        fprintf(stderr,"error: failed to create decoder\n");
+        state = 0;
         return err;
     }
+    return 0;
+}
+
+void
+audiodecoder::release()
+{
+    if (!state) {
+        return;
+    }
+    if (arena) {
+        arena->checkin(*this);
+    } else {
+        opus_decoder_destroy(get());
+    }
+    state = 0;
+    arena = 0;
+}
+
+int
+audiocodecarena::configure(size_t _encoders, size_t _decoders, int _samplingrate, int _channels, int _bitrate)
+{
+    if (slab) {
+        fprintf(stderr,"error: codec arena is already configured\n");
+        return -1;
+    }
     
-    if(opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate)) != OPUS_OK) {
-        fprintf(stderr,"error: failed to set encoder bit rate\n");
+    encoders = _encoders;
+    decoders = _decoders;
+    samplingrate = _samplingrate;
+    channels = _channels;
+    bitrate = _bitrate;
+    
+    // every state on its own cache lines
+    enc_stride = ((size_t)opus_encoder_get_size(channels) + 63) & ~((size_t)63);
+    dec_stride = ((size_t)opus_decoder_get_size(channels) + 63) & ~((size_t)63);
+    
+    void* mem = 0;
+    if (posix_memalign(&mem, 64, encoders * enc_stride + decoders * dec_stride)) {
+        fprintf(stderr,"error: failed to allocate codec arena for %lu encoders and %lu decoders\n", encoders, decoders);
+        return -1;
     }
+    slab = (unsigned char*) mem;
     
+    for (size_t i = 0; i < encoders; ++i) {
+        int err = opus_encoder_init(encoder_at(i), samplingrate, channels, OPUS_APPLICATION_RESTRICTED_LOWDELAY);
+        if (err != OPUS_OK) {
+            fprintf(stderr,"error: failed to initialise encoder %lu\n", i);
+            return err;
+        }
+        if (opus_encoder_ctl(encoder_at(i), OPUS_SET_BITRATE(bitrate)) != OPUS_OK) {
+            fprintf(stderr,"error: failed to set encoder bit rate\n");
+        }
+    }
+    for (size_t i = 0; i < decoders; ++i) {
+        int err = opus_decoder_init(decoder_at(i), samplingrate, channels);
+        if (err != OPUS_OK) {
+            fprintf(stderr,"error: failed to initialise decoder %lu\n", i);
+            return err;
+        }
+    }
+    
+    enc_free.configure(encoders);
+    dec_free.configure(decoders);
+    return 0;
+}
+
+int
+audiocodecarena::checkout(audioencoder& encoder)
+{
+    long i = enc_free.pop();
+    if (i < 0) {
+        n_exhausted++;
+        return -1;
+    }
+    encoder.release();
+    encoder.state = encoder_at(i);
+    encoder.arena = this;
+    encoder.index = i;
+    return 0;
+}
+
+int
+audiocodecarena::checkout(audiodecoder& decoder)
+{
+    long i = dec_free.pop();
+    if (i < 0) {
+        n_exhausted++;
+        return -1;
+    }
+    decoder.release();
+    decoder.state = decoder_at(i);
+    decoder.arena = this;
+    decoder.index = i;
     return 0;
 }
 
+void
+audiocodecarena::checkin(audioencoder& encoder)
+{
+    // forget the stream and any per-stream setting before the next checkout
+    encoder.reset();
+    encoder.set_fec(0);
+    opus_encoder_ctl(encoder.get(), OPUS_SET_BITRATE(bitrate));
+    enc_free.push(encoder.index);
+}
 
+void
+audiocodecarena::checkin(audiodecoder& decoder)
+{
+    decoder.reset();
+    dec_free.push(decoder.index);
+}
+
+int
+audiobuffermanager::reserve(size_t n)
+{
+    if (slab) {
+        if (n > frames) {
+            fprintf(stderr,"error: buffer slab is fixed at %lu frames\n", frames);
+            return -1;
+        }
+        return 0;
+    }
+    
+    if (n < max) {
+        n = max;
+    }
+    
+    // header, PCM and compressed payload, each on its own cache lines
+    size_t header = (sizeof(audiobuffer) + 63) & ~((size_t)63);
+    size_t pcmbytes = framesize * channels * samplesize;
+    size_t pcmspace = (pcmbytes + 63) & ~((size_t)63);
+    size_t mpegspace = (mpegsize + 63) & ~((size_t)63);
+    stride = header + pcmspace + mpegspace;
+    
+    void* mem = 0;
+    if (posix_memalign(&mem, 64, n * stride)) {
+        fprintf(stderr,"error: failed to allocate buffer slab of %lu frames\n", n);
+        return -1;
+    }
+    slab = (unsigned char*) mem;
+    frames = n;
+    
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char* base = slab + i * stride;
+        audiobuffer* buffer = new (base) audiobuffer(this, i,
+                                                     base + header, pcmbytes,
+                                                     base + header + pcmspace, mpegsize,
+                                                     samplingrate, channels, framesize, samplesize);
+        buffer->next.store(i, std::memory_order_relaxed);
+    }
+    // free list: n-1 -> n-2 -> ... -> 0
+    freehead.store(n, std::memory_order_release);
+    n_free = n;
+    return 0;
+}
 
 int
-audiobuffer::wav2mpeg(audiocodec& codec){
+audiobuffer::wav2mpeg(audioencoder& encoder){
     if (debug) {
-        fprintf(stdout,"info: capacity=%lu framesize=%lu\n", mpegbuffer.capacity(), framesize);
+        AUDIO_DEBUG("capacity=%lu framesize=%lu", mpegcapacity(), framesize);
     }
     
-    int len = opus_encode(codec.getEncoder(),
-                          (const opus_int16 *) ptr(),
-                          framesize,
-                          (unsigned char*) mpegptr(),
-                          mpegbuffer.capacity());
-    codec.releaseCodec();
+    int len = encoder.encode((const opus_int16 *) ptr(),
+                             framesize,
+                             (unsigned char*) mpegptr(),
+                             mpegcapacity());
     
     if (len < 0) {
-        fprintf(stderr,"error: encoder returned %d as len\n", len);
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "encoder returned %d as len", len);
     } else {
         if (debug) {
-            fprintf(stdout,"info: encoder returned %d as len\n", len);
+            AUDIO_DEBUG("encoder returned %d as len", len);
         }
         type = eMPEG;
     }
-    mpegbuffer.resize(len);
+    mpeg_size = (len > 0) ? len : 0;
     return len;
 }
 
 int
-audiobuffer::mpeg2wav(audiocodec& codec)
+audiobuffer::mpeg2wav(audiodecoder& decoder)
 {
-    if (1) {
-        fprintf(stdout,"info: capacity=%lu framesize=%lu output=%lu size=%lu\n", mpegbuffer.capacity(), framesize, capacity(), size());
+    if (debug) {
+        AUDIO_DEBUG("capacity=%lu framesize=%lu output=%lu size=%lu", mpegcapacity(), framesize, capacity(), size());
     }
     
-    int len = opus_decode(codec.getDecoder(),
-                          (const unsigned char*) mpegptr(),
-                          mpegbuffer.size(),
-                          (opus_int16 *) ptr(),
-                          framesize,
-                          0);
-    
-    codec.releaseCodec();
+    int len = decoder.decode((const unsigned char*) mpegptr(),
+                             mpegsize(),
+                             (opus_int16 *) ptr(),
+                             framesize);
     
     if (len != framesize) {
-        fprintf(stderr,"error: deocder returned %d as len\n", len);
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "decoder returned %d as len", len);
     } else {
         type = eWAV;
     }
@@ -86,29 +275,103 @@ audiobuffer::mpeg2wav(audiocodec& codec)
     return len;
 }
 
+int
+audiobuffer::fec2wav(audiodecoder& decoder, audiobuffer& next)
+{
+    if ((next.type != eMPEG) || !audiodecoder::has_fec(next.mpegptr(), next.mpegsize())) {
+        return -1;
+    }
+    
+    // decode_fec=1 returns the frame before <next>, <next> itself is decoded later
+    int len = decoder.decode((const unsigned char*) next.mpegptr(),
+                             next.mpegsize(),
+                             (opus_int16 *) ptr(),
+                             framesize,
+                             1);
+    if (len != (int)framesize) {
+        return -1;
+    }
+    type = eWAV;
+    return len;
+}
+
+int
+audiobuffer::plc2wav(audiodecoder& decoder)
+{
+    int len = decoder.conceal((opus_int16 *) ptr(), framesize);
+    if (len != (int)framesize) {
+        return -1;
+    }
+    type = eWAV;
+    return len;
+}
+
 int
 audiobuffer::mpeg2udp(audiosocket& audiosock)
 {
-    static struct audio_t sendbuffer;
-    sendbuffer.frame++;
-    if (mpegsize() > sizeof(sendbuffer.buffer)) {
+    static audiopacket_t sendbuffer;
+    
+    int len = audiowire::encode(&sendbuffer, 0, audiosock.id(), audiosock.nextseq(), mediatime, mpegptr(), mpegsize(), capturetime, audiosock.room());
+    if (len < 0) {
+        return -1;
+    }
+    
+    return audiosock.send((void*)sendbuffer.data, len);
+}
+
+int
+audiobuffer::mpeg2udp(audiopacket_t* packet, uint16_t id)
+{
+    // serialize into a caller owned packet, e.g. for audiosocket::queue;
+    // the caller numbers the frames per destination
+    return audiowire::encode(packet, 0, id, (uint32_t) frameindex, mediatime, mpegptr(), mpegsize(), capturetime);
+}
+
+int
+audiobuffer::mpeg2udp(audiosocket& audiosock, audiobuffer* const* frames, int k)
+{
+    static audiopacket_t sendbuffer;
+    
+    if ((k < 1) || (k > AUDIO_WIRE_MAX_FRAMES)) {
         return -1;
     }
+    const unsigned char* payloads[AUDIO_WIRE_MAX_FRAMES];
+    size_t lens[AUDIO_WIRE_MAX_FRAMES];
+    for (int i = 0; i < k; ++i) {
+        payloads[i] = frames[i]->mpegptr();
+        lens[i] = frames[i]->mpegsize();
+    }
     
-    snprintf(sendbuffer.name, sizeof(sendbuffer.name), "%s", audiosock.name());
-    sendbuffer.len = mpegsize();
-    sendbuffer.c_s = store_tv.tv_sec;
-    sendbuffer.c_us = store_tv.tv_usec;
-    memcpy(sendbuffer.buffer,mpegptr(), mpegsize());
+    int len = audiowire::encode(&sendbuffer, 0, audiosock.id(), audiosock.nextseq(k), frames[0]->mediatime, payloads, lens, k, frames[0]->capturetime, audiosock.room());
+    if (len < 0) {
+        return -1;
+    }
     
-    return audiosock.send((void*)&sendbuffer, 64 + sendbuffer.len);
+    return audiosock.send((void*)sendbuffer.data, len);
 }
 
 int
-audiobuffer::udp2mpeg(audio_t* udpaudio)
+audiobuffer::mpeg2udp(audiopacket_t* packet, uint16_t id, audiobuffer* const* frames, int k)
 {
-    set_frameindex(udpaudio->frame);
-    storempeg(udpaudio->buffer, udpaudio->len, udpaudio->c_s, udpaudio->c_us);
+    if ((k < 1) || (k > AUDIO_WIRE_MAX_FRAMES)) {
+        return -1;
+    }
+    const unsigned char* payloads[AUDIO_WIRE_MAX_FRAMES];
+    size_t lens[AUDIO_WIRE_MAX_FRAMES];
+    for (int i = 0; i < k; ++i) {
+        payloads[i] = frames[i]->mpegptr();
+        lens[i] = frames[i]->mpegsize();
+    }
+    return audiowire::encode(packet, 0, id, (uint32_t) frames[0]->frameindex, frames[0]->mediatime, payloads, lens, k, frames[0]->capturetime);
+}
+
+int
+audiobuffer::udp2mpeg(const audiowire_t& wire, uint64_t frame)
+{
+    set_frameindex(frame);
+    set_timestamp(wire.timestamp);
+    set_capturetime(wire.capture);
+    storempeg(wire.payload, wire.len);
     return 0;
 }
 
@@ -123,6 +386,7 @@ audiosocket::connect(std::string destination,
         return -1;
     
     socketname = yourname;
+    socketid = audiowire::id(yourname);
     destinationhost = destination;
     destinationport = port;
     
@@ -156,7 +420,7 @@ audiosocket::disconnect()
 }
 
 int
-audiosocket::bind(int port)
+audiosocket::bind(int port, bool reuseport)
 {
     receiverport = port;
     
@@ -166,6 +430,14 @@ audiosocket::bind(int port)
         return -1;
     }
     
+    if (reuseport) {
+        int one = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+            fprintf(stderr,"error: SO_REUSEPORT failed\n");
+            return -1;
+        }
+    }
+    
     memset(&receiveraddr, 0, sizeof(receiveraddr));
     
     // Filling server information
@@ -184,6 +456,31 @@ audiosocket::bind(int port)
     return 0;
 }
 
+int
+audiosocket::steer(int workers)
+{
+    // classic BPF on the UDP payload: A = participant id (bytes 2-3), return A % workers
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_H | BPF_ABS, 0, 0, 2 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) workers },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    
+    if (workers < 1) {
+        return -1;
+    }
+    
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+        // the kernel falls back to hashing the 4-tuple, which is still flow stable
+        fprintf(stderr,"warning: failed to attach reuseport steering program\n");
+        return -1;
+    }
+    return 0;
+}
+
 std::string
 audiosocket::getip(struct sockaddr_in* res)
 {
@@ -213,26 +510,178 @@ audiosocket::getip(struct sockaddr_in* res)
 int
 audiosocket::send(void* buffer, size_t len)
 {
-    int rc = sendto(sockfd, (char *)buffer, len, 0, (const struct sockaddr *) &destinationaddr, sizeof(destinationaddr));
+    int rc = ::sendto(sockfd, (char *)buffer, len, 0, (const struct sockaddr *) &destinationaddr, sizeof(destinationaddr));
     return rc;
 }
 
+int
+audiosocket::sendto(void* buffer, size_t len, const struct sockaddr_in& dest)
+{
+    int rc = ::sendto(sockfd, (char *)buffer, len, 0, (const struct sockaddr *) &dest, sizeof(dest));
+    return rc;
+}
 
-audio_t*
-audiosocket::receive(){
-    static struct audio_t udpaudio;
-    static struct sockaddr_in cliaddr;
-    static socklen_t len;
-    udpaudio.len = 0;
-    ssize_t n = recvfrom(sockfd, (char *)&udpaudio, 64+1440,
-                         MSG_WAITALL, ( struct sockaddr *) &cliaddr,
+
+int
+audiosocket::receive(audiopacket_t* packet)
+{
+    socklen_t len = sizeof(packet->peer);
+    ssize_t n = recvfrom(sockfd, (char *)packet->data, sizeof(packet->data),
+                         MSG_WAITALL, ( struct sockaddr *) &packet->peer,
                          &len);
     
-    fprintf(stdout,"received %ld\n", n);
+    if (n < 0) {
+        packet->bytes = 0;
+        return -1;
+    }
+    packet->bytes = n;
+    return n;
+}
+
+int
+audiosocket::receive(audiopacket_t* packets, int n)
+{
+    struct mmsghdr msgs[AUDIO_MAX_BATCH];
+    struct iovec iovs[AUDIO_MAX_BATCH];
+    
+    if (n > AUDIO_MAX_BATCH) {
+        n = AUDIO_MAX_BATCH;
+    }
     
-    if (n == (udpaudio.len+64)) {
-        return &udpaudio;
-    } else {
+    memset(msgs, 0, sizeof(struct mmsghdr) * n);
+    for (int i = 0; i < n; ++i) {
+        iovs[i].iov_base = packets[i].data;
+        iovs[i].iov_len = sizeof(packets[i].data);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &packets[i].peer;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    
+    // block for the first datagram, then take whatever is already queued
+    int rc = recvmmsg(sockfd, msgs, n, MSG_WAITFORONE, 0);
+    for (int i = 0; i < rc; ++i) {
+        packets[i].bytes = msgs[i].msg_len;
+    }
+    return rc;
+}
+
+int
+audiosocket::queue(void* buffer, size_t len, const struct sockaddr_in& dest)
+{
+    if (txcount == AUDIO_MAX_BATCH) {
+        if (flush() < 0) {
+            return -1;
+        }
+    }
+    
+    txiov[txcount].iov_base = buffer;
+    txiov[txcount].iov_len = len;
+    txaddr[txcount] = dest;
+    memset(&txmsg[txcount], 0, sizeof(struct mmsghdr));
+    txmsg[txcount].msg_hdr.msg_iov = &txiov[txcount];
+    txmsg[txcount].msg_hdr.msg_iovlen = 1;
+    txmsg[txcount].msg_hdr.msg_name = &txaddr[txcount];
+    txmsg[txcount].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    txcount++;
+    return 0;
+}
+
+int
+audiosocket::flush()
+{
+    if (!txcount) {
         return 0;
     }
+    
+    if (gso && (txcount > 1)) {
+        int rc = flush_gso();
+        if (rc >= 0) {
+            return rc;
+        }
+        // not a single-destination equal-size run: fall back to sendmmsg
+    }
+    
+    int sent = 0;
+    while (sent < txcount) {
+        int rc = sendmmsg(sockfd, txmsg + sent, txcount - sent, 0);
+        if (rc <= 0) {
+            AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "sendmmsg failed after %d of %d datagrams", sent, txcount);
+            break;
+        }
+        sent += rc;
+    }
+    txcount = 0;
+    return sent;
+}
+
+int
+audiosocket::enable_gso(bool enable)
+{
+    if (enable) {
+        // probe kernel support
+        int segment = 0;
+        if (setsockopt(sockfd, IPPROTO_UDP, UDP_SEGMENT, &segment, sizeof(segment))) {
+            fprintf(stderr,"warning: UDP GSO not supported\n");
+            gso = false;
+            return -1;
+        }
+    }
+    gso = enable;
+    return 0;
+}
+
+int
+audiosocket::set_nonblocking(bool enable)
+{
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(sockfd, F_SETFL, flags) ? -1 : 0;
+}
+
+int
+audiosocket::flush_gso()
+{
+    // GSO segments one buffer into equal sized datagrams (the last may be shorter)
+    // for a single destination
+    size_t segment = txiov[0].iov_len;
+    for (int i = 1; i < txcount; ++i) {
+        if ((txaddr[i].sin_addr.s_addr != txaddr[0].sin_addr.s_addr) ||
+            (txaddr[i].sin_port != txaddr[0].sin_port)) {
+            return -1;
+        }
+        if ((i < txcount - 1) && (txiov[i].iov_len != segment)) {
+            return -1;
+        }
+        if (txiov[i].iov_len > segment) {
+            return -1;
+        }
+    }
+    
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_name = &txaddr[0];
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = txiov;
+    msg.msg_iovlen = txcount;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *((uint16_t*) CMSG_DATA(cm)) = segment;
+    
+    if (sendmsg(sockfd, &msg, 0) < 0) {
+        return -1;
+    }
+    int sent = txcount;
+    txcount = 0;
+    return sent;
 }
@@ -14,43 +14,77 @@
 #include <string.h>
 #include <queue>
 #include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <stdlib.h>
 #include <deque>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <unistd.h>
 #include "opus.h"
+#include "audiowire.hpp"
+#include "audioclock.hpp"
+#include "audiolog.hpp"
+#include "audiometer.hpp"
 
-struct audio_t {
-    audio_t() : len(0), frame(0), c_s(0), c_us(0) {}
-    ~audio_t() {}
-    uint64_t frame;
-    uint64_t len;
-    uint64_t c_s;
-    uint64_t c_us;
-    char name[32];
-    unsigned char buffer[1440];
-};
+#define AUDIO_MAX_BATCH 64
 
 class audiosocket {
 public:
-    audiosocket() : sockfd(-1) {}
+    audiosocket() : sockfd(-1), socketid(AUDIO_WIRE_SERVER_ID), socketroom(0), txseq(0), txcount(0), gso(false) {}
     ~audiosocket(){}
     
     int connect(std::string destination, std::string name, int port=8080);
     int disconnect();
     
-    int bind(int port=8080);
+    // reuseport: join a SO_REUSEPORT group, one socket per receive worker
+    int bind(int port=8080, bool reuseport=false);
+    
+    // steer the datagrams of a SO_REUSEPORT group by participant id: the
+    // socket bound as <n>-th receives all ids with id % workers == n
+    int steer(int workers);
     
     std::string getip(struct sockaddr_in* res);
     
     
     int send(void* buff, size_t len);
-    audio_t* receive();
+    int sendto(void* buff, size_t len, const struct sockaddr_in& dest);
+    // reentrant: fill the caller's packet including the sender address, returns the size or -1
+    int receive(audiopacket_t* packet);
+    
+    // batch receive: wait for at least one datagram, return up to <n> (<= AUDIO_MAX_BATCH)
+    // with their sizes and senders; validate each with audiowire::parse
+    int receive(audiopacket_t* packets, int n);
+    
+    // batch send: queue() references the caller's buffer until flush() hands
+    // all queued datagrams to the kernel in one sendmmsg call
+    int queue(void* buff, size_t len, const struct sockaddr_in& dest);
+    int queue(void* buff, size_t len) { return queue(buff, len, destinationaddr); }
+    int flush();
+    size_t queued() { return txcount; }
+    
+    // send equal sized runs to one destination as a single UDP GSO super-datagram
+    int enable_gso(bool enable=true);
+    
+    // receive() returns -1 with EAGAIN instead of blocking, for event loops
+    int set_nonblocking(bool enable=true);
+    
+    int fd() { return sockfd; }
     
     const char* name() { return socketname.c_str(); }
     
+    // participant id sent in the wire header, derived from the name on connect
+    uint16_t id() { return socketid; }
+    void set_id(uint16_t _id) { socketid = _id; }
+    // room sent with every datagram, 0 is the server's default room
+    uint16_t room() { return socketroom; }
+    void set_room(uint16_t _room) { socketroom = _room; }
+    // reserve <n> sequence numbers, returns the first
+    uint32_t nextseq(uint32_t n = 1) { uint32_t seq = txseq; txseq += n; return seq; }
+    
 private:
     
     int sockfd;
@@ -63,72 +97,276 @@ private:
     
     struct sockaddr_in receiveraddr;
     std::string socketname;
+    uint16_t socketid;
+    uint16_t socketroom;
+    uint32_t txseq;
+    
+    struct mmsghdr txmsg[AUDIO_MAX_BATCH];
+    struct iovec txiov[AUDIO_MAX_BATCH];
+    struct sockaddr_in txaddr[AUDIO_MAX_BATCH];
+    int txcount;
+    bool gso;
+    
+    int flush_gso();
 };
 
 
-class audiocodec {
+class audiocodecarena;
+
+// Opus state owned by exactly one thread, no locking. The state is either
+// checked out of an audiocodecarena or allocated on its own by configure().
+class audiocodechandle {
+public:
+    audiocodechandle() : state(0), arena(0), index(0) {}
+    audiocodechandle(const audiocodechandle&) = delete;
+    audiocodechandle& operator=(const audiocodechandle&) = delete;
+    virtual ~audiocodechandle() {}
+    
+    explicit operator bool() const { return state != 0; }
+    
+protected:
+    friend class audiocodecarena;
+    
+    void take(audiocodechandle& o) {
+        state = o.state;
+        arena = o.arena;
+        index = o.index;
+        o.state = 0;
+        o.arena = 0;
+    }
+    
+    void* state;
+    audiocodecarena* arena;   // 0 if the state was allocated by configure()
+    uint32_t index;
+};
+
+class audioencoder : public audiocodechandle {
 public:
-    audiocodec() {encoder = NULL; decoder = NULL;}
-    int configure(int samplingrate, int channels, int bitrate);
-    virtual ~audiocodec(){
-        if (encoder) {
-            opus_encoder_destroy(encoder);
+    audioencoder() {}
+    audioencoder(audioencoder&& o) noexcept { take(o); }
+    audioencoder& operator=(audioencoder&& o) noexcept {
+        if (this != &o) {
+            release();
+            take(o);
         }
-        if (decoder) {
-            opus_decoder_destroy(decoder);
+        return *this;
+    }
+    virtual ~audioencoder() { release(); }
+    
+    // standalone state outside of an arena; loss_perc > 0 enables in-band FEC
+    int configure(int samplingrate, int channels, int bitrate, int loss_perc = 0);
+    // back to the arena (or the heap)
+    void release();
+    
+    OpusEncoder* get() { return (OpusEncoder*) state; }
+    
+    // in-band FEC for an expected packet loss in percent, 0 disables it
+    int set_fec(int loss_perc) {
+        if (opus_encoder_ctl(get(), OPUS_SET_INBAND_FEC(loss_perc > 0 ? 1 : 0)) != OPUS_OK) {
+            return -1;
         }
+        return (opus_encoder_ctl(get(), OPUS_SET_PACKET_LOSS_PERC(loss_perc)) != OPUS_OK) ? -1 : 0;
     }
     
-    OpusEncoder* getEncoder() {mMutex.lock(); return encoder;}
-    OpusDecoder* getDecoder() {mMutex.lock(); return decoder;}
-    void releaseCodec() {mMutex.unlock();}
+    // discontinuous transmission inside the codec, only SILK and hybrid modes use it
+    int set_dtx(bool enable) {
+        return (opus_encoder_ctl(get(), OPUS_SET_DTX(enable ? 1 : 0)) != OPUS_OK) ? -1 : 0;
+    }
     
-private:
+    int encode(const opus_int16* pcm, int frames, unsigned char* data, size_t capacity) {
+        return opus_encode(get(), pcm, frames, data, capacity);
+    }
     
-    std::mutex mMutex;
+    int reset() { return opus_encoder_ctl(get(), OPUS_RESET_STATE); }
+};
+
+class audiodecoder : public audiocodechandle {
+public:
+    audiodecoder() {}
+    audiodecoder(audiodecoder&& o) noexcept { take(o); }
+    audiodecoder& operator=(audiodecoder&& o) noexcept {
+        if (this != &o) {
+            release();
+            take(o);
+        }
+        return *this;
+    }
+    virtual ~audiodecoder() { release(); }
+    
+    // standalone state outside of an arena
+    int configure(int samplingrate, int channels);
+    // back to the arena (or the heap)
+    void release();
+    
+    OpusDecoder* get() { return (OpusDecoder*) state; }
+    
+    int decode(const unsigned char* data, size_t len, opus_int16* pcm, int frames, int fec = 0) {
+        return opus_decode(get(), data, len, pcm, frames, fec);
+    }
     
-    OpusEncoder* encoder;
-    OpusDecoder* decoder;
+    // packet loss concealment for one missing frame
+    int conceal(opus_int16* pcm, int frames) {
+        return opus_decode(get(), NULL, 0, pcm, frames, 0);
+    }
+    
+    // SILK and hybrid packets may carry the previous frame, CELT only packets never do
+    static bool has_fec(const unsigned char* data, size_t len) {
+        return len && ((data[0] >> 3) < 16);
+    }
+    
+    int reset() { return opus_decoder_ctl(get(), OPUS_RESET_STATE); }
 };
 
-class audiobuffer : public std::vector<unsigned char> {
+// Encoder and decoder states for many streams in one contiguous block,
+// sized with opus_*_get_size() and initialised once by configure().
+// checkout() pops a ready state from a lock-free free list, a released
+// state is reset with OPUS_RESET_STATE before it is handed out again.
+class audiocodecarena {
 public:
-    audiobuffer(size_t _samplingrate,
-                int _channels,
-                size_t _framesize,
-                size_t _samplesize) : samplingrate(_samplingrate), channels(_channels), framesize(_framesize), samplesize(_samplesize), type(eEMPTY), debug(false)
-    {
-        //printf("buffer %lu\n", framesize*channels*samplesize);
-        reserve(framesize*channels*samplesize);
-        resize(framesize*channels*samplesize);
-        silence();
+    audiocodecarena() : slab(0), encoders(0), decoders(0), enc_stride(0), dec_stride(0),
+                        samplingrate(48000), channels(2), bitrate(192000), n_exhausted(0) {}
+    audiocodecarena(const audiocodecarena&) = delete;
+    audiocodecarena& operator=(const audiocodecarena&) = delete;
+    
+    virtual ~audiocodecarena() {
+        // states still checked out at exit keep the arena alive
+        if (slab && (enc_free.available() == encoders) && (dec_free.available() == decoders)) {
+            free(slab);
+        }
     }
     
-    audiobuffer(size_t _samplingrate,
-                int _channels,
-                size_t _framesize) : samplingrate(_samplingrate), channels(_channels), framesize(_framesize), type(eEMPTY)
-    {
-        samplesize=2;
+    // allocate and initialise all states, only the first call allocates
+    int configure(size_t _encoders, size_t _decoders, int _samplingrate, int _channels, int _bitrate);
+    
+    // O(1), returns -1 if the arena is exhausted
+    int checkout(audioencoder& encoder);
+    int checkout(audiodecoder& decoder);
+    
+    size_t encoders_available() { return enc_free.available(); }
+    size_t decoders_available() { return dec_free.available(); }
+    size_t exhausted() { return n_exhausted; }
+    
+private:
+    friend class audioencoder;
+    friend class audiodecoder;
+    
+    // Treiber stack of indices, the tag in the upper 32 bits protects against ABA
+    class freelist {
+    public:
+        freelist() : head(0), n_free(0) {}
+        
+        void configure(size_t n) {
+            links.reset(new std::atomic<uint32_t>[n]);
+            for (size_t i = 0; i < n; ++i) {
+                links[i].store(i, std::memory_order_relaxed);
+            }
+            // n-1 -> n-2 -> ... -> 0
+            head.store(n, std::memory_order_release);
+            n_free = n;
+        }
         
-        //printf("buffer %lu\n", framesize*channels*samplesize);
+        // index or -1 if empty
+        long pop() {
+            uint64_t h = head.load(std::memory_order_acquire);
+            uint64_t next;
+            do {
+                uint32_t index = (uint32_t) h;
+                if (!index) {
+                    return -1;
+                }
+                next = ((h >> 32) + 1) << 32 | links[index-1].load(std::memory_order_relaxed);
+            } while (!head.compare_exchange_weak(h, next, std::memory_order_acquire, std::memory_order_acquire));
+            n_free--;
+            return (uint32_t) h - 1;
+        }
         
-        reserve(framesize*channels*samplesize);
-        resize(framesize*channels*samplesize);
+        void push(uint32_t index) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            uint64_t next;
+            do {
+                links[index].store((uint32_t) h, std::memory_order_relaxed);
+                next = ((h >> 32) + 1) << 32 | (index + 1);
+            } while (!head.compare_exchange_weak(h, next, std::memory_order_release, std::memory_order_relaxed));
+            n_free++;
+        }
         
-        //printf("buffer size %lu\n", size());
-        silence();
-        samplesize=2;
-        mpegbuffer.reserve(1500);
-        mpegbuffer.resize(1500);
+        size_t available() { return n_free; }
         
+    private:
+        std::atomic<uint64_t> head;   // tag << 32 | (index+1)
+        std::atomic<size_t> n_free;
+        std::unique_ptr<std::atomic<uint32_t>[]> links;
+    };
+    
+    OpusEncoder* encoder_at(size_t i) { return (OpusEncoder*) (slab + i * enc_stride); }
+    OpusDecoder* decoder_at(size_t i) { return (OpusDecoder*) (slab + encoders * enc_stride + i * dec_stride); }
+    
+    void checkin(audioencoder& encoder);
+    void checkin(audiodecoder& decoder);
+    
+    unsigned char* slab;
+    size_t encoders;
+    size_t decoders;
+    size_t enc_stride;
+    size_t dec_stride;
+    int samplingrate;
+    int channels;
+    int bitrate;
+    freelist enc_free;
+    freelist dec_free;
+    std::atomic<size_t> n_exhausted;
+};
+
+// One encoder and one decoder. Each side must only be used by one thread;
+// the encoder usually belongs to the sender, the decoder to the player.
+class audiocodec {
+public:
+    audiocodec() {}
+    int configure(int samplingrate, int channels, int bitrate, int loss_perc = 0);
+    virtual ~audiocodec() {}
+    
+    OpusEncoder* getEncoder() { return encoder.get(); }
+    OpusDecoder* getDecoder() { return decoder.get(); }
+    
+    audioencoder encoder;
+    audiodecoder decoder;
+};
+
+class audiobuffermanager;
+
+// Fixed size frame living in the slab of an audiobuffermanager. PCM and
+// compressed payload follow the header in the same cache aligned block.
+class audiobuffer {
+public:
+    audiobuffer(audiobuffermanager* _pool,
+                uint32_t _index,
+                unsigned char* _pcm,
+                size_t _pcm_capacity,
+                unsigned char* _mpeg,
+                size_t _mpeg_capacity,
+                size_t _samplingrate,
+                int _channels,
+                size_t _framesize,
+                size_t _samplesize) : type(eEMPTY), refs(0), next(0), pool(_pool), index(_index),
+                                      pcm(_pcm), pcm_capacity(_pcm_capacity), pcm_size(0),
+                                      mpeg(_mpeg), mpeg_capacity(_mpeg_capacity), mpeg_size(_mpeg_capacity),
+                                      samplingrate(_samplingrate), channels(_channels), framesize(_framesize), samplesize(_samplesize), frameindex(0), mediatime(0), capturetime(0), store_ns(0), debug(false)
+    {
+        set_samplesize(samplesize);
+        lvl.channels = 0;
+        lvl.active = false;
+        lvl.metered = false;
+        silence();
     }
     
     virtual ~audiobuffer() {}
         
     void set_samplesize(size_t _size) {
         samplesize = _size;
-        reserve(framesize*channels*samplesize);
-        resize(framesize*channels*samplesize);
+        pcm_size = framesize*channels*samplesize;
+        if (pcm_size > pcm_capacity) {
+            pcm_size = pcm_capacity;
+        }
     }
     
     void set_frameindex(uint64_t index) {
@@ -144,56 +382,96 @@ public:
     }
     
     unsigned char* ptr() {
-        return &(operator[](0));
+        return pcm;
+    }
+    
+    size_t size() {
+        return pcm_size;
+    }
+    
+    size_t capacity() {
+        return pcm_capacity;
     }
     
     unsigned char* mpegptr() {
-        return &(mpegbuffer[0]);
+        return mpeg;
     }
     
     size_t mpegsize() {
-        return mpegbuffer.size();
+        return mpeg_size;
     }
     
-    size_t music() {
-        size_t music_sum=0;
-        for (size_t i = 0 ; i< size(); ++i) {
-            music_sum += ptr()[i];
-        }
-        return music_sum;
+    size_t mpegcapacity() {
+        return mpeg_capacity;
     }
     
+    // per channel peak and rms of the int16 PCM, kept with the frame until it is recycled
+    const audiolevel_t& meter() {
+        audiometer::measure((const int16_t*) ptr(), framesize, channels, lvl);
+        return lvl;
+    }
+    
+    audiolevel_t& level() { return lvl; }
+    
+    // voice activity as the stream's audiovad decided, silent frames may skip work
+    bool active() { return lvl.active; }
+    
     void store(const char* input) {
         if (debug) {
-            printf("%lu %lu\n", size(), framesize*samplesize*channels);
+            AUDIO_DEBUG("store size=%lu frame-bytes=%lu", size(), framesize*samplesize*channels);
         }
-        gettimeofday(&store_tv, &store_tz);
-        memcpy(ptr(), (char*)input, framesize * samplesize * channels);
+        store_ns = audioclock::now();
+        memcpy(ptr(), (char*)input, size());
+        type = eWAV;
+    }
+    
+    // store PCM captured at an earlier time, CLOCK_MONOTONIC ns
+    void store(const char* input, uint64_t t_ns) {
+        memcpy(ptr(), (char*)input, size());
+        store_ns = t_ns;
         type = eWAV;
     }
     
-    void storempeg(void* buffer, size_t len, uint64_t time_s, uint64_t time_us)
+    void storempeg(const void* buffer, size_t len)
     {
-        mpegbuffer.resize(len);
-        memcpy(mpegptr(), (char*)buffer, len);
-        store_tv.tv_sec = time_s;
-        store_tv.tv_usec = time_us;
+        if (len > mpeg_capacity) {
+            len = mpeg_capacity;
+        }
+        mpeg_size = len;
+        memcpy(mpegptr(), (const char*)buffer, len);
+        store_ns = audioclock::now();
         type = eMPEG;
     }
     
     float age_in_ms() {
-        struct timeval tv;
-        struct timezone tz;
-        
-        gettimeofday(&tv, &tz);
-        
-        return (((tv.tv_sec-store_tv.tv_sec)*1000000.0) + (tv.tv_usec-store_tv.tv_usec))/1000.0;
+        return (audioclock::now() - store_ns) / 1000000.0;
     }
     
-    int wav2mpeg(audiocodec& codec);
-    int mpeg2wav(audiocodec& codec);
-    int udp2mpeg(audio_t* receivebuffer);
+    // CLOCK_MONOTONIC ns of the last store
+    uint64_t stored() { return store_ns; }
+
+    
+    int wav2mpeg(audioencoder& encoder);
+    int mpeg2wav(audiodecoder& decoder);
+    // rebuild a missing frame from the FEC data in <next>, or by concealment
+    int fec2wav(audiodecoder& decoder, audiobuffer& next);
+    int plc2wav(audiodecoder& decoder);
+    int wav2mpeg(audiocodec& codec) { return wav2mpeg(codec.encoder); }
+    int mpeg2wav(audiocodec& codec) { return mpeg2wav(codec.decoder); }
+    int udp2mpeg(const audiowire_t& wire, uint64_t frame);
     int mpeg2udp(audiosocket& audiosock);
+    int mpeg2udp(audiopacket_t* packet, uint16_t id);
+    // aggregate <k> consecutive encoded frames into one datagram
+    static int mpeg2udp(audiosocket& audiosock, audiobuffer* const* frames, int k);
+    static int mpeg2udp(audiopacket_t* packet, uint16_t id, audiobuffer* const* frames, int k);
+    
+    // media clock in samples, carried in the wire header
+    void set_timestamp(uint32_t ts) { mediatime = ts; }
+    uint32_t timestamp() { return mediatime; }
+    
+    // capture time in ns on the server clock, 0 if unknown; carried in the wire extension
+    void set_capturetime(uint64_t t_ns) { capturetime = t_ns; }
+    uint64_t capture() { return capturetime; }
     
     enum BufferType {eEMPTY, eWAV, eMPEG};
     
@@ -201,132 +479,223 @@ public:
     
     size_t getFramesize() {return framesize;}
     
+    // intrusive reference count, the last release returns the frame to its pool
+    void acquire() { refs.fetch_add(1, std::memory_order_relaxed); }
+    inline void release();
+    
 private:
-    std::vector<unsigned char> mpegbuffer;
+    friend class audiobuffermanager;
+    
+    // reset when the frame goes back to the free list
+    void recycle() {
+        set_samplesize(samplesize);
+        mpeg_size = mpeg_capacity;
+        frameindex = 0;
+        mediatime = 0;
+        capturetime = 0;
+        lvl.channels = 0;
+        lvl.active = false;
+        lvl.metered = false;
+        type = eEMPTY;
+        silence();
+    }
+    
+    std::atomic<uint32_t> refs;
+    std::atomic<uint32_t> next;     // free list link (index+1, 0 terminates)
+    audiobuffermanager* pool;
+    uint32_t index;
+    
+    unsigned char* pcm;
+    size_t pcm_capacity;
+    size_t pcm_size;
+    unsigned char* mpeg;
+    size_t mpeg_capacity;
+    size_t mpeg_size;
+    
     uint64_t samplingrate;
     int channels;
     size_t framesize;
     size_t samplesize;
     uint64_t frameindex;
-    struct timeval store_tv;
-    struct timezone store_tz;
+    uint32_t mediatime;
+    uint64_t capturetime;
+    uint64_t store_ns;      // CLOCK_MONOTONIC
+    audiolevel_t lvl;       // set by meter()
     bool debug;
 };
 
+// reference to a slab frame, used like the std::shared_ptr it replaces
+class audiobufferref {
+public:
+    audiobufferref() : p(0) {}
+    audiobufferref(std::nullptr_t) : p(0) {}
+    explicit audiobufferref(audiobuffer* _p) : p(_p) { if (p) p->acquire(); }
+    audiobufferref(const audiobufferref& o) : p(o.p) { if (p) p->acquire(); }
+    audiobufferref(audiobufferref&& o) noexcept : p(o.p) { o.p = 0; }
+    ~audiobufferref() { if (p) p->release(); }
+    
+    audiobufferref& operator=(const audiobufferref& o) {
+        if (o.p) o.p->acquire();
+        if (p) p->release();
+        p = o.p;
+        return *this;
+    }
+    
+    audiobufferref& operator=(audiobufferref&& o) noexcept {
+        if (this != &o) {
+            if (p) p->release();
+            p = o.p;
+            o.p = 0;
+        }
+        return *this;
+    }
+    
+    audiobufferref& operator=(std::nullptr_t) {
+        if (p) p->release();
+        p = 0;
+        return *this;
+    }
+    
+    audiobuffer* operator->() const { return p; }
+    audiobuffer& operator*() const { return *p; }
+    audiobuffer* get() const { return p; }
+    explicit operator bool() const { return p != 0; }
+    bool operator==(std::nullptr_t) const { return p == 0; }
+    bool operator!=(std::nullptr_t) const { return p != 0; }
+    
+private:
+    audiobuffer* p;
+};
+
+// Slab of preallocated frames with a lock-free free list. reserve() must
+// run once at startup, before any get_buffer(); after it get_buffer() and
+// put_buffer() never touch the heap. Without a slab or when it is
+// exhausted get_buffer() returns nullptr.
 class audiobuffermanager {
 public:
     audiobuffermanager(size_t _max = 128,
-                       size_t _default_size = 120*2*2)
+                       size_t _default_size = 120*2*2) : max(_max), samplingrate(48000), framesize(_default_size/4), samplesize(2), channels(2), mpegsize(1500),
+                                                         slab(0), stride(0), frames(0), freehead(0), n_free(0), n_exhausted(0)
     {
-        max = _max;
-        buffersize = _default_size;
-        queued_size = 0;
-        inflight_size = 0;
     }
     
-    virtual ~audiobuffermanager(){}
+    virtual ~audiobuffermanager() {
+        // frames still referenced at exit keep the slab alive
+        if (slab && (n_free.load() == frames)) {
+            for (size_t i = 0; i < frames; ++i) {
+                at(i)->~audiobuffer();
+            }
+            free(slab);
+        }
+    }
     
-    typedef std::shared_ptr<audiobuffer> shared_buffer;
+    typedef audiobufferref shared_buffer;
     
     void configure(size_t _max,
                    size_t _samplingrate,
                    int _channels,
                    size_t _framesize,
-                   size_t _samplesize
+                   size_t _samplesize,
+                   size_t _mpegsize = 1500
                    )
     {
         max = _max;
-        buffersize = _channels*framesize*2;
         samplingrate = _samplingrate;
         channels = _channels;
         framesize = _framesize;
         samplesize = _samplesize;
+        mpegsize = _mpegsize;
     }
     
-    
-    void reserve(size_t n) {
-        // create <n> buffers in the manager if less than max
-        std::vector<shared_buffer> vec;
-        for (size_t i = 0 ; i < n; ++i) {
-            vec.push_back(get_buffer());
-        }
-        for (size_t i = 0 ; i < n; ++i) {
-            put_buffer(vec[i]);
-        }
-    }
+    // allocate the slab with <n> frames (at least <max>), only the first call allocates
+    int reserve(size_t n);
     
     shared_buffer get_buffer()
     {
-        std::lock_guard<std::mutex> guard(mMutex);
-        
-        if (!queue.size()) {
-            
-            shared_buffer buf = std::make_shared<audiobuffer>(
-                                                              samplingrate, channels, framesize);
-            buf->set_samplesize(samplesize);
-            inflight_size += buf->size();
-            return buf;
-        } else {
-            shared_buffer buffer = queue.front();
-            queued_size -= buffer->capacity();
-            buffer->resize(channels*framesize*samplesize);
-            buffer->reserve(channels*framesize*samplesize);
-            inflight_size += buffer->capacity();
-            queue.pop();
-            return buffer;
+        // no slab, no frames: reserve() belongs to the startup, never to the first caller here
+        if (!slab) {
+            n_exhausted++;
+            return nullptr;
         }
+        
+        uint64_t head = freehead.load(std::memory_order_acquire);
+        uint64_t next;
+        do {
+            uint32_t index = (uint32_t) head;
+            if (!index) {
+                n_exhausted++;
+                return nullptr;
+            }
+            // the tag in the upper 32 bits protects against ABA
+            next = ((head >> 32) + 1) << 32 | at(index-1)->next.load(std::memory_order_relaxed);
+        } while (!freehead.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire));
+        
+        n_free--;
+        return shared_buffer(at((uint32_t) head - 1));
     }
     
+    // drop a reference; the frame returns to the free list with the last one
     void put_buffer(shared_buffer buffer)
     {
-        std::lock_guard<std::mutex> guard(mMutex);
-        
-        if (inflight_size >= buffer->capacity()) {
-            inflight_size -= buffer->capacity();
-        } else {
-            inflight_size = 0;
-        }
-        
-        if (queue.size() > max) {
-            //printf("# dump audio buffer : size=%lu\n", queue.size());
-            return;
-        } else {
-            queue.push(buffer);
-            buffer->resize(buffersize);
-            buffer->reserve(buffersize);
-            buffer->shrink_to_fit();
-            buffer->silence();
-            queued_size += buffersize;
-            //printf("# keep audio buffer : size=%lu\n", queue.size());
-            return;
-        }
+        buffer = nullptr;
     }
     
+    // bytes of PCM in free frames
     const size_t queued()
     {
-        std::lock_guard<std::mutex> guard(mMutex);
-        return queued_size;
+        return n_free * framesize * channels * samplesize;
     }
     
+    // bytes of PCM in frames in use
     const size_t inflight()
     {
-        std::lock_guard<std::mutex> guard(mMutex);
-        return inflight_size;
+        return (frames - n_free) * framesize * channels * samplesize;
     }
     
+    size_t available() { return n_free; }
+    size_t allocated() { return frames; }
+    size_t exhausted() { return n_exhausted; }
+    
 private:
-    std::mutex mMutex;
-    std::queue<shared_buffer> queue;
+    friend class audiobuffer;
+    
+    audiobuffer* at(size_t i) { return (audiobuffer*) (slab + i * stride); }
+    
+    void recycle(audiobuffer* buffer)
+    {
+        buffer->recycle();
+        uint64_t head = freehead.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            buffer->next.store((uint32_t) head, std::memory_order_relaxed);
+            next = ((head >> 32) + 1) << 32 | (buffer->index + 1);
+        } while (!freehead.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+        n_free++;
+    }
+    
     size_t max;
-    size_t buffersize;
-    size_t queued_size;
-    size_t inflight_size;
     size_t samplingrate;
     size_t framesize;
     size_t samplesize;
     int channels;
+    size_t mpegsize;
+    
+    unsigned char* slab;
+    size_t stride;
+    size_t frames;
+    std::atomic<uint64_t> freehead;   // tag << 32 | (index+1)
+    std::atomic<size_t> n_free;
+    std::atomic<size_t> n_exhausted;
 };
 
+inline void
+audiobuffer::release()
+{
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        pool->recycle(this);
+    }
+}
+
 class audioqueue {
 public:
     audioqueue() {
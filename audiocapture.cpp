@@ -0,0 +1,202 @@
+//
+//  audiocapture.cpp
+//
+//  Capture pipeline: audio callback -> slot ring -> encoder/sender thread
+//
+
+#include "audiocapture.hpp"
+#include <pthread.h>
+#include <time.h>
+
+int
+audiocapture::capture(const void* input, size_t frames)
+{
+    uint64_t t1 = audioclock::now();
+    uint32_t index;
+    int rc = 0;
+
+    frameindex += frames;
+
+    if ((frames != framesize) || !free_slots.pop(index)) {
+        // encoder is behind: drop this period
+        n_overrun++;
+        if (stats) {
+            stats->add(audiostats::eOverruns);
+        }
+        rc = -1;
+    } else {
+        slot& s = slots[index];
+        s.frameindex = frameindex;
+        s.t_ns = t1;
+        memcpy(&pcm[index * framesize * channels], input, framesize * channels * sizeof(int16_t));
+        filled_slots.push(index);
+        sem_post(&ready);
+
+        size_t depth = filled_slots.size();
+        if (depth > highwater.load(std::memory_order_relaxed)) {
+            highwater.store(depth, std::memory_order_relaxed);
+        }
+        n_captured++;
+    }
+
+    uint64_t dt = audioclock::now() - t1;
+    t_cb_last.store(dt, std::memory_order_relaxed);
+    t_cb_sum.fetch_add(dt, std::memory_order_relaxed);
+    if (dt > t_cb_max.load(std::memory_order_relaxed)) {
+        t_cb_max.store(dt, std::memory_order_relaxed);
+    }
+    if (stats) {
+        stats->record(audiostats::eCapture, dt);
+    }
+    return rc;
+}
+
+int
+audiocapture::start()
+{
+    if (running) {
+        return -1;
+    }
+    running = true;
+    thread = std::thread(&audiocapture::run, this);
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set)) {
+            AUDIO_WARNING("failed to pin encoder thread to cpu %d", cpu);
+        }
+    }
+    return 0;
+}
+
+void
+audiocapture::stop()
+{
+    if (!running) {
+        return;
+    }
+    running = false;
+    sem_post(&ready);
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+int
+audiocapture::flush()
+{
+    audiobuffer* frames[AUDIO_WIRE_MAX_FRAMES];
+    for (int i = 0; i < npending; ++i) {
+        frames[i] = pending[i].get();
+    }
+    int len = audiobuffer::mpeg2udp(sock, frames, npending);
+    for (int i = 0; i < npending; ++i) {
+        pending[i] = nullptr;
+    }
+    npending = 0;
+    return len;
+}
+
+void
+audiocapture::run()
+{
+    struct timespec ts1, ts2, ts3;
+    size_t frames = 0;
+
+    while (running) {
+        sem_wait(&ready);
+
+        uint32_t index;
+        while (filled_slots.pop(index)) {
+            slot& s = slots[index];
+
+            clock_gettime(CLOCK_MONOTONIC, &ts1);
+            if (stats) {
+                stats->record(audiostats::eCaptureWait, ts1.tv_sec * 1000000000ull + ts1.tv_nsec - s.t_ns);
+            }
+            audiobuffermanager::shared_buffer audio = manager.get_buffer();
+            if (!audio) {
+                // buffer slab exhausted
+                free_slots.push(index);
+                continue;
+            }
+            audio->set_frameindex(s.frameindex);
+            audio->set_timestamp((uint32_t) s.frameindex);
+            audio->store((const char*) &pcm[index * framesize * channels], s.t_ns);
+            if (clock && clock->is_synced()) {
+                audio->set_capturetime(clock->to_server(s.t_ns));
+            }
+            free_slots.push(index);
+            audio->meter();
+            vad.update(audio->level());
+
+            int code_len = 0;
+            int send_len = -1;
+            if (dtx && !audio->active()) {
+                // silent: no encode, frames waiting for aggregation go out now and the
+                // receiver hears a keepalive instead of the skipped frames
+                if (npending) {
+                    flush();
+                }
+                clock_gettime(CLOCK_MONOTONIC, &ts2);
+                uint32_t seq = sock.nextseq();
+                if (!silent || (s.t_ns - t_keepalive >= AUDIO_DTX_KEEPALIVE_MS * 1000000ull)) {
+                    int len = audiowire::keepalive(&keepalive, sock.id(), seq, (uint32_t) s.frameindex, sock.room());
+                    send_len = (len > 0) ? sock.send(keepalive.data, len) : -1;
+                    t_keepalive = s.t_ns;
+                }
+                silent = true;
+                n_silent++;
+            } else {
+                silent = false;
+                rate.apply(encoder);
+                code_len = audio->wav2mpeg(encoder);
+                clock_gettime(CLOCK_MONOTONIC, &ts2);
+                if ((code_len > 0) && (aggregate > 1)) {
+                    send_len = 0;
+                    pending[npending++] = audio;
+                    if (npending == aggregate) {
+                        send_len = flush();
+                    }
+                } else if (code_len > 0) {
+                    send_len = audio->mpeg2udp(sock);
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &ts3);
+            if (send_len > 0) {
+                n_sent++;
+            }
+            if (stats) {
+                if (code_len > 0) {
+                    stats->record(audiostats::eEncode, (ts2.tv_sec-ts1.tv_sec)*1000000000ull + ts2.tv_nsec - ts1.tv_nsec);
+                }
+                if (send_len > 0) {
+                    stats->record(audiostats::eSend, (ts3.tv_sec-ts2.tv_sec)*1000000000ull + ts3.tv_nsec - ts2.tv_nsec);
+                }
+            }
+
+            if (!(++frames%400)) {
+                AUDIO_INFO("capture: len=%d sent-len=%d rate=%d fec=%d silent=%lu peak=%.1fdB rms=%.1fdB vad=%d floor=%.1fdB t_cb:%.03f t_cb_avg:%.03f t_cb_max:%.03f t_enc:%.03f t_send:%.03f ring-hwm=%lu overruns=%lu",
+                       code_len,
+                       send_len,
+                       rate.bitrate(),
+                       rate.loss_perc(),
+                       n_silent.load(),
+                       audiometer::to_db(audio->level().maxpeak()),
+                       audiometer::to_db(audio->level().maxrms()),
+                       audio->active(),
+                       vad.noisefloor(),
+                       t_cb_last / 1000.0,
+                       cb_avg_us(),
+                       t_cb_max / 1000.0,
+                       ((ts2.tv_sec-ts1.tv_sec)*1000000000.0 + (ts2.tv_nsec-ts1.tv_nsec))/1000.0,
+                       ((ts3.tv_sec-ts2.tv_sec)*1000000000.0 + (ts3.tv_nsec-ts2.tv_nsec))/1000.0,
+                       highwater.load(),
+                       n_overrun.load());
+            }
+            manager.put_buffer(audio);
+        }
+    }
+}
@@ -0,0 +1,139 @@
+//
+//  audiocapture.hpp
+//
+//  Capture pipeline: the audio callback only copies PCM into a
+//  preallocated slot, an encoder thread encodes and sends it.
+//
+
+#ifndef audiocapture_hpp
+#define audiocapture_hpp
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <semaphore.h>
+#include "audiobuffer.hpp"
+#include "audioring.hpp"
+#include "audiorate.hpp"
+#include "audiometer.hpp"
+#include "audiostats.hpp"
+
+#define CAPTURE_SLOTS 64
+
+class audiocapture {
+public:
+    audiocapture(audiobuffermanager& _manager,
+                 audioencoder& _encoder,
+                 audiosocket& _sock) : manager(_manager), encoder(_encoder), sock(_sock), channels(2), framesize(120), cpu(-1), aggregate(1), dtx(false), silent(false), t_keepalive(0), clock(0), stats(0), npending(0), running(false), frameindex(0)
+    {
+        sem_init(&ready, 0, 0);
+        n_captured = n_overrun = n_sent = n_silent = 0;
+        t_cb_last = t_cb_max = t_cb_sum = 0;
+        highwater = 0;
+    }
+
+    virtual ~audiocapture() {
+        stop();
+        sem_destroy(&ready);
+    }
+
+    // cpu < 0 leaves the encoder thread unpinned; aggregate > 1 packs that
+    // many frames into one datagram, costing (aggregate-1) frames of latency
+    void configure(int _channels,
+                   size_t _framesize,
+                   int _cpu = -1,
+                   int _aggregate = 1)
+    {
+        channels = _channels;
+        framesize = _framesize;
+        cpu = _cpu;
+        aggregate = (_aggregate < 1) ? 1 : (_aggregate > AUDIO_WIRE_MAX_FRAMES) ? AUDIO_WIRE_MAX_FRAMES : _aggregate;
+        pcm.assign(CAPTURE_SLOTS * framesize * channels, 0);
+        slots.resize(CAPTURE_SLOTS);
+        for (uint32_t i = 0; i < CAPTURE_SLOTS; ++i) {
+            free_slots.push(i);
+        }
+    }
+
+    // silent frames (audiovad) are not encoded or sent, the receiver gets a
+    // keepalive every AUDIO_DTX_KEEPALIVE_MS instead; also enables Opus DTX
+    void set_dtx(bool enable) {
+        dtx = enable;
+        encoder.set_dtx(enable);
+    }
+
+    // once <clock> is synchronised the frames carry their capture time on the server clock
+    void set_clock(audioclock* _clock) {
+        clock = _clock;
+    }
+
+    // capture, ring wait, encode and send histograms
+    void set_stats(audiostats* _stats) {
+        stats = _stats;
+    }
+
+    // realtime side: copy one period of interleaved int16 PCM, never blocks or allocates
+    int capture(const void* input, size_t frames);
+
+    int start();
+    void stop();
+
+    // counters, readable from any thread
+    std::atomic<uint64_t> n_captured;
+    std::atomic<uint64_t> n_overrun;
+    std::atomic<uint64_t> n_sent;
+    std::atomic<uint64_t> n_silent;   // frames skipped by DTX
+    std::atomic<uint64_t> t_cb_last;  // ns
+    std::atomic<uint64_t> t_cb_max;   // ns
+    std::atomic<uint64_t> t_cb_sum;   // ns
+    std::atomic<size_t> highwater;    // filled slots
+
+    double cb_avg_us() { return n_captured ? t_cb_sum / 1000.0 / n_captured : 0; }
+
+    // fed with the receiver reports of the server, applied by the encoder thread
+    audioratecontrol rate;
+
+    // voice activity of the captured stream, run by the encoder thread on every frame
+    audiovad vad;
+
+private:
+    void run();
+    // send the frames waiting for aggregation, returns the datagram length or -1
+    int flush();
+
+    struct slot {
+        uint64_t frameindex;
+        uint64_t t_ns;     // CLOCK_MONOTONIC at the callback
+    };
+
+    audiobuffermanager& manager;
+    audioencoder& encoder;
+    audiosocket& sock;
+    int channels;
+    size_t framesize;
+    int cpu;
+    int aggregate;
+    bool dtx;
+    bool silent;             // the last frame was skipped
+    uint64_t t_keepalive;    // CLOCK_MONOTONIC of the last keepalive
+    audiopacket_t keepalive;
+    audioclock* clock;
+    audiostats* stats;
+
+    // encoded frames waiting for the aggregated datagram
+    audiobuffermanager::shared_buffer pending[AUDIO_WIRE_MAX_FRAMES];
+    int npending;
+
+    std::vector<int16_t> pcm;          // CAPTURE_SLOTS contiguous periods
+    std::vector<slot> slots;
+    audioring<uint32_t, CAPTURE_SLOTS> free_slots;   // encoder -> callback
+    audioring<uint32_t, CAPTURE_SLOTS> filled_slots; // callback -> encoder
+    sem_t ready;
+
+    std::atomic<bool> running;
+    std::thread thread;
+    uint64_t frameindex;
+};
+
+#endif /* audiocapture_hpp */
@@ -0,0 +1,61 @@
+//
+//  audioclock.cpp
+//
+//  Monotonic clock synchronisation between audioMUX and audioSERV
+//
+
+#include "audioclock.hpp"
+
+int
+audioclock::ping(audiopacket_t* packet, uint16_t id, uint32_t seq)
+{
+    audioclock_t clock;
+    clock.t1 = now();
+    clock.t2 = clock.t3 = 0;
+    return audiowire::encode(packet, id, seq, clock);
+}
+
+int
+audioclock::answer(audiopacket_t* packet, const audiowire_t& ping, uint64_t t2)
+{
+    audioclock_t clock;
+    if (audiowire::parse(ping, clock) || !(ping.flags & AUDIO_WIRE_FLAG_PING)) {
+        return -1;
+    }
+    clock.t2 = t2;
+    clock.t3 = now();
+    return audiowire::encode(packet, AUDIO_WIRE_SERVER_ID, ping.seq, clock);
+}
+
+int
+audioclock::pong(const audiowire_t& wire, uint64_t t4)
+{
+    audioclock_t clock;
+    if (audiowire::parse(wire, clock) || !(wire.flags & AUDIO_WIRE_FLAG_PONG)) {
+        return -1;
+    }
+    if ((t4 < clock.t1) || (clock.t3 < clock.t2) || (t4 - clock.t1 < clock.t3 - clock.t2)) {
+        // not one of ours or garbled
+        return -1;
+    }
+
+    sample& s = samples[next];
+    s.rtt = (t4 - clock.t1) - (clock.t3 - clock.t2);
+    s.offset = ((int64_t) (clock.t2 - clock.t1) + (int64_t) (clock.t3 - t4)) / 2;
+    next = (next + 1) % AUDIO_CLOCK_SAMPLES;
+    if (count < AUDIO_CLOCK_SAMPLES) {
+        count++;
+    }
+
+    // the exchange with the least queueing has the least asymmetry
+    const sample* best = &samples[0];
+    for (int i = 1; i < count; ++i) {
+        if (samples[i].rtt < best->rtt) {
+            best = &samples[i];
+        }
+    }
+    offset_ns.store(best->offset, std::memory_order_relaxed);
+    rtt_ns.store(best->rtt, std::memory_order_relaxed);
+    synced.store(true, std::memory_order_release);
+    return 0;
+}
@@ -0,0 +1,67 @@
+//
+//  audioclock.hpp
+//
+//  CLOCK_MONOTONIC time stamps and an NTP style estimate of the offset
+//  between the monotonic clock of a client and the one of the server,
+//  from ping/pong exchanges over the audio socket. The server clock is the
+//  reference for the capture times carried by the frames.
+//
+
+#ifndef audioclock_hpp
+#define audioclock_hpp
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+#include "audiowire.hpp"
+
+#define AUDIO_CLOCK_SAMPLES 16     /* pongs kept, the one with the lowest rtt wins */
+#define AUDIO_PING_MS       1000   /* ping interval of a client */
+
+class audioclock {
+public:
+    audioclock() : next(0), count(0), offset_ns(0), rtt_ns(0), synced(false) {}
+
+    virtual ~audioclock() {}
+
+    // monotonic ns
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    // client: a ping stamped with the current time
+    static int ping(audiopacket_t* packet, uint16_t id, uint32_t seq);
+
+    // client: fold in a pong that arrived at <t4>, returns 0 or -1
+    int pong(const audiowire_t& wire, uint64_t t4);
+
+    // server: answer a ping that arrived at <t2>
+    static int answer(audiopacket_t* packet, const audiowire_t& ping, uint64_t t2);
+
+    // server clock = local clock + offset
+    int64_t offset() { return offset_ns.load(std::memory_order_relaxed); }
+    double rtt_ms() { return rtt_ns.load(std::memory_order_relaxed) / 1000000.0; }
+    bool is_synced() { return synced.load(std::memory_order_acquire); }
+
+    uint64_t to_server(uint64_t local) { return local + offset(); }
+    uint64_t to_local(uint64_t server) { return server - offset(); }
+
+private:
+    struct sample {
+        int64_t offset;
+        uint64_t rtt;
+    };
+
+    // written by the thread receiving the pongs
+    sample samples[AUDIO_CLOCK_SAMPLES];
+    int next;
+    int count;
+
+    std::atomic<int64_t> offset_ns;
+    std::atomic<uint64_t> rtt_ns;
+    std::atomic<bool> synced;
+};
+
+#endif /* audioclock_hpp */
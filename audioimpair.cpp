@@ -0,0 +1,127 @@
+//
+//  audioimpair.cpp
+//
+//  Gilbert-Elliott loss, delay distributions and the rate limited link
+//
+
+#include "audioimpair.hpp"
+
+audioimpairdecision
+audioimpair::decide()
+{
+    audioimpairdecision d;
+    d.index = index++;
+    n_packets++;
+
+    if (replaying) {
+        if (replay_pos < trace.size() && (trace[replay_pos].index == d.index)) {
+            d = trace[replay_pos++];
+        } else {
+            // trace ended (or does not match): pass through unchanged
+            d.copies = 1;
+            d.delay_us = 0;
+            d.reordered = false;
+        }
+    } else {
+        // a fixed number of draws per packet, so a seed gives the same decisions
+        // for the same packet numbers whatever the timing
+        double u_state = rng.uniform();
+        double u_loss = rng.uniform();
+        double u_dup = rng.uniform();
+        double u_reorder = rng.uniform();
+        double n = rng.normal();
+        double u_jitter = rng.uniform();
+
+        bad = bad ? !(u_state < config.ge_r) : (u_state < config.ge_p);
+        bool lost = u_loss < (bad ? config.loss_bad : config.loss_good);
+
+        double jitter = 0;
+        switch (config.distribution) {
+        case audioimpairconfig::eUniform:
+            jitter = u_jitter * config.jitter_ms;
+            break;
+        case audioimpairconfig::eNormal:
+            jitter = fabs(n) * config.jitter_ms;
+            break;
+        case audioimpairconfig::ePareto:
+            // shape 2.5: mostly small, now and then a long spike
+            jitter = (pow(1.0 - u_jitter, -1.0 / 2.5) - 1.0) * config.jitter_ms;
+            break;
+        }
+
+        d.copies = lost ? 0 : ((u_dup < config.duplicate) ? 2 : 1);
+        d.reordered = !lost && (u_reorder < config.reorder);
+        d.delay_us = (uint32_t) ((config.delay_ms + jitter + (d.reordered ? config.reorder_ms : 0)) * 1000.0);
+        if (lost && bad) {
+            n_burst++;
+        }
+    }
+
+    if (!d.copies) {
+        n_lost++;
+    }
+    if (d.copies > 1) {
+        n_duplicated++;
+    }
+    if (d.reordered) {
+        n_reordered++;
+    }
+    return d;
+}
+
+int
+audioimpair::schedule(const audioimpairdecision& d, size_t bytes, uint64_t now, uint64_t& release)
+{
+    uint64_t t = now;
+    if (config.rate_kbps > 0) {
+        // serialise on the link, drop tail when it is too far behind
+        if (link_free > now + (uint64_t) (config.queue_ms * 1000000.0)) {
+            n_queue_dropped++;
+            return -1;
+        }
+        uint64_t start = (link_free > now) ? link_free : now;
+        link_free = start + (uint64_t) (bytes * 8 * 1000000.0 / config.rate_kbps);
+        t = link_free;
+    }
+    t += (uint64_t) d.delay_us * 1000;
+
+    if (!d.reordered) {
+        // jitter spreads the packets out but does not reorder them
+        if (t < last_release) {
+            t = last_release;
+        }
+        last_release = t;
+    }
+    release = t;
+    return 0;
+}
+
+int
+audioimpair::replay(const char* path, char dir)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr,"error: cannot open trace %s\n", path);
+        return -1;
+    }
+    trace.clear();
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        char c;
+        unsigned long i;
+        int copies, reordered;
+        unsigned int delay;
+        if ((sscanf(line, "%c %lu %d %u %d", &c, &i, &copies, &delay, &reordered) == 5) && (c == dir)) {
+            audioimpairdecision d;
+            d.index = i;
+            d.copies = copies;
+            d.delay_us = delay;
+            d.reordered = reordered;
+            trace.push_back(d);
+        }
+    }
+    fclose(f);
+    replaying = true;
+    replay_pos = 0;
+    return 0;
+}
@@ -0,0 +1,130 @@
+//
+//  audioimpair.hpp
+//
+//  Deterministic impairment of one direction of a UDP path: delay with a
+//  jitter distribution, Gilbert-Elliott burst loss, reordering, duplication
+//  and a rate limit. The per-packet decisions come from a seeded generator
+//  (or a recorded trace), so a scenario replays packet by packet.
+//
+
+#ifndef audioimpair_hpp
+#define audioimpair_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+
+// splitmix64: the same sequence on every platform and library, unlike <random> distributions
+class audiorandom {
+public:
+    audiorandom(uint64_t _seed = 1) : state(_seed) {}
+
+    void seed(uint64_t _seed) { state = _seed; }
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    // [0,1)
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    bool chance(double p) { return (p > 0) && (uniform() < p); }
+
+    // standard normal, Box-Muller; always two draws
+    double normal() {
+        double u1 = uniform();
+        double u2 = uniform();
+        return sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * M_PI * u2);
+    }
+
+private:
+    uint64_t state;
+};
+
+struct audioimpairconfig {
+    enum Distribution { eUniform, eNormal, ePareto };
+
+    audioimpairconfig() : delay_ms(0), jitter_ms(0), distribution(eUniform),
+                          ge_p(0), ge_r(1), loss_bad(1), loss_good(0),
+                          reorder(0), reorder_ms(10), duplicate(0),
+                          rate_kbps(0), queue_ms(200) {}
+
+    double delay_ms;           // fixed one-way delay
+    double jitter_ms;          // spread added on top: uniform [0,j], |normal(0,j)| or pareto with scale j
+    Distribution distribution;
+    double ge_p;               // Gilbert-Elliott: good -> bad per packet
+    double ge_r;               // bad -> good per packet
+    double loss_bad;           // loss probability in the bad state
+    double loss_good;          // in the good state; with ge_p = 0 this is plain random loss
+    double reorder;            // probability a packet is held back by reorder_ms and overtaken
+    double reorder_ms;
+    double duplicate;          // probability a packet is sent twice
+    double rate_kbps;          // link rate, 0 unlimited
+    double queue_ms;           // drop tail once the link is this far behind
+};
+
+// what happens to one packet
+struct audioimpairdecision {
+    uint64_t index;            // packet number in this direction
+    int copies;                // 0 lost, 1, or 2 duplicated
+    uint32_t delay_us;         // delay + jitter (+ reorder hold)
+    bool reordered;            // may be overtaken, not kept in FIFO order
+};
+
+class audioimpair {
+public:
+    audioimpair() : bad(false), index(0), replaying(false), replay_pos(0), last_release(0), link_free(0) { reset(); }
+
+    virtual ~audioimpair() {}
+
+    void configure(const audioimpairconfig& _config, uint64_t seed) {
+        config = _config;
+        rng.seed(seed);
+        bad = false;
+        index = 0;
+    }
+
+    // replay the decisions recorded for direction <dir> instead of drawing them
+    int replay(const char* path, char dir);
+
+    // append each decision as "<dir> <index> <copies> <delay_us> <reordered>"
+    static void record(FILE* trace, char dir, const audioimpairdecision& d) {
+        fprintf(trace, "%c %lu %d %u %d\n", dir, d.index, d.copies, d.delay_us, d.reordered ? 1 : 0);
+    }
+
+    // decision for the next packet
+    audioimpairdecision decide();
+
+    // release time in ns of one copy of <bytes> arriving at <now>; -1 if the rate limited link drops it
+    int schedule(const audioimpairdecision& d, size_t bytes, uint64_t now, uint64_t& release);
+
+    void reset() {
+        n_packets = n_lost = n_burst = n_duplicated = n_reordered = n_queue_dropped = 0;
+    }
+
+    uint64_t n_packets;
+    uint64_t n_lost;
+    uint64_t n_burst;          // losses in the bad state
+    uint64_t n_duplicated;
+    uint64_t n_reordered;
+    uint64_t n_queue_dropped;
+
+private:
+    audioimpairconfig config;
+    audiorandom rng;
+    bool bad;
+    uint64_t index;
+
+    bool replaying;
+    std::vector<audioimpairdecision> trace;
+    size_t replay_pos;
+
+    uint64_t last_release;     // FIFO order of the not reordered packets
+    uint64_t link_free;        // rate limiter: when the link is idle again
+};
+
+#endif /* audioimpair_hpp */
@@ -0,0 +1,190 @@
+//
+//  audiolog.cpp
+//
+//  Background formatting and output of the log rings
+//
+
+#include "audiolog.hpp"
+#include <unistd.h>
+
+static const char* level_names[] = { "error", "warning", "info", "debug" };
+
+audiolog::ring*
+audiolog::own()
+{
+    static thread_local ring* mine = 0;
+    static thread_local bool tried = false;
+    if (!tried) {
+        tried = true;
+        // rings are never given back, threads that log are long lived
+        int i = n_threads.fetch_add(1, std::memory_order_relaxed);
+        if (i < AUDIO_LOG_THREADS) {
+            mine = &rings[i];
+        } else {
+            n_threads.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    return mine;
+}
+
+size_t
+audiolog::format(const audiologrecord& r, char* out, size_t len)
+{
+    size_t n = 0;
+    int arg = 0;
+    const char* p = r.fmt;
+
+    while (*p && (n + 1 < len)) {
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[n++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // flags, width and precision are kept, the length modifier is ours
+        char spec[32];
+        size_t s = 0;
+        spec[s++] = *p++;
+        while (*p && strchr("-+ #0123456789.*", *p) && (s < sizeof(spec) - 4)) {
+            spec[s++] = *p++;
+        }
+        while (*p && strchr("hlLqjzt", *p)) {
+            p++;
+        }
+        char conv = *p ? *p++ : 0;
+        if (!conv || (arg >= r.nargs)) {
+            break;
+        }
+
+        int w = 0;
+        size_t room = len - n;
+        switch (r.types[arg]) {
+        case eDouble:
+            spec[s++] = strchr("eEfFgGaA", conv) ? conv : 'f';
+            spec[s] = 0;
+            w = snprintf(out + n, room, spec, r.args[arg].d);
+            break;
+        case eString:
+            spec[s++] = 's';
+            spec[s] = 0;
+            w = snprintf(out + n, room, spec, r.text + r.args[arg].u);
+            break;
+        case ePointer:
+            spec[s++] = 'p';
+            spec[s] = 0;
+            w = snprintf(out + n, room, spec, r.args[arg].p);
+            break;
+        case eInt:
+        case eUInt:
+            if (conv == 'c') {
+                spec[s++] = 'c';
+                spec[s] = 0;
+                w = snprintf(out + n, room, spec, (int) r.args[arg].i);
+                break;
+            }
+            spec[s++] = 'l';
+            spec[s++] = 'l';
+            spec[s++] = strchr("diuxXo", conv) ? conv : ((r.types[arg] == eInt) ? 'd' : 'u');
+            spec[s] = 0;
+            if (r.types[arg] == eInt) {
+                w = snprintf(out + n, room, spec, (long long) r.args[arg].i);
+            } else {
+                w = snprintf(out + n, room, spec, (unsigned long long) r.args[arg].u);
+            }
+            break;
+        }
+        arg++;
+        if (w > 0) {
+            n += ((size_t) w < room) ? w : room - 1;
+        }
+    }
+    out[n] = 0;
+    return n;
+}
+
+void
+audiolog::write(const audiologrecord& r)
+{
+    char line[1024];
+    char msg[896];
+    format(r, msg, sizeof(msg));
+    size_t len = strlen(msg);
+    if (len && (msg[len-1] == '\n')) {
+        msg[--len] = 0;
+    }
+    int n = snprintf(line, sizeof(line), "[%.06f] %s: %s", r.t_ns / 1000000000.0, level_names[r.level & 3], msg);
+    if (r.suppressed && (n > 0) && ((size_t) n < sizeof(line))) {
+        n += snprintf(line + n, sizeof(line) - n, " (%u suppressed)", r.suppressed);
+    }
+    // errors and warnings go to stderr like before
+    FILE* out = (r.level <= AUDIO_LOG_WARNING) ? stderr : stdout;
+    fprintf(out, "%s\n", line);
+}
+
+size_t
+audiolog::drain()
+{
+    size_t n = 0;
+    int threads = n_threads.load(std::memory_order_acquire);
+    if (threads > AUDIO_LOG_THREADS) {
+        threads = AUDIO_LOG_THREADS;
+    }
+    for (int i = 0; i < threads; ++i) {
+        ring& q = rings[i];
+        size_t t = q.tail.load(std::memory_order_relaxed);
+        size_t h = q.head.load(std::memory_order_acquire);
+        for (; t != h; ++t, ++n) {
+            write(q.records[t % AUDIO_LOG_RING]);
+        }
+        q.tail.store(t, std::memory_order_release);
+    }
+    if (n) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return n;
+}
+
+void
+audiolog::run()
+{
+    uint64_t reported = 0;
+    while (running.load(std::memory_order_acquire)) {
+        drain();
+        uint64_t lost = n_dropped.load(std::memory_order_relaxed);
+        if (lost != reported) {
+            fprintf(stderr,"warning: %lu log messages dropped, ring full\n", lost - reported);
+            reported = lost;
+        }
+        usleep(AUDIO_LOG_FLUSH_MS * 1000);
+    }
+}
+
+int
+audiolog::start()
+{
+    if (running.load()) {
+        return -1;
+    }
+    running.store(true, std::memory_order_release);
+    thread = std::thread(&audiolog::run, this);
+    return 0;
+}
+
+void
+audiolog::stop()
+{
+    if (!running.load()) {
+        return;
+    }
+    running.store(false, std::memory_order_release);
+    if (thread.joinable()) {
+        thread.join();
+    }
+    // producers that saw running before the store may still add a record
+    drain();
+}
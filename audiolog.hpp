@@ -0,0 +1,230 @@
+//
+//  audiolog.hpp
+//
+//  Leveled logging that keeps stdio out of the audio and packet paths:
+//  callers copy the format pointer and the raw arguments into a fixed size
+//  record on a per-thread lock-free ring, a background thread formats and
+//  writes them. Levels above AUDIO_LOG_LEVEL are removed at compile time.
+//
+
+#ifndef audiolog_hpp
+#define audiolog_hpp
+
+#include <atomic>
+#include <thread>
+#include <type_traits>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "audioclock.hpp"
+
+#define AUDIO_LOG_ERROR   0
+#define AUDIO_LOG_WARNING 1
+#define AUDIO_LOG_INFO    2
+#define AUDIO_LOG_DEBUG   3
+
+#ifndef AUDIO_LOG_LEVEL
+#define AUDIO_LOG_LEVEL   AUDIO_LOG_INFO   /* -DAUDIO_LOG_LEVEL=3 compiles the debug messages in */
+#endif
+
+#define AUDIO_LOG_ARGS    16    /* conversions per message */
+#define AUDIO_LOG_TEXT    64    /* bytes for copies of %s arguments per message */
+#define AUDIO_LOG_RING    256   /* records per thread, a full ring drops */
+#define AUDIO_LOG_THREADS 64    /* threads that can log through a ring */
+#define AUDIO_LOG_FLUSH_MS 20   /* background thread poll interval */
+
+// one message, formatted later; <fmt> must be a string literal
+struct audiologrecord {
+    uint64_t t_ns;
+    const char* fmt;
+    uint32_t suppressed;   // messages the rate limit swallowed before this one
+    uint8_t level;
+    uint8_t nargs;
+    uint8_t ntext;
+    uint8_t types[AUDIO_LOG_ARGS];
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void* p;
+    } args[AUDIO_LOG_ARGS];
+    char text[AUDIO_LOG_TEXT];
+};
+
+// per call site limit of messages per second, see AUDIO_LOG_RATE
+class audiologlimit {
+public:
+    audiologlimit(uint32_t _per_s) : per_s(_per_s), window(0), n(0), suppressed(0) {}
+
+    // true if the message may go out, <dropped> is what was swallowed since the last one
+    bool allow(uint32_t& dropped) {
+        uint64_t now = audioclock::now();
+        uint64_t w = window.load(std::memory_order_relaxed);
+        if ((now - w >= 1000000000ull) && window.compare_exchange_strong(w, now, std::memory_order_relaxed)) {
+            n.store(0, std::memory_order_relaxed);
+        }
+        if (n.fetch_add(1, std::memory_order_relaxed) < per_s) {
+            dropped = suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+        suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+private:
+    uint32_t per_s;
+    std::atomic<uint64_t> window;
+    std::atomic<uint32_t> n;
+    std::atomic<uint32_t> suppressed;
+};
+
+class audiolog {
+public:
+    enum ArgType { eInt, eUInt, eDouble, eString, ePointer };
+
+    static audiolog& instance() {
+        static audiolog log;
+        return log;
+    }
+
+    virtual ~audiolog() { stop(); }
+
+    // start the writer thread; until then messages are written synchronously
+    int start();
+
+    // drain all rings and stop the writer thread
+    void stop();
+
+    // runtime filter on top of the compile time one
+    void set_level(int _level) { level.store(_level, std::memory_order_relaxed); }
+
+    template<typename... Args>
+    void log(int _level, uint32_t suppressed, const char* fmt, Args... args) {
+        if (_level > level.load(std::memory_order_relaxed)) {
+            return;
+        }
+        static_assert(sizeof...(Args) <= AUDIO_LOG_ARGS, "too many arguments for a log message");
+        audiologrecord local;
+        ring* q = running.load(std::memory_order_acquire) ? own() : 0;
+        size_t h = 0;
+        audiologrecord* r = &local;
+        if (q) {
+            h = q->head.load(std::memory_order_relaxed);
+            if (h - q->tail.load(std::memory_order_acquire) >= AUDIO_LOG_RING) {
+                n_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            r = &q->records[h % AUDIO_LOG_RING];
+        }
+        r->t_ns = audioclock::now();
+        r->fmt = fmt;
+        r->suppressed = suppressed;
+        r->level = _level;
+        r->nargs = 0;
+        r->ntext = 0;
+        int unpack[] = {0, (pack(*r, args), 0)...};
+        (void) unpack;
+        if (q) {
+            q->head.store(h + 1, std::memory_order_release);
+        } else {
+            // not started (or out of rings): write it ourselves
+            write(*r);
+        }
+    }
+
+    // messages lost because a ring was full or no ring was left
+    uint64_t dropped() { return n_dropped.load(std::memory_order_relaxed); }
+
+    // printf style formatting of a record into <out>, returns the length
+    static size_t format(const audiologrecord& r, char* out, size_t len);
+
+private:
+    audiolog() : level(AUDIO_LOG_LEVEL), running(false), n_threads(0), n_dropped(0) {
+        for (auto& q : rings) {
+            q.head.store(0, std::memory_order_relaxed);
+            q.tail.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    template<typename T>
+    static void pack(audiologrecord& r, T v) {
+        int i = r.nargs++;
+        if constexpr (std::is_floating_point<T>::value) {
+            r.types[i] = eDouble;
+            r.args[i].d = v;
+        } else if constexpr (std::is_same<typename std::decay<T>::type, char*>::value ||
+                             std::is_same<typename std::decay<T>::type, const char*>::value) {
+            // copy, the caller's string may be gone when the writer gets to it
+            r.types[i] = eString;
+            r.args[i].u = r.ntext;
+            size_t n = v ? strnlen(v, AUDIO_LOG_TEXT - 1 - r.ntext) : 0;
+            memcpy(r.text + r.ntext, v, n);
+            r.ntext += n;
+            r.text[r.ntext++] = 0;
+            if (r.ntext >= AUDIO_LOG_TEXT) {
+                r.ntext = AUDIO_LOG_TEXT - 1;
+            }
+        } else if constexpr (std::is_pointer<T>::value) {
+            r.types[i] = ePointer;
+            r.args[i].p = (const void*) v;
+        } else if constexpr (std::is_signed<T>::value) {
+            r.types[i] = eInt;
+            r.args[i].i = v;
+        } else {
+            r.types[i] = eUInt;
+            r.args[i].u = v;
+        }
+    }
+
+    // single producer (the owning thread), single consumer (the writer); records are
+    // written in place, audioring would copy them twice
+    struct ring {
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+        audiologrecord records[AUDIO_LOG_RING];
+    };
+
+    // the ring of the calling thread, 0 if all are taken
+    ring* own();
+    void write(const audiologrecord& r);
+    void run();
+    size_t drain();
+
+    std::atomic<int> level;
+    std::atomic<bool> running;
+    std::thread thread;
+    ring rings[AUDIO_LOG_THREADS];
+    std::atomic<int> n_threads;       // rings handed out
+    std::atomic<uint64_t> n_dropped;
+};
+
+#define AUDIO_LOG(level, fmt, ...) \
+    do { if ((level) <= AUDIO_LOG_LEVEL) audiolog::instance().log(level, 0, "" fmt, ##__VA_ARGS__); } while (0)
+
+// at most <per_s> messages per second from this call site, the next one reports what was suppressed
+#define AUDIO_LOG_RATE(level, per_s, fmt, ...) \
+    do { \
+        if ((level) <= AUDIO_LOG_LEVEL) { \
+            static audiologlimit audio_log_limit(per_s); \
+            uint32_t audio_log_dropped; \
+            if (audio_log_limit.allow(audio_log_dropped)) \
+                audiolog::instance().log(level, audio_log_dropped, "" fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define AUDIO_ERROR(fmt, ...)   AUDIO_LOG(AUDIO_LOG_ERROR, fmt, ##__VA_ARGS__)
+#define AUDIO_WARNING(fmt, ...) AUDIO_LOG(AUDIO_LOG_WARNING, fmt, ##__VA_ARGS__)
+
+#if AUDIO_LOG_LEVEL >= AUDIO_LOG_INFO
+#define AUDIO_INFO(fmt, ...)    AUDIO_LOG(AUDIO_LOG_INFO, fmt, ##__VA_ARGS__)
+#else
+#define AUDIO_INFO(fmt, ...)    do {} while (0)
+#endif
+
+#if AUDIO_LOG_LEVEL >= AUDIO_LOG_DEBUG
+#define AUDIO_DEBUG(fmt, ...)   AUDIO_LOG(AUDIO_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define AUDIO_DEBUG(fmt, ...)   do {} while (0)
+#endif
+
+#endif /* audiolog_hpp */
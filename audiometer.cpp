@@ -0,0 +1,261 @@
+//
+//  audiometer.cpp
+//
+//  Level metering and voice activity detection
+//
+
+#include "audiometer.hpp"
+#include <algorithm>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AUDIO_METER_X86 1
+#endif
+
+float
+audiolevel_t::maxpeak() const
+{
+    float m = 0;
+    for (int c = 0; c < channels; ++c) {
+        if (peak[c] > m) {
+            m = peak[c];
+        }
+    }
+    return m;
+}
+
+float
+audiolevel_t::maxrms() const
+{
+    float m = 0;
+    for (int c = 0; c < channels; ++c) {
+        if (rms[c] > m) {
+            m = rms[c];
+        }
+    }
+    return m;
+}
+
+void
+audiometer::scalar(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy)
+{
+    for (int c = 0; c < channels; ++c) {
+        peak[c] = 0;
+        energy[c] = 0;
+    }
+    for (size_t i = 0; i < frames; ++i) {
+        for (int c = 0; c < channels; ++c) {
+            int32_t x = pcm[i*channels + c];
+            int32_t a = (x < 0) ? std::min(-x, 32767) : x;
+            if (a > peak[c]) {
+                peak[c] = a;
+            }
+            energy[c] += x * x;
+        }
+    }
+}
+
+#ifdef AUDIO_METER_X86
+
+void
+audiometer::sse2(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy)
+{
+    if ((channels != 1) && (channels != 2)) {
+        scalar(pcm, frames, channels, peak, energy);
+        return;
+    }
+    const size_t n = frames * channels;
+    const __m128i zero = _mm_setzero_si128();
+    // stereo: the even int16 lanes are left, the odd ones right; mono: both are the channel
+    const __m128i low = _mm_set1_epi32(0x0000ffff);
+    __m128i vpeak = zero;
+    __m128i e0 = zero;
+    __m128i e1 = zero;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pcm + i));
+        // |x|, saturating so -32768 reads 32767
+        vpeak = _mm_max_epi16(vpeak, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+        // squares of the even and odd lanes apart, a pair of full scale squares overflows int32
+        __m128i l = _mm_and_si128(x, low);
+        __m128i r = _mm_srli_epi32(x, 16);
+        __m128i s0 = _mm_madd_epi16(l, l);
+        __m128i s1 = _mm_madd_epi16(r, r);
+        // widen to 64 bit before accumulating, the squares are positive
+        e0 = _mm_add_epi64(e0, _mm_add_epi64(_mm_unpacklo_epi32(s0, zero), _mm_unpackhi_epi32(s0, zero)));
+        e1 = _mm_add_epi64(e1, _mm_add_epi64(_mm_unpacklo_epi32(s1, zero), _mm_unpackhi_epi32(s1, zero)));
+    }
+
+    int16_t p[8];
+    int64_t e[2][2];
+    _mm_storeu_si128((__m128i*) p, vpeak);
+    _mm_storeu_si128((__m128i*) e[0], e0);
+    _mm_storeu_si128((__m128i*) e[1], e1);
+    if (channels == 2) {
+        peak[0] = std::max(std::max(p[0], p[2]), std::max(p[4], p[6]));
+        peak[1] = std::max(std::max(p[1], p[3]), std::max(p[5], p[7]));
+        energy[0] = e[0][0] + e[0][1];
+        energy[1] = e[1][0] + e[1][1];
+    } else {
+        peak[0] = 0;
+        for (int k = 0; k < 8; ++k) {
+            peak[0] = std::max(peak[0], (int32_t) p[k]);
+        }
+        energy[0] = e[0][0] + e[0][1] + e[1][0] + e[1][1];
+    }
+
+    // tail
+    for (; i < n; ++i) {
+        int c = i % channels;
+        int32_t x = pcm[i];
+        int32_t a = (x < 0) ? std::min(-x, 32767) : x;
+        if (a > peak[c]) {
+            peak[c] = a;
+        }
+        energy[c] += x * x;
+    }
+}
+
+__attribute__((target("avx2")))
+void
+audiometer::avx2(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy)
+{
+    if ((channels != 1) && (channels != 2)) {
+        scalar(pcm, frames, channels, peak, energy);
+        return;
+    }
+    const size_t n = frames * channels;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low = _mm256_set1_epi32(0x0000ffff);
+    __m256i vpeak = zero;
+    __m256i e0 = zero;
+    __m256i e1 = zero;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(pcm + i));
+        vpeak = _mm256_max_epi16(vpeak, _mm256_max_epi16(x, _mm256_subs_epi16(zero, x)));
+        __m256i l = _mm256_and_si256(x, low);
+        __m256i r = _mm256_srli_epi32(x, 16);
+        __m256i s0 = _mm256_madd_epi16(l, l);
+        __m256i s1 = _mm256_madd_epi16(r, r);
+        e0 = _mm256_add_epi64(e0, _mm256_add_epi64(_mm256_unpacklo_epi32(s0, zero), _mm256_unpackhi_epi32(s0, zero)));
+        e1 = _mm256_add_epi64(e1, _mm256_add_epi64(_mm256_unpacklo_epi32(s1, zero), _mm256_unpackhi_epi32(s1, zero)));
+    }
+
+    int16_t p[16];
+    int64_t e[2][4];
+    _mm256_storeu_si256((__m256i*) p, vpeak);
+    _mm256_storeu_si256((__m256i*) e[0], e0);
+    _mm256_storeu_si256((__m256i*) e[1], e1);
+    for (int c = 0; c < channels; ++c) {
+        peak[c] = 0;
+        for (int k = c; k < 16; k += channels) {
+            peak[c] = std::max(peak[c], (int32_t) p[k]);
+        }
+    }
+    if (channels == 2) {
+        energy[0] = e[0][0] + e[0][1] + e[0][2] + e[0][3];
+        energy[1] = e[1][0] + e[1][1] + e[1][2] + e[1][3];
+    } else {
+        energy[0] = e[0][0] + e[0][1] + e[0][2] + e[0][3] + e[1][0] + e[1][1] + e[1][2] + e[1][3];
+    }
+
+    // tail, n is a multiple of channels so the lanes stay aligned to them
+    for (; i < n; ++i) {
+        int c = i % channels;
+        int32_t x = pcm[i];
+        int32_t a = (x < 0) ? std::min(-x, 32767) : x;
+        if (a > peak[c]) {
+            peak[c] = a;
+        }
+        energy[c] += x * x;
+    }
+}
+
+audiometer::kernel_t
+audiometer::kernel()
+{
+    static const kernel_t best = __builtin_cpu_supports("avx2") ? avx2 : sse2;
+    return best;
+}
+
+const char*
+audiometer::isa()
+{
+    return (kernel() == avx2) ? "avx2" : "sse2";
+}
+
+#else
+
+void
+audiometer::sse2(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy)
+{
+    scalar(pcm, frames, channels, peak, energy);
+}
+
+void
+audiometer::avx2(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy)
+{
+    scalar(pcm, frames, channels, peak, energy);
+}
+
+audiometer::kernel_t
+audiometer::kernel()
+{
+    return scalar;
+}
+
+const char*
+audiometer::isa()
+{
+    return "scalar";
+}
+
+#endif
+
+void
+audiometer::measure(const int16_t* pcm, size_t frames, int channels, audiolevel_t& level)
+{
+    int32_t peak[AUDIO_METER_CHANNELS];
+    int64_t energy[AUDIO_METER_CHANNELS];
+    if (channels > AUDIO_METER_CHANNELS) {
+        channels = AUDIO_METER_CHANNELS;
+    }
+    kernel()(pcm, frames, channels, peak, energy);
+
+    for (int c = 0; c < channels; ++c) {
+        level.peak[c] = peak[c] / 32768.0f;
+        level.rms[c] = frames ? sqrtf((float) energy[c] / frames) / 32768.0f : 0;
+    }
+    level.channels = channels;
+    level.active = false;
+    level.metered = true;
+}
+
+double
+audiometer::to_db(double linear)
+{
+    return (linear > 1e-6) ? 20.0 * log10(linear) : -120.0;
+}
+
+bool
+audiovad::update(audiolevel_t& level)
+{
+    double db = audiometer::to_db(level.maxrms());
+
+    // the floor drops with the quietest frames and creeps up under steady noise
+    if (db < floor_db) {
+        floor_db = std::max(db, AUDIO_VAD_MIN_DB);
+    } else {
+        floor_db = std::min(floor_db + AUDIO_VAD_RISE_DB_S * frame_ms / 1000.0, AUDIO_VAD_FLOOR_MAX_DB);
+    }
+
+    if ((db > AUDIO_VAD_MIN_DB) && (db > floor_db + AUDIO_VAD_MARGIN_DB)) {
+        hangover = AUDIO_VAD_HANGOVER_MS;
+    } else if (hangover > 0) {
+        hangover -= frame_ms;
+    }
+    level.active = (hangover > 0);
+    return level.active;
+}
@@ -0,0 +1,72 @@
+//
+//  audiometer.hpp
+//
+//  Level metering and voice activity detection of interleaved int16 PCM.
+//  The metering kernel is picked at runtime: AVX2, SSE2 or scalar.
+//
+
+#ifndef audiometer_hpp
+#define audiometer_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AUDIO_METER_CHANNELS   8       // channels metered per frame
+#define AUDIO_VAD_MIN_DB       -60.0   // quieter frames are never active
+#define AUDIO_VAD_MARGIN_DB    9.0     // above the noise floor counts as active
+#define AUDIO_VAD_FLOOR_MAX_DB -40.0   // the floor never rises above, louder is always active
+#define AUDIO_VAD_RISE_DB_S    0.5     // noise floor adaption upwards, downwards it follows at once
+#define AUDIO_VAD_HANGOVER_MS  200.0   // active frames keep the stream active this long
+
+// levels of one frame, linear and relative to full scale
+struct audiolevel_t {
+    float peak[AUDIO_METER_CHANNELS];
+    float rms[AUDIO_METER_CHANNELS];
+    int channels;
+    bool active;      // voice activity, set by audiovad
+    bool metered;     // false until measured
+
+    float maxpeak() const;
+    float maxrms() const;
+};
+
+class audiometer {
+public:
+    // sample peak and sum of squares per channel of <frames> interleaved frames
+    typedef void (*kernel_t)(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy);
+
+    static void scalar(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy);
+    // vector kernels handle mono and stereo, more channels fall back to scalar
+    static void sse2(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy);
+    static void avx2(const int16_t* pcm, size_t frames, int channels, int32_t* peak, int64_t* energy);
+
+    // the best kernel of this cpu and its name
+    static kernel_t kernel();
+    static const char* isa();
+
+    // peak and rms of one frame, <active> is left false
+    static void measure(const int16_t* pcm, size_t frames, int channels, audiolevel_t& level);
+
+    static double to_db(double linear);
+};
+
+// Energy detector with an adaptive noise floor and a hangover, one per stream
+class audiovad {
+public:
+    audiovad() : floor_db(AUDIO_VAD_MIN_DB), frame_ms(2.5), hangover(0) {}
+    virtual ~audiovad() {}
+
+    void configure(double _frame_ms) { frame_ms = _frame_ms; }
+
+    // classify a metered frame, sets and returns level.active
+    bool update(audiolevel_t& level);
+
+    double noisefloor() { return floor_db; }
+
+private:
+    double floor_db;
+    double frame_ms;
+    double hangover;   // ms left
+};
+
+#endif /* audiometer_hpp */
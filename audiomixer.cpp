@@ -0,0 +1,437 @@
+//
+//  audiomixer.cpp
+//
+//  Server side "minus-one" mixer
+//
+
+#include "audiomixer.hpp"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static double elapsed_ms(struct timespec& ts1, struct timespec& ts2)
+{
+    return ((ts2.tv_sec-ts1.tv_sec)*1000000000.0 + (ts2.tv_nsec-ts1.tv_nsec))/1000000.0;
+}
+
+void
+audiomixer::accumulate(int32_t* sum, const int16_t* in, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= n; i += 8) {
+        __m128i x  = _mm_loadu_si128((const __m128i*)(in + i));
+        // sign extend 8 x int16 into 2 x 4 x int32
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        __m128i s0 = _mm_loadu_si128((const __m128i*)(sum + i));
+        __m128i s1 = _mm_loadu_si128((const __m128i*)(sum + i + 4));
+        _mm_storeu_si128((__m128i*)(sum + i), _mm_add_epi32(s0, lo));
+        _mm_storeu_si128((__m128i*)(sum + i + 4), _mm_add_epi32(s1, hi));
+    }
+#endif
+    for (; i < n; ++i) {
+        sum[i] += in[i];
+    }
+}
+
+void
+audiomixer::minusone(int16_t* out, const int32_t* sum, const int16_t* self, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= n; i += 8) {
+        __m128i s0 = _mm_loadu_si128((const __m128i*)(sum + i));
+        __m128i s1 = _mm_loadu_si128((const __m128i*)(sum + i + 4));
+        if (self) {
+            __m128i x  = _mm_loadu_si128((const __m128i*)(self + i));
+            s0 = _mm_sub_epi32(s0, _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+            s1 = _mm_sub_epi32(s1, _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+        }
+        // packs saturates to [-32768,32767]
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(s0, s1));
+    }
+#endif
+    for (; i < n; ++i) {
+        int32_t v = sum[i] - (self ? self[i] : 0);
+        if (v > 32767) v = 32767;
+        if (v < -32768) v = -32768;
+        out[i] = (int16_t) v;
+    }
+}
+
+audiomixer::shared_participant
+audiomixer::participant(uint16_t id, const struct sockaddr_in& addr)
+{
+    const audiosessionkey key(id, addr);
+    const uint64_t now = audioclock::now();
+    {
+        // fast path, receive workers look up known sessions concurrently
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        auto it = table.find(key);
+        if (it != table.end()) {
+            it->second->last_seen.store(now, std::memory_order_relaxed);
+            return it->second;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> guard(mMutex);
+    auto it = table.find(key);
+    if (it != table.end()) {
+        it->second->last_seen.store(now, std::memory_order_relaxed);
+        return it->second;
+    }
+
+    shared_participant p = std::make_shared<audioparticipant>(id, addr);
+    if (arena.checkout(p->decoder) || arena.checkout(p->encoder)) {
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "no codec left for participant %u", id);
+        return nullptr;
+    }
+    p->rxstats.configure(1000.0 * framesize / samplingrate);
+    p->rate.configure(AUDIO_RATE_MIN, bitrate, bitrate, 0, 1000.0 * framesize / samplingrate);
+    table.emplace(key, p);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    AUDIO_INFO("new participant %u from %s:%u participants=%lu", id, ip, ntohs(addr.sin_port), table.size());
+    return p;
+}
+
+size_t
+audiomixer::evict(uint64_t idle_ms)
+{
+    const uint64_t now = audioclock::now();
+    const uint64_t idle_ns = idle_ms * 1000000ull;
+    size_t evicted = 0;
+
+    std::unique_lock<std::shared_mutex> guard(mMutex);
+    for (auto it = table.begin(); it != table.end(); ) {
+        uint64_t seen = it->second->last_seen.load(std::memory_order_relaxed);
+        if ((now > seen) && (now - seen > idle_ns)) {
+            AUDIO_INFO("participant %u left after %.1f s idle participants=%lu",
+                       it->first.id, (now - seen) / 1000000000.0, table.size() - 1);
+            // the last reference (here or in the mixer's active list) releases codecs and frames
+            it = table.erase(it);
+            evicted++;
+        } else {
+            ++it;
+        }
+    }
+    return evicted;
+}
+
+int
+audiomixer::add(const audiowire_t& wire, const struct sockaddr_in& addr)
+{
+    shared_participant p = participant(wire.id, addr);
+    if (!p) {
+        return -1;
+    }
+
+    if (wire.flags & AUDIO_WIRE_FLAG_DTX) {
+        // silent on purpose: nothing to queue, decode or mix until the audio resumes
+        p->rxframe = audiowire::unwrap(wire.seq, p->rxframe);
+        p->rxstats.skipped(p->rxframe);
+        p->talking.store(false, std::memory_order_relaxed);
+        return 0;
+    }
+    p->talking.store(true, std::memory_order_relaxed);
+
+    audiowire_t frames[AUDIO_WIRE_MAX_FRAMES];
+    int k = audiowire::split(wire, frames, AUDIO_WIRE_MAX_FRAMES, framesize, 1000000000ull * framesize / samplingrate);
+    if (k < 0) {
+        return -1;
+    }
+    // the mix goes back the way the participant sends
+    p->aggregate.store(k, std::memory_order_relaxed);
+
+    for (int i = 0; i < k; ++i) {
+        audiobuffermanager::shared_buffer audio = manager.get_buffer();
+        if (!audio) {
+            // buffer slab exhausted
+            return -1;
+        }
+        p->rxframe = audiowire::unwrap(frames[i].seq, p->rxframe);
+        p->rxstats.received(p->rxframe);
+        audio->udp2mpeg(frames[i], p->rxframe);
+        if (!p->inbound.add_output(audio)) {
+            manager.put_buffer(audio);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+audiomixer::report(const audiowire_t& wire, const struct sockaddr_in& addr)
+{
+    audioreport_t report;
+    if (audiowire::parse(wire, report)) {
+        return -1;
+    }
+
+    shared_participant p;
+    {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        auto it = table.find(audiosessionkey(wire.id, addr));
+        if (it == table.end()) {
+            return -1;
+        }
+        p = it->second;
+        p->last_seen.store(audioclock::now(), std::memory_order_relaxed);
+    }
+    // reports are steered like the audio, so one worker updates a participant
+    p->rate.update(report);
+    return 0;
+}
+
+int
+audiomixer::flush(audioparticipant& p, audiopacket_t* packet)
+{
+    audiobuffer* frames[AUDIO_WIRE_MAX_FRAMES];
+    for (int j = 0; j < p.npending; ++j) {
+        frames[j] = p.pending[j].get();
+    }
+    int len = audiobuffer::mpeg2udp(packet, AUDIO_WIRE_SERVER_ID, frames, p.npending);
+    for (int j = 0; j < p.npending; ++j) {
+        p.pending[j] = nullptr;
+    }
+    p.npending = 0;
+    return len;
+}
+
+int
+audiomixer::mix(audiosocket& audiosock)
+{
+    struct timespec ts1, ts2;
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+    const size_t n = framesize*channels;
+
+    active.clear();
+    {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        for (auto it = table.begin(); it != table.end(); ++it) {
+            active.push_back(it->second);
+        }
+    }
+
+    std::fill(sum.begin(), sum.end(), 0);
+
+    size_t speakers = 0;
+    size_t talkers = 0;
+    size_t deepest = 0;
+    uint64_t drops = 0;
+    uint64_t concealed = 0;
+    // the two oldest capture times, a mix is stamped with the oldest one it contains
+    uint64_t oldest[2] = {0, 0};
+    audioparticipant* oldest_owner = nullptr;
+    const uint64_t now = audioclock::now();
+    // decode one frame per participant and build the full sum
+    for (auto& p : active) {
+        p->pcm = nullptr;
+
+        p->talker = p->talking.load(std::memory_order_relaxed) || p->inbound.output_size();
+        if (!p->talker) {
+            // in DTX: nothing to decode or accumulate
+            continue;
+        }
+        talkers++;
+
+        // bound the latency: drop what we cannot play in time
+        // aggregated frames arrive in bursts, leave room for two of them
+        size_t k = p->aggregate.load(std::memory_order_relaxed);
+        size_t depth = p->inbound.output_size();
+        if (depth > deepest) {
+            deepest = depth;
+        }
+        while (p->inbound.output_size() > std::max(maxqueue, 2*k)) {
+            manager.put_buffer(p->inbound.get_output());
+            p->n_dropped++;
+            drops++;
+        }
+
+        audiobuffermanager::shared_buffer audio = p->inbound.get_output();
+        if (!audio) {
+            // a talker's frame is late or lost: its decoder conceals the gap, Opus fades it out
+            if (p->missing++ >= AUDIO_MIXER_PLC_FRAMES) {
+                continue;
+            }
+            audio = manager.get_buffer();
+            if (!audio) {
+                continue;
+            }
+            if (audio->plc2wav(p->decoder) != (int)framesize) {
+                manager.put_buffer(audio);
+                continue;
+            }
+            accumulate(sum.data(), (const int16_t*) audio->ptr(), n);
+            p->pcm = audio;
+            speakers++;
+            concealed++;
+            continue;
+        }
+        p->missing = 0;
+
+        uint64_t t_dec = stats ? audioclock::now() : 0;
+        if (stats) {
+            stats->record(audiostats::eQueueWait, t_dec - audio->stored());
+        }
+        int decoded = audio->mpeg2wav(p->decoder);
+        if (stats) {
+            stats->record(audiostats::eDecode, audioclock::now() - t_dec);
+        }
+        if (decoded == (int)framesize) {
+            accumulate(sum.data(), (const int16_t*) audio->ptr(), n);
+            p->pcm = audio;
+            speakers++;
+
+            uint64_t capture = audio->capture();
+            if (capture && (capture < now)) {
+                p->latency = (now - capture) / 1000000.0;
+                l_sum += p->latency;
+                l_n++;
+                if (p->latency > l_max) {
+                    l_max = p->latency;
+                }
+                if (!oldest[0] || (capture < oldest[0])) {
+                    oldest[1] = oldest[0];
+                    oldest[0] = capture;
+                    oldest_owner = p.get();
+                } else if (!oldest[1] || (capture < oldest[1])) {
+                    oldest[1] = capture;
+                }
+            }
+        } else {
+            manager.put_buffer(audio);
+        }
+    }
+
+    // per participant a mix, a receiver report and a keepalive slot
+    const size_t np = active.size();
+    if (outbound.size() < 3*np) {
+        outbound.resize(3*np);
+    }
+    const bool reporting = !(ticks % report_ticks);
+
+    // everyone gets the sum without himself
+    for (size_t i = 0; i < np; ++i) {
+        auto& p = active[i];
+
+        // a talker's late frame is still a gap to conceal, only DTX of all others is silence
+        if (dtx && (talkers <= (p->talker ? 1u : 0u))) {
+            // nobody else talks: no encode, the keepalive keeps the listener's playout in step
+            if (p->npending) {
+                int len = flush(*p, &outbound[i]);
+                if (len > 0) {
+                    audiosock.queue(outbound[i].data, len, p->addr);
+                }
+            }
+            ++p->txframe;
+            if (!p->silent || (ticks - p->keepalive_tick >= keepalive_ticks)) {
+                int len = audiowire::keepalive(&outbound[2*np + i], AUDIO_WIRE_SERVER_ID, (uint32_t) p->txframe, p->txframe * framesize);
+                if (len > 0) {
+                    audiosock.queue(outbound[2*np + i].data, len, p->addr);
+                }
+                p->keepalive_tick = ticks;
+            }
+            p->silent = true;
+        } else {
+            p->silent = false;
+            minusone(mixed.data(), sum.data(), p->pcm ? (const int16_t*) p->pcm->ptr() : 0, n);
+
+            audiobuffermanager::shared_buffer out = manager.get_buffer();
+            if (out) {
+                out->store((const char*) mixed.data());
+                // minus-one: the listener's own frame does not count
+                out->set_capturetime((oldest_owner == p.get()) ? oldest[1] : oldest[0]);
+                p->rate.apply(p->encoder);
+                uint64_t t_enc = stats ? audioclock::now() : 0;
+                int encoded = out->wav2mpeg(p->encoder);
+                if (stats) {
+                    stats->record(audiostats::eEncode, audioclock::now() - t_enc);
+                }
+                if (encoded > 0) {
+                    out->set_frameindex(++p->txframe);
+                    out->set_timestamp(p->txframe * framesize);
+                    int k = p->aggregate.load(std::memory_order_relaxed);
+                    int len = 0;
+                    // frames already pending go out together, even if the participant switched back
+                    if ((k > 1) || p->npending) {
+                        p->pending[p->npending++] = out;
+                        if (p->npending >= k) {
+                            len = flush(*p, &outbound[i]);
+                        }
+                    } else {
+                        len = out->mpeg2udp(&outbound[i], AUDIO_WIRE_SERVER_ID);
+                    }
+                    if (len > 0) {
+                        audiosock.queue(outbound[i].data, len, p->addr);
+                    }
+                }
+                manager.put_buffer(out);
+            }
+        }
+
+        if (reporting) {
+            audiopacket_t& rr = outbound[np + i];
+            audioreport_t report = p->rxstats.report(p->n_dropped);
+            int len = audiowire::encode(&rr, AUDIO_WIRE_SERVER_ID, (uint32_t) (ticks / report_ticks), report);
+            if (len > 0) {
+                audiosock.queue(rr.data, len, p->addr);
+            }
+        }
+    }
+
+    // the whole fan-out of this tick in one system call
+    uint64_t t_send = stats ? audioclock::now() : 0;
+    audiosock.flush();
+    if (stats) {
+        stats->record(audiostats::eSend, audioclock::now() - t_send);
+    }
+
+    for (auto& p : active) {
+        if (p->pcm) {
+            manager.put_buffer(p->pcm);
+            p->pcm = nullptr;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts2);
+
+    if (stats) {
+        stats->record(audiostats::eMix, (ts2.tv_sec-ts1.tv_sec)*1000000000ull + ts2.tv_nsec - ts1.tv_nsec);
+        stats->add(audiostats::eDrops, drops);
+        if (concealed) {
+            stats->add(audiostats::eConcealed, concealed);
+        }
+    }
+    n_concealed += concealed;
+    last_depth.store(deepest, std::memory_order_relaxed);
+
+    t_last = elapsed_ms(ts1, ts2);
+    t_sum += t_last;
+    if (t_last > t_max) {
+        t_max = t_last;
+    }
+    ticks++;
+
+    if (!(ticks%400)) {
+        AUDIO_INFO("mixer: room=%u participants=%lu talkers=%lu speakers=%lu concealed=%lu rate=%d t_mix:%.03f t_avg:%.03f t_max:%.03f latency=%.03f latency_avg=%.03f latency_max=%.03f",
+               room,
+               active.size(),
+               talkers,
+               speakers,
+               n_concealed,
+               active.size() ? active[0]->rate.bitrate() : 0,
+               t_last,
+               avg_cost(),
+               t_max,
+               active.size() ? active[0]->latency : 0,
+               avg_latency(),
+               l_max);
+    }
+
+    return active.size();
+}
@@ -0,0 +1,203 @@
+//
+//  audiomixer.hpp
+//
+//  Server side "minus-one" mixer: every participant receives the sum of
+//  all other participants, encoded into a single stream.
+//
+
+#ifndef audiomixer_hpp
+#define audiomixer_hpp
+
+#include <unordered_map>
+#include <shared_mutex>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+#include "audiobuffer.hpp"
+#include "audioring.hpp"
+#include "audiorate.hpp"
+#include "audiostats.hpp"
+
+#define AUDIO_SESSION_TIMEOUT_MS 10000  // a participant silent for this long is evicted
+#define AUDIO_MIXER_PLC_FRAMES   40     // late frames of a talker concealed in a row, then it is left out
+
+class audioparticipant {
+public:
+    audioparticipant(uint16_t _id,
+                     const struct sockaddr_in& _addr) : id(_id), addr(_addr), txframe(0), rxframe(0), n_dropped(0), latency(0), aggregate(1), npending(0), last_seen(audioclock::now()), talking(false), talker(false), silent(false), keepalive_tick(0), missing(0) {}
+
+    virtual ~audioparticipant() {}
+
+    uint16_t id;                 // participant id of the wire header
+    struct sockaddr_in addr;     // where the mix is sent to
+    audiodecoder decoder;        // inbound stream, checked out of the mixer arena
+    audioencoder encoder;        // outbound mix
+    audioringqueue<> inbound;    // received, still encoded frames (receiver -> mixer)
+    audiobuffermanager::shared_buffer pcm; // decoded frame of the current tick
+    uint64_t txframe;
+    uint64_t rxframe;            // unwrapped sequence of the last received frame
+    audioreceiverstats rxstats;  // inbound stream, reported back to the participant
+    audioratecontrol rate;       // outbound mix, driven by the participant's reports
+    uint32_t n_dropped;          // inbound frames the mixer could not play in time
+    double latency;              // capture to mix of the last frame in ms, 0 until the participant is synchronised
+    std::atomic<int> aggregate;  // frames per datagram, as the participant sends them
+    audiobuffermanager::shared_buffer pending[AUDIO_WIRE_MAX_FRAMES]; // mixes not sent yet
+    int npending;
+    std::atomic<uint64_t> last_seen; // monotonic ns of the last datagram, drives the idle eviction
+    std::atomic<bool> talking;   // false while the participant sends DTX keepalives
+    bool talker;                 // talking in the current tick, mixer only
+    bool silent;                 // its mix is in DTX: nobody else talks
+    uint64_t keepalive_tick;     // mixer tick of the last keepalive sent to it
+    size_t missing;              // ticks in a row without a frame while talking, mixer only
+};
+
+// A session is the pair of participant id and the address it sends from:
+// a rebinding NAT opens a new session and the old one times out.
+struct audiosessionkey {
+    audiosessionkey(uint16_t _id, const struct sockaddr_in& a) : addr(a.sin_addr.s_addr), port(a.sin_port), id(_id) {}
+
+    bool operator==(const audiosessionkey& o) const {
+        return (addr == o.addr) && (port == o.port) && (id == o.id);
+    }
+
+    uint32_t addr;
+    uint16_t port;
+    uint16_t id;
+};
+
+struct audiosessionhash {
+    size_t operator()(const audiosessionkey& k) const {
+        // murmur3 finalizer over the packed 64 bit key
+        uint64_t h = ((uint64_t) k.addr << 32) | ((uint64_t) k.port << 16) | k.id;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+class audiomixer {
+public:
+    audiomixer(audiobuffermanager& _manager) : manager(_manager), samplingrate(48000), channels(2), framesize(120), bitrate(192000), maxqueue(8), stats(0), room(0), last_depth(0), dtx(true), report_ticks(100), keepalive_ticks(40), ticks(0), n_concealed(0), t_last(0), t_sum(0), t_max(0), l_sum(0), l_max(0), l_n(0) {}
+
+    virtual ~audiomixer() {}
+
+    typedef std::shared_ptr<audioparticipant> shared_participant;
+
+    // preallocates codec state for <maxparticipants>, returns 0 or -1
+    int configure(size_t _samplingrate,
+                  int _channels,
+                  size_t _framesize,
+                  int _bitrate,
+                  size_t _maxqueue = 8,
+                  size_t _maxparticipants = 256)
+    {
+        samplingrate = _samplingrate;
+        channels = _channels;
+        framesize = _framesize;
+        bitrate = _bitrate;
+        maxqueue = _maxqueue;
+        sum.resize(framesize*channels);
+        mixed.resize(framesize*channels);
+        report_ticks = AUDIO_REPORT_MS * samplingrate / (1000 * framesize);
+        if (!report_ticks) {
+            report_ticks = 1;
+        }
+        keepalive_ticks = AUDIO_DTX_KEEPALIVE_MS * samplingrate / (1000 * framesize);
+        if (!keepalive_ticks) {
+            keepalive_ticks = 1;
+        }
+        table.reserve(_maxparticipants);
+        return arena.configure(_maxparticipants, _maxparticipants, samplingrate, channels, bitrate) ? -1 : 0;
+    }
+
+    // queue wait, decode, encode, send and tick histograms and drops of mix(),
+    // several mixers may share one audiostats
+    void set_stats(audiostats* _stats) {
+        stats = _stats;
+    }
+
+    // receive path: queue an encoded frame for the participant it came from
+    int add(const audiowire_t& wire, const struct sockaddr_in& addr);
+
+    // receive path: receiver report of a participant about its mix
+    int report(const audiowire_t& wire, const struct sockaddr_in& addr);
+
+    // drop sessions without a datagram for <idle_ms>, their codec states go back
+    // to the arena and their queued frames to the slab; returns the number evicted
+    size_t evict(uint64_t idle_ms = AUDIO_SESSION_TIMEOUT_MS);
+
+    // mixer path: decode, mix and send one frame to every participant
+    int mix(audiosocket& audiosock);
+
+    size_t participants() {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        return table.size();
+    }
+
+    // a listener nobody else talks to gets keepalives instead of encoded silence
+    void set_dtx(bool enable) {
+        dtx = enable;
+    }
+
+    // tags the periodic statistics when a server runs several mixers
+    void set_room(uint16_t _room) {
+        room = _room;
+    }
+
+    // deepest participant queue at the last mix
+    size_t queue_depth() { return last_depth.load(std::memory_order_relaxed); }
+
+    // mix cost in ms
+    double last_cost() { return t_last; }
+    double max_cost() { return t_max; }
+    double avg_cost() { return ticks ? t_sum / ticks : 0; }
+
+    // capture to mix latency in ms over all synchronised participants
+    double avg_latency() { return l_n ? l_sum / l_n : 0; }
+    double max_latency() { return l_max; }
+
+    // kernels: sum += in ; out = saturate(sum - self)
+    static void accumulate(int32_t* sum, const int16_t* in, size_t n);
+    static void minusone(int16_t* out, const int32_t* sum, const int16_t* self, size_t n);
+
+private:
+    // O(1) session lookup, creates the session on the first datagram
+    shared_participant participant(uint16_t id, const struct sockaddr_in& addr);
+
+    // serialize the mixes waiting for aggregation into <packet>, returns the length or -1
+    int flush(audioparticipant& p, audiopacket_t* packet);
+
+    audiocodecarena arena;
+    std::shared_mutex mMutex;
+    std::unordered_map<audiosessionkey, shared_participant, audiosessionhash> table;
+    std::vector<shared_participant> active;
+
+    audiobuffermanager& manager;
+    size_t samplingrate;
+    int channels;
+    size_t framesize;
+    int bitrate;
+    size_t maxqueue;
+    audiostats* stats;
+    uint16_t room;
+    std::atomic<size_t> last_depth;
+    bool dtx;
+
+    std::vector<int32_t> sum;
+    std::vector<int16_t> mixed;
+    std::vector<audiopacket_t> outbound;  // serialized mixes, reports and keepalives of one tick, sent in one batch
+
+    size_t report_ticks;         // mixes between two receiver reports
+    size_t keepalive_ticks;      // mixes between two DTX keepalives
+    uint64_t ticks;
+    uint64_t n_concealed;        // late frames of talkers rebuilt by the decoder
+    double t_last;
+    double t_sum;
+    double t_max;
+    double l_sum;
+    double l_max;
+    uint64_t l_n;
+};
+
+#endif /* audiomixer_hpp */
@@ -0,0 +1,189 @@
+//
+//  audiorate.cpp
+//
+//  Receiver reports and sender bitrate adaptation
+//
+
+#include "audiorate.hpp"
+#include <math.h>
+
+static double elapsed_ms(struct timespec& ts1, struct timespec& ts2)
+{
+    return ((ts2.tv_sec-ts1.tv_sec)*1000000000.0 + (ts2.tv_nsec-ts1.tv_nsec))/1000000.0;
+}
+
+void
+audioreceiverstats::received(uint64_t frame)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!started) {
+        base.store(frame, std::memory_order_relaxed);
+        highest.store(frame, std::memory_order_relaxed);
+        last_frame = frame;
+        last_arrival = now;
+        started = true;
+    } else if (frame > last_frame) {
+        if (silent) {
+            // keepalives go out every AUDIO_DTX_KEEPALIVE_MS only: the frames between the
+            // last one and this were skipped as well, not lost, and are no jitter sample
+            uint64_t h = highest.load(std::memory_order_relaxed);
+            if (frame > h + 1) {
+                n_received.fetch_add(frame - h - 1, std::memory_order_release);
+            }
+        } else {
+            // RFC 3550 inter-arrival jitter on the frame clock
+            double d = elapsed_ms(last_arrival, now) - (frame - last_frame) * period_ms;
+            double j = jitter.load(std::memory_order_relaxed);
+            j += (fabs(d) - j) / 16.0;
+            jitter.store(j, std::memory_order_relaxed);
+        }
+        highest.store(frame, std::memory_order_relaxed);
+        last_frame = frame;
+        last_arrival = now;
+    }
+    silent = false;
+    n_received.fetch_add(1, std::memory_order_release);
+}
+
+void
+audioreceiverstats::skipped(uint64_t frame)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!started) {
+        // the stream starts silent, expect the first frame after <frame>
+        base.store(frame + 1, std::memory_order_relaxed);
+        highest.store(frame, std::memory_order_relaxed);
+        started = true;
+    } else if (frame > last_frame) {
+        uint64_t h = highest.load(std::memory_order_relaxed);
+        if (frame > h) {
+            n_received.fetch_add(frame - h, std::memory_order_release);
+            highest.store(frame, std::memory_order_relaxed);
+        }
+    } else {
+        return;
+    }
+    silent = true;
+    last_frame = frame;
+    last_arrival = now;
+}
+
+audioreport_t
+audioreceiverstats::report(uint32_t late)
+{
+    audioreport_t report;
+    uint64_t r = n_received.load(std::memory_order_acquire);
+    uint64_t h = highest.load(std::memory_order_relaxed);
+    uint64_t b = base.load(std::memory_order_relaxed);
+    uint64_t expected = r ? (h - b + 1) : 0;
+
+    // RFC 3550 A.3: fraction lost in the interval, duplicates can make it negative
+    int64_t expected_interval = expected - expected_prior;
+    int64_t received_interval = r - received_prior;
+    int64_t lost_interval = expected_interval - received_interval;
+    expected_prior = expected;
+    received_prior = r;
+
+    report.fraction_lost = ((expected_interval > 0) && (lost_interval > 0)) ? (uint8_t) ((lost_interval << 8) / expected_interval) : 0;
+    report.lost = (expected > r) ? (uint32_t) (expected - r) : 0;
+    report.highest = (uint32_t) h;
+    report.jitter_us = (uint32_t) (jitter_ms() * 1000.0);
+    report.late = late;
+    return report;
+}
+
+void
+audioratecontrol::configure(int _minrate,
+                            int _maxrate,
+                            int _startrate,
+                            int _loss_perc,
+                            double _frame_ms)
+{
+    minrate = _minrate;
+    maxrate = _maxrate;
+    fec = (_frame_ms >= AUDIO_FEC_MIN_MS);
+    current = _startrate;
+    if (current > maxrate) current = maxrate;
+    if (current < minrate) current = minrate;
+    good = hold = 0;
+    loss_avg = _loss_perc / 100.0;
+    have_report = false;
+    publish(_loss_perc);
+}
+
+void
+audioratecontrol::update(const audioreport_t& report)
+{
+    double loss = report.fraction_lost / 256.0;
+    uint32_t late = have_report ? report.late - last_late : 0;
+    // a fast growing jitter means a queue is building up on the path
+    bool queueing = have_report && (report.jitter_us > 5000) && (report.jitter_us > last_jitter + last_jitter / 2);
+
+    n_reports++;
+    loss_avg += (loss - loss_avg) / 4.0;
+
+    if ((loss > 0.02) || late) {
+        // congested: multiplicative decrease, the more loss the deeper
+        double f = 1.0 - 2.0 * loss;
+        if (f < 0.5) f = 0.5;
+        if (f > 0.85) f = 0.85;
+        current *= f;
+        if (current < minrate) current = minrate;
+        good = 0;
+        hold = 4;
+        n_decrease++;
+    } else if (queueing) {
+        good = 0;
+    } else if (hold) {
+        hold--;
+    } else if (++good >= 4) {
+        // clean for a second: probe up by 5%, at least 8 kbit/s
+        double step = current * 0.05;
+        current += (step > 8000) ? step : 8000;
+        if (current > maxrate) current = maxrate;
+        good = 0;
+        n_increase++;
+    }
+
+    last_late = report.late;
+    last_jitter = report.jitter_us;
+    have_report = true;
+
+    // FEC covers the loss we keep seeing
+    int loss_perc = (int) lround(loss_avg * 100.0);
+    publish(loss_perc > 25 ? 25 : loss_perc);
+}
+
+void
+audioratecontrol::publish(int loss_perc)
+{
+    uint64_t rate = (uint64_t) current;
+    // spend the cycles where every bit counts
+    uint64_t complexity = (rate < 64000) ? 10 : 8;
+    setting.store(rate << 16 | complexity << 8 | (uint64_t) (fec ? loss_perc : 0), std::memory_order_release);
+}
+
+int
+audioratecontrol::apply(audioencoder& encoder)
+{
+    uint64_t s = setting.load(std::memory_order_acquire);
+    if (s == applied) {
+        return 0;
+    }
+    applied = s;
+
+    if (opus_encoder_ctl(encoder.get(), OPUS_SET_BITRATE((opus_int32) (s >> 16))) != OPUS_OK) {
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "failed to set encoder bit rate");
+    }
+    if (opus_encoder_ctl(encoder.get(), OPUS_SET_COMPLEXITY((opus_int32) ((s >> 8) & 0xff))) != OPUS_OK) {
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "failed to set encoder complexity");
+    }
+    if (encoder.set_fec((int) (s & 0xff))) {
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "failed to set encoder FEC");
+    }
+    return 1;
+}
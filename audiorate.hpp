@@ -0,0 +1,119 @@
+//
+//  audiorate.hpp
+//
+//  Receiver reports and the bitrate adaptation of the sender driven by
+//  them: step down quickly when loss or late packets show up, probe back
+//  up slowly while the path is clean.
+//
+
+#ifndef audiorate_hpp
+#define audiorate_hpp
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+#include "audiobuffer.hpp"
+
+#define AUDIO_RATE_MIN      32000   /* lowest bitrate the controller goes to */
+#define AUDIO_FEC_MIN_MS    10      /* in-band FEC is SILK/hybrid only, shorter frames are CELT */
+#define AUDIO_REPORT_MS     250     /* receiver report interval */
+
+// Receive side statistics of one stream, reported to its sender. One
+// thread calls received(), one (possibly other) thread builds the reports.
+class audioreceiverstats {
+public:
+    audioreceiverstats() : period_ms(2.5), base(0), highest(0), n_received(0), jitter(0),
+                           started(false), silent(false), last_frame(0), expected_prior(0), received_prior(0) {}
+
+    virtual ~audioreceiverstats() {}
+
+    void configure(double _period_ms) { period_ms = _period_ms; }
+
+    // receiving thread: one frame arrived (unwrapped sequence)
+    void received(uint64_t frame);
+
+    // receiving thread: the sender skipped the frames up to <frame> on purpose (DTX),
+    // they count as received and the gap adds no jitter; so do the frames it skipped
+    // after its last keepalive, up to the next received() frame
+    void skipped(uint64_t frame);
+
+    // reporting thread: loss since the previous report, totals and jitter
+    audioreport_t report(uint32_t late);
+
+    double jitter_ms() { return jitter.load(std::memory_order_relaxed); }
+
+private:
+    double period_ms;
+
+    // written by the receiving thread
+    std::atomic<uint64_t> base;
+    std::atomic<uint64_t> highest;
+    std::atomic<uint64_t> n_received;
+    std::atomic<double> jitter;
+    bool started;
+    bool silent;         // the last packet was a DTX keepalive
+    uint64_t last_frame;
+    struct timespec last_arrival;
+
+    // written by the reporting thread
+    uint64_t expected_prior;
+    uint64_t received_prior;
+};
+
+// Turns receiver reports into encoder settings. update() runs on the
+// thread receiving the reports, apply() on the thread owning the encoder;
+// the setting is published as one atomic word.
+class audioratecontrol {
+public:
+    audioratecontrol() : minrate(AUDIO_RATE_MIN), maxrate(192000), fec(true), current(192000), good(0), hold(0),
+                         loss_avg(0), last_late(0), last_jitter(0), have_report(false), setting(0), applied(0)
+    {
+        n_reports = n_decrease = n_increase = 0;
+    }
+
+    virtual ~audioratecontrol() {}
+
+    // frames shorter than AUDIO_FEC_MIN_MS cannot carry FEC, it stays off whatever the loss
+    void configure(int _minrate,
+                   int _maxrate,
+                   int _startrate,
+                   int _loss_perc = 0,
+                   double _frame_ms = AUDIO_FEC_MIN_MS);
+
+    // report thread
+    void update(const audioreport_t& report);
+
+    // encoder thread: push a changed setting into the encoder, returns 1 if it changed
+    int apply(audioencoder& encoder);
+
+    int bitrate() { return (int) (setting.load(std::memory_order_relaxed) >> 16); }
+    int complexity() { return (int) ((setting.load(std::memory_order_relaxed) >> 8) & 0xff); }
+    int loss_perc() { return (int) (setting.load(std::memory_order_relaxed) & 0xff); }
+
+    std::atomic<uint64_t> n_reports;
+    std::atomic<uint64_t> n_decrease;
+    std::atomic<uint64_t> n_increase;
+
+private:
+    void publish(int loss_perc);
+
+    int minrate;
+    int maxrate;
+    bool fec;            // the frames are long enough for in-band FEC
+
+    // report thread
+    double current;
+    int good;            // clean reports in a row
+    int hold;            // reports to wait after a decrease
+    double loss_avg;
+    uint32_t last_late;
+    uint32_t last_jitter;
+    bool have_report;
+
+    // bitrate << 16 | complexity << 8 | loss percent
+    std::atomic<uint64_t> setting;
+    // encoder thread
+    uint64_t applied;
+};
+
+#endif /* audiorate_hpp */
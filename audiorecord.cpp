@@ -0,0 +1,250 @@
+//
+//  audiorecord.cpp
+//
+//  Multitrack recording to memory mapped, preallocated files
+//
+
+#include "audiorecord.hpp"
+#include "audiolog.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int
+audiorecorder::open(const char* path, uint16_t room, size_t samplingrate, int channels, size_t framesize)
+{
+    if (base) {
+        return -1;
+    }
+    fd = ::open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        AUDIO_ERROR("cannot create recording %s errno=%d", path, errno);
+        return -1;
+    }
+    int rc = posix_fallocate(fd, 0, AUDIO_RECORD_SEGMENT);
+    if (rc) {
+        AUDIO_ERROR("cannot preallocate recording %s errno=%d", path, rc);
+        ::close(fd);
+        fd = -1;
+        unlink(path);
+        return -1;
+    }
+    // the whole file size is reserved as address space, the preallocation keeps the pages below valid
+    void* m = mmap(0, AUDIO_RECORD_MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (m == MAP_FAILED) {
+        AUDIO_ERROR("cannot map recording %s errno=%d", path, errno);
+        ::close(fd);
+        fd = -1;
+        unlink(path);
+        return -1;
+    }
+    base = (unsigned char*) m;
+#ifdef MADV_POPULATE_WRITE
+    // the first segment faults in here as well, record() only copies
+    madvise(base, AUDIO_RECORD_SEGMENT, MADV_POPULATE_WRITE);
+#endif
+
+    struct timespec mono;
+    struct timespec wall;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    audiorecordhdr_t* h = (audiorecordhdr_t*) base;
+    memcpy(h->magic, AUDIO_RECORD_MAGIC, sizeof(h->magic));
+    h->version = AUDIO_RECORD_VERSION;
+    h->room = room;
+    h->channels = channels;
+    h->framesize = framesize;
+    h->samplingrate = samplingrate;
+    h->t_start = mono.tv_sec * 1000000000ull + mono.tv_nsec;
+    h->t_wall = wall.tv_sec * 1000000000ull + wall.tv_nsec;
+
+    n_records = n_dropped = 0;
+    tail.store(sizeof(audiorecordhdr_t), std::memory_order_relaxed);
+    allocated.store(AUDIO_RECORD_SEGMENT, std::memory_order_release);
+    return 0;
+}
+
+int
+audiorecorder::record(const audiopacket_t& packet, uint16_t id, uint64_t t_ns)
+{
+    // open() runs on another thread, the mapping is valid once allocated is published
+    uint64_t limit = allocated.load(std::memory_order_acquire);
+    if (!limit) {
+        return -1;
+    }
+    // receive workers of the same room append concurrently: reserve, then fill
+    const uint64_t len = audiorecording::align(sizeof(audiorecord_t) + packet.bytes);
+    uint64_t offset = tail.load(std::memory_order_relaxed);
+    do {
+        if (offset + len > limit) {
+            limit = allocated.load(std::memory_order_acquire);
+        }
+        if (offset + len > limit) {
+            n_dropped++;
+            return -1;
+        }
+    } while (!tail.compare_exchange_weak(offset, offset + len, std::memory_order_relaxed));
+
+    audiorecord_t* r = (audiorecord_t*) (base + offset);
+    r->id = id;
+    r->bytes = packet.bytes;
+    r->t_ns = t_ns;
+    memcpy(base + offset + sizeof(audiorecord_t), packet.data, packet.bytes);
+    __atomic_store_n(&r->sync, AUDIO_RECORD_SYNC, __ATOMIC_RELEASE);
+    n_records++;
+    return 0;
+}
+
+int
+audiorecorder::grow()
+{
+    if (!base) {
+        return -1;
+    }
+    uint64_t a = allocated.load(std::memory_order_relaxed);
+    while (a - tail.load(std::memory_order_relaxed) < AUDIO_RECORD_SEGMENT) {
+        if (a + AUDIO_RECORD_SEGMENT > AUDIO_RECORD_MAX_BYTES) {
+            AUDIO_LOG_RATE(AUDIO_LOG_WARNING, 10, "recording full at %lu bytes", a);
+            return -1;
+        }
+        int rc = posix_fallocate(fd, a, AUDIO_RECORD_SEGMENT);
+        if (rc) {
+            AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "cannot extend recording errno=%d", rc);
+            return -1;
+        }
+#ifdef MADV_POPULATE_WRITE
+        // fault the pages in here, not on the receive path
+        madvise(base + a, AUDIO_RECORD_SEGMENT, MADV_POPULATE_WRITE);
+#endif
+        a += AUDIO_RECORD_SEGMENT;
+        allocated.store(a, std::memory_order_release);
+    }
+    return 0;
+}
+
+void
+audiorecorder::close()
+{
+    if (!base) {
+        return;
+    }
+    uint64_t t = tail.load(std::memory_order_acquire);
+    allocated.store(0, std::memory_order_relaxed);
+    munmap(base, AUDIO_RECORD_MAX_BYTES);
+    base = 0;
+    // the unused preallocation goes back
+    if (ftruncate(fd, t)) {
+        AUDIO_WARNING("cannot trim recording errno=%d", errno);
+    }
+    ::close(fd);
+    fd = -1;
+}
+
+int
+audiorecording::open(const char* path)
+{
+    close();
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr,"error: cannot open %s errno=%d\n", path, errno);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || ((uint64_t) st.st_size < sizeof(audiorecordhdr_t))) {
+        fprintf(stderr,"error: %s is no recording\n", path);
+        ::close(fd);
+        return -1;
+    }
+    void* m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr,"error: cannot map %s errno=%d\n", path, errno);
+        return -1;
+    }
+    base = (unsigned char*) m;
+    size = st.st_size;
+    if (memcmp(header().magic, AUDIO_RECORD_MAGIC, 8) || (header().version != AUDIO_RECORD_VERSION)) {
+        fprintf(stderr,"error: %s is no recording or of another version\n", path);
+        close();
+        return -1;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+void
+audiorecording::close()
+{
+    if (base) {
+        munmap(base, size);
+        base = 0;
+        size = 0;
+    }
+}
+
+bool
+audiorecording::valid(uint64_t offset)
+{
+    if ((offset & 7) || (offset + sizeof(audiorecord_t) > size)) {
+        return false;
+    }
+    const audiorecord_t* r = record(offset);
+    if ((r->sync != AUDIO_RECORD_SYNC) || (r->bytes < AUDIO_WIRE_HEADER) || (r->bytes > AUDIO_WIRE_MAX)) {
+        return false;
+    }
+    uint64_t end = skip(offset);
+    if (end > size) {
+        return false;
+    }
+    // a sync word inside a datagram is followed by garbage; a real record by the next one,
+    // an incomplete one or the zeros of the preallocation
+    if (end + sizeof(uint32_t) <= size) {
+        uint32_t following = record(end)->sync;
+        if (following && (following != AUDIO_RECORD_SYNC)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t
+audiorecording::next(uint64_t offset)
+{
+    if (offset < sizeof(audiorecordhdr_t)) {
+        offset = sizeof(audiorecordhdr_t);
+    }
+    for (offset = align(offset); offset + sizeof(audiorecord_t) <= size; offset += 8) {
+        if (valid(offset)) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+int64_t
+audiorecording::seek(uint64_t t_ns)
+{
+    uint64_t lo = sizeof(audiorecordhdr_t);
+    uint64_t hi = size;
+    while (hi - lo > 4096) {
+        uint64_t mid = align(lo + (hi - lo) / 2);
+        int64_t r = next(mid);
+        if ((r < 0) || ((uint64_t) r >= hi) || (record(r)->t_ns >= t_ns)) {
+            hi = mid;
+        } else {
+            lo = skip(r);
+        }
+    }
+    // the receive workers stamp their batches, the order is monotonic only to a few ms
+    for (int64_t r = next(lo); r >= 0; r = next(skip(r))) {
+        if (record(r)->t_ns >= t_ns) {
+            return r;
+        }
+    }
+    return -1;
+}
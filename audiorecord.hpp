@@ -0,0 +1,128 @@
+//
+//  audiorecord.hpp
+//
+//  Multitrack recording of a room: every datagram a participant sends is
+//  appended exactly as received, no decode and no re-encode. The file is
+//  mapped into memory and preallocated ahead of the tail by a housekeeping
+//  thread, so the receive path only reserves space and copies.
+//
+//  File layout (host byte order, the datagrams stay in network order):
+//
+//   0                  64
+//  +------------------+--------+----------+--------+----------+-----
+//  | audiorecordhdr_t | record | datagram | record | datagram | ...
+//  +------------------+--------+----------+--------+----------+-----
+//
+//  Every record is 8 byte aligned and starts with AUDIO_RECORD_SYNC, which
+//  is stored last: a record without it was never completed. Like the Ogg
+//  capture pattern the sync word lets a reader pick up at any offset, and
+//  the receive times grow with the offset, so seeking is a bisection.
+//  audioREC converts the tracks to Ogg Opus.
+//
+
+#ifndef audiorecord_hpp
+#define audiorecord_hpp
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "audiowire.hpp"
+
+#define AUDIO_RECORD_MAGIC     "AUDIOREC"
+#define AUDIO_RECORD_VERSION   1
+#define AUDIO_RECORD_SYNC      0x52584d41u        /* "AMXR" */
+#define AUDIO_RECORD_SEGMENT   (16ull << 20)      /* preallocated ahead of the tail */
+#define AUDIO_RECORD_MAX_BYTES (64ull << 30)      /* address space reserved per file */
+
+struct audiorecordhdr_t {
+    char magic[8];            // AUDIO_RECORD_MAGIC
+    uint16_t version;
+    uint16_t room;
+    uint16_t channels;
+    uint16_t framesize;       // samples per frame
+    uint32_t samplingrate;
+    uint32_t reserved;
+    uint64_t t_start;         // CLOCK_MONOTONIC ns when the recording started
+    uint64_t t_wall;          // CLOCK_REALTIME ns at t_start
+    uint8_t pad[24];
+};
+
+struct audiorecord_t {
+    uint32_t sync;            // AUDIO_RECORD_SYNC once complete
+    uint16_t id;              // participant, one track each
+    uint16_t bytes;           // datagram length
+    uint64_t t_ns;            // receive time, CLOCK_MONOTONIC ns
+};
+
+static_assert(sizeof(audiorecordhdr_t) == 64, "recording header layout");
+static_assert(sizeof(audiorecord_t) == 16, "record layout");
+
+// writer, one per room
+class audiorecorder {
+public:
+    audiorecorder() : n_records(0), n_dropped(0), fd(-1), base(0), tail(0), allocated(0) {}
+
+    virtual ~audiorecorder() { close(); }
+
+    // create <path> and map it, returns 0 or -1
+    int open(const char* path, uint16_t room, size_t samplingrate, int channels, size_t framesize);
+
+    // receive path: append one datagram, never blocks; -1 if the file is not open (yet)
+    // or there is no preallocated space left
+    int record(const audiopacket_t& packet, uint16_t id, uint64_t t_ns);
+
+    // housekeeping: keep AUDIO_RECORD_SEGMENT preallocated beyond the tail, returns 0 or -1
+    int grow();
+
+    // trim the preallocation and unmap; only when no receive thread can record any more
+    void close();
+
+    bool recording() { return allocated.load(std::memory_order_acquire) != 0; }
+    uint64_t bytes() { return tail.load(std::memory_order_relaxed); }
+
+    std::atomic<uint64_t> n_records;
+    std::atomic<uint64_t> n_dropped;   // no space preallocated in time or the file is full
+
+private:
+    int fd;
+    unsigned char* base;
+    std::atomic<uint64_t> tail;        // end of the last reserved record
+    std::atomic<uint64_t> allocated;   // file size, the mapping is valid below; publishes base
+};
+
+// reader, maps a whole recording read only
+class audiorecording {
+public:
+    audiorecording() : base(0), size(0) {}
+
+    virtual ~audiorecording() { close(); }
+
+    // returns 0 or -1 if the file is no recording
+    int open(const char* path);
+    void close();
+
+    const audiorecordhdr_t& header() { return *(const audiorecordhdr_t*) base; }
+
+    // first complete record at or after <offset>, returns its offset or -1 at the end
+    int64_t next(uint64_t offset);
+
+    // record and datagram at a record offset from next()
+    const audiorecord_t* record(uint64_t offset) { return (const audiorecord_t*) (base + offset); }
+    const unsigned char* datagram(uint64_t offset) { return base + offset + sizeof(audiorecord_t); }
+
+    // offset just behind the record at <offset>
+    uint64_t skip(uint64_t offset) { return offset + align(sizeof(audiorecord_t) + record(offset)->bytes); }
+
+    // offset of the first record received at or after <t_ns>, or -1; a bisection over the file
+    int64_t seek(uint64_t t_ns);
+
+    static uint64_t align(uint64_t n) { return (n + 7) & ~7ull; }
+
+private:
+    bool valid(uint64_t offset);
+
+    unsigned char* base;
+    uint64_t size;
+};
+
+#endif /* audiorecord_hpp */
@@ -0,0 +1,220 @@
+//
+//  audioresampler.cpp
+//
+//  Drift estimator and fractional resampler for the playout path
+//
+
+#include "audioresampler.hpp"
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define AUDIO_DRIFT_MIN_SPAN 5.0    /* seconds of data before the rate fits count */
+#define AUDIO_DRIFT_GAP      1000   /* frames; a larger jump restarts the arrival fit */
+#define AUDIO_DRIFT_GAIN     2e-4   /* ratio correction per frame of depth error */
+
+static double seconds(struct timespec& ts1, struct timespec& ts2)
+{
+    return (ts2.tv_sec-ts1.tv_sec) + (ts2.tv_nsec-ts1.tv_nsec)/1000000000.0;
+}
+
+void
+audioclockfit::add(double x, double y)
+{
+    if (n) {
+        double d = exp(-(x - xlast) / window);
+        s *= d;
+        sx *= d;
+        sy *= d;
+        sxx *= d;
+        sxy *= d;
+    } else {
+        xfirst = x;
+    }
+    s += 1;
+    sx += x;
+    sy += y;
+    sxx += x*x;
+    sxy += x*y;
+    xlast = x;
+    n++;
+}
+
+double
+audioclockfit::slope(double min_span) const
+{
+    if ((n < 2) || (xlast - xfirst < min_span)) {
+        return 0;
+    }
+    double den = s*sxx - sx*sx;
+    if (den <= 0) {
+        return 0;
+    }
+    return (s*sxy - sx*sy) / den;
+}
+
+void
+audiodrift::arrived(uint64_t frame)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!have_in || (frame < last_frame) || (frame > last_frame + AUDIO_DRIFT_GAP)) {
+        // first frame or the sender restarted
+        in.reset();
+        in_rate.store(0, std::memory_order_relaxed);
+        t0_in = now;
+        have_in = true;
+    }
+    last_frame = frame;
+
+    in.add(seconds(t0_in, now), (double) frame * framesize);
+    in_rate.store(in.slope(AUDIO_DRIFT_MIN_SPAN), std::memory_order_relaxed);
+}
+
+double
+audiodrift::played(size_t frames, double depth, double target)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!have_out) {
+        t0_out = now;
+        have_out = true;
+    }
+    out.add(seconds(t0_out, now), (double) played_frames);
+    played_frames += frames;
+
+    // feed forward: sender clock over our clock
+    double rate_in = in_rate.load(std::memory_order_relaxed);
+    double rate_out = out.slope(AUDIO_DRIFT_MIN_SPAN);
+    double r = ((rate_in > 0) && (rate_out > 0)) ? rate_in / rate_out : 1.0;
+    drift.store(r - 1.0, std::memory_order_relaxed);
+
+    // feedback: pull the (smoothed) depth back to the target
+    if (depth_avg < 0) {
+        depth_avg = depth;
+    }
+    depth_avg += (depth - depth_avg) / 400.0;
+    r += AUDIO_DRIFT_GAIN * (depth_avg - target);
+
+    if (r > 1.0 + AUDIO_DRIFT_MAX_PPM * 1e-6) r = 1.0 + AUDIO_DRIFT_MAX_PPM * 1e-6;
+    if (r < 1.0 - AUDIO_DRIFT_MAX_PPM * 1e-6) r = 1.0 - AUDIO_DRIFT_MAX_PPM * 1e-6;
+    ratio = r;
+    return r;
+}
+
+void
+audioresampler::configure(int _channels, size_t maxframes)
+{
+    channels = _channels;
+    capacity = maxframes + 1;
+    // one frame of history, the queue and room for the 4 float loads past the end
+    fifo.assign((capacity + 2) * channels + 4, 0.0f);
+    rd = wr = 1;
+    frac = 0;
+}
+
+size_t
+audioresampler::needed(size_t frames, double ratio) const
+{
+    if (!frames) {
+        return 0;
+    }
+    // the last output frame interpolates between rd+k-1 and rd+k+2
+    size_t k = (size_t) (frac + (frames - 1) * ratio);
+    return k + 3;
+}
+
+void
+audioresampler::compact()
+{
+    // keep the history frame in front of rd
+    size_t keep = wr - (rd - 1);
+    memmove(&fifo[0], &fifo[(rd - 1) * channels], keep * channels * sizeof(float));
+    wr = keep;
+    rd = 1;
+}
+
+size_t
+audioresampler::push(const int16_t* in, size_t frames)
+{
+    if (wr + frames > capacity) {
+        compact();
+        if (wr + frames > capacity) {
+            frames = capacity - wr;
+        }
+    }
+    float* dst = &fifo[wr * channels];
+    for (size_t i = 0; i < frames * channels; ++i) {
+        dst[i] = in[i];
+    }
+    wr += frames;
+    return frames;
+}
+
+size_t
+audioresampler::push_silence(size_t frames)
+{
+    if (wr + frames > capacity) {
+        compact();
+        if (wr + frames > capacity) {
+            frames = capacity - wr;
+        }
+    }
+    memset(&fifo[wr * channels], 0, frames * channels * sizeof(float));
+    wr += frames;
+    return frames;
+}
+
+size_t
+audioresampler::pull(int16_t* out, size_t frames, double ratio)
+{
+    size_t i = 0;
+    for (; i < frames; ++i) {
+        double p = frac + i * ratio;
+        size_t k = (size_t) p;
+        if (rd + k + 2 >= wr) {
+            break;
+        }
+        float t = (float) (p - k);
+        float t2 = t * t;
+        float t3 = t2 * t;
+        // Catmull-Rom weights of x[-1], x[0], x[1], x[2]
+        float c0 = -0.5f*t + t2 - 0.5f*t3;
+        float c1 = 1.0f - 2.5f*t2 + 1.5f*t3;
+        float c2 = 0.5f*t + 2.0f*t2 - 1.5f*t3;
+        float c3 = -0.5f*t2 + 0.5f*t3;
+        const float* x = &fifo[(rd + k - 1) * channels];
+#ifdef __SSE2__
+        if (channels == 2) {
+            // a = x[-1] x[0], b = x[1] x[2], both channels at once
+            __m128 a = _mm_loadu_ps(x);
+            __m128 b = _mm_loadu_ps(x + 4);
+            __m128 s = _mm_add_ps(_mm_mul_ps(a, _mm_set_ps(c1, c1, c0, c0)),
+                                  _mm_mul_ps(b, _mm_set_ps(c3, c3, c2, c2)));
+            s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+            __m128i v = _mm_cvtps_epi32(s);
+            v = _mm_packs_epi32(v, v);
+            int32_t lr = _mm_cvtsi128_si32(v);
+            memcpy(out + 2*i, &lr, 4);
+            continue;
+        }
+#endif
+        for (int c = 0; c < channels; ++c) {
+            float v = c0 * x[c] + c1 * x[channels + c] + c2 * x[2*channels + c] + c3 * x[3*channels + c];
+            long l = lrintf(v);
+            if (l > 32767) l = 32767;
+            if (l < -32768) l = -32768;
+            out[i*channels + c] = (int16_t) l;
+        }
+    }
+
+    double p = frac + i * ratio;
+    size_t k = (size_t) p;
+    rd += k;
+    frac = p - k;
+    return i;
+}
@@ -0,0 +1,129 @@
+//
+//  audioresampler.hpp
+//
+//  Clock drift compensation on the playout side: audiodrift compares the
+//  rate frames arrive at with the rate the sound card plays them, and
+//  audioresampler stretches the stream by that ratio with a fractional
+//  cubic interpolator, so the jitter buffer depth stays where it is.
+//
+
+#ifndef audioresampler_hpp
+#define audioresampler_hpp
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define AUDIO_DRIFT_MAX_PPM 2000   /* bound of the ratio correction */
+
+// Least squares slope of y over x with exponential forgetting
+class audioclockfit {
+public:
+    audioclockfit() : window(30.0) { reset(); }
+
+    void configure(double _window) { window = _window; }
+
+    void reset() {
+        s = sx = sy = sxx = sxy = 0;
+        xlast = 0;
+        n = 0;
+    }
+
+    // x in seconds
+    void add(double x, double y);
+
+    // y per x, 0 until <min_span> seconds were seen
+    double slope(double min_span) const;
+
+private:
+    double window;
+    double s, sx, sy, sxx, sxy;
+    double xfirst, xlast;
+    uint64_t n;
+};
+
+// Sender/receiver clock ratio. arrived() runs on the receive thread,
+// played() in the playout callback.
+class audiodrift {
+public:
+    audiodrift() : framesize(120), in_rate(0), ratio(1.0), drift(0), depth_avg(-1), have_in(false), have_out(false), last_frame(0), t0_in(), t0_out(), played_frames(0) {}
+
+    virtual ~audiodrift() {}
+
+    // frame size in samples, averaging window in seconds
+    void configure(size_t _framesize, double window = 30.0) {
+        framesize = _framesize;
+        in.configure(window);
+        out.configure(window);
+    }
+
+    // receive thread: frame <frame> of the sender just arrived
+    void arrived(uint64_t frame);
+
+    // playout callback: <frames> samples are due; returns input samples per output sample,
+    // steering the buffer <depth> towards <target> (both in frames)
+    double played(size_t frames, double depth, double target);
+
+    double ppm() { return drift.load(std::memory_order_relaxed) * 1e6; }
+    double last_ratio() { return ratio; }
+
+private:
+    size_t framesize;
+
+    // receive thread
+    audioclockfit in;
+    std::atomic<double> in_rate;   // sender samples per local second, 0 while unknown
+
+    // playout callback
+    audioclockfit out;
+    double ratio;
+    std::atomic<double> drift;
+    double depth_avg;
+
+    bool have_in;
+    bool have_out;
+    uint64_t last_frame;
+    struct timespec t0_in;
+    struct timespec t0_out;
+    uint64_t played_frames;
+};
+
+// Fractional resampler for interleaved int16 PCM. Input is queued with
+// push(), pull() produces output consuming <ratio> input frames per output
+// frame. All memory is allocated by configure().
+class audioresampler {
+public:
+    audioresampler() : channels(2), capacity(0), rd(0), wr(0), frac(0) {}
+
+    virtual ~audioresampler() {}
+
+    // room for <maxframes> queued input frames
+    void configure(int _channels, size_t maxframes);
+
+    // queued input frames not consumed yet
+    size_t buffered() const { return wr - rd; }
+
+    // queued input frames pull(<frames>, <ratio>) needs
+    size_t needed(size_t frames, double ratio) const;
+
+    // returns the frames taken
+    size_t push(const int16_t* in, size_t frames);
+    size_t push_silence(size_t frames);
+
+    // returns the frames produced, short if not enough input is queued
+    size_t pull(int16_t* out, size_t frames, double ratio);
+
+private:
+    void compact();
+
+    int channels;
+    size_t capacity;           // frames
+    std::vector<float> fifo;   // one frame of history in front of rd
+    size_t rd;
+    size_t wr;
+    double frac;               // position between rd and rd+1
+};
+
+#endif /* audioresampler_hpp */
@@ -0,0 +1,147 @@
+//
+//  audioring.hpp
+//
+//  Fixed capacity single-producer/single-consumer ring and a drop-in
+//  replacement for audioqueue built on top of it.
+//
+
+#ifndef audioring_hpp
+#define audioring_hpp
+
+#include <atomic>
+#include <utility>
+#include <stddef.h>
+#include "audiobuffer.hpp"
+
+#define AUDIO_CACHELINE 64
+
+template<typename T, size_t N>
+class audioring {
+    static_assert(N && !(N & (N-1)), "audioring capacity must be a power of two");
+
+public:
+    audioring() : head(0), tail_cache(0), tail(0), head_cache(0) {}
+    ~audioring() {}
+
+    static constexpr size_t capacity() { return N; }
+
+    // producer side
+    bool push(T item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail_cache == N) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h - tail_cache == N) {
+                return false;
+            }
+        }
+        ring[h & (N-1)] = std::move(item);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // push up to n items, returns how many were taken
+    size_t push(T* items, size_t n) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t room = N - (h - tail_cache);
+        if (room < n) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            room = N - (h - tail_cache);
+        }
+        if (n > room) {
+            n = room;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            ring[(h + i) & (N-1)] = std::move(items[i]);
+        }
+        head.store(h + n, std::memory_order_release);
+        return n;
+    }
+
+    // consumer side
+    bool pop(T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head_cache) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t == head_cache) {
+                return false;
+            }
+        }
+        item = std::move(ring[t & (N-1)]);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // pop up to n items, returns how many were taken
+    size_t pop(T* items, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t avail = head_cache - t;
+        if (avail < n) {
+            head_cache = head.load(std::memory_order_acquire);
+            avail = head_cache - t;
+        }
+        if (n > avail) {
+            n = avail;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            items[i] = std::move(ring[(t + i) & (N-1)]);
+        }
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    // safe from either side, exact only on the calling side
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t h = head.load(std::memory_order_acquire);
+        return (h >= t) ? (h - t) : 0;
+    }
+
+    bool empty() const { return !size(); }
+
+private:
+    // producer line: write index and cached read index
+    alignas(AUDIO_CACHELINE) std::atomic<size_t> head;
+    size_t tail_cache;
+    // consumer line: read index and cached write index
+    alignas(AUDIO_CACHELINE) std::atomic<size_t> tail;
+    size_t head_cache;
+    alignas(AUDIO_CACHELINE) T ring[N];
+};
+
+// same interface as audioqueue, one producer and one consumer per direction
+template<size_t N = 256>
+class audioringqueue {
+public:
+    audioringqueue() {}
+    virtual ~audioringqueue() {}
+
+    bool add_output(audiobuffermanager::shared_buffer out) { return output.push(std::move(out)); }
+    bool add_input(audiobuffermanager::shared_buffer in) { return input.push(std::move(in)); }
+
+    // nullptr if empty
+    audiobuffermanager::shared_buffer get_output() {
+        audiobuffermanager::shared_buffer audio;
+        output.pop(audio);
+        return audio;
+    }
+
+    audiobuffermanager::shared_buffer get_input() {
+        audiobuffermanager::shared_buffer audio;
+        input.pop(audio);
+        return audio;
+    }
+
+    size_t add_output(audiobuffermanager::shared_buffer* out, size_t n) { return output.push(out, n); }
+    size_t add_input(audiobuffermanager::shared_buffer* in, size_t n) { return input.push(in, n); }
+    size_t get_output(audiobuffermanager::shared_buffer* out, size_t n) { return output.pop(out, n); }
+    size_t get_input(audiobuffermanager::shared_buffer* in, size_t n) { return input.pop(in, n); }
+
+    size_t output_size() { return output.size(); }
+    size_t input_size() { return input.size(); }
+
+private:
+    audioring<audiobuffermanager::shared_buffer, N> input;
+    audioring<audiobuffermanager::shared_buffer, N> output;
+};
+
+#endif /* audioring_hpp */
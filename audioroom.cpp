@@ -0,0 +1,327 @@
+//
+//  audioroom.cpp
+//
+//  Rooms of audioSERV and their placement on the mix workers
+//
+
+#include "audioroom.hpp"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <time.h>
+
+int
+audioroom::configure(size_t samplingrate,
+                     int channels,
+                     size_t framesize,
+                     int bitrate,
+                     size_t maxqueue,
+                     size_t maxparticipants,
+                     size_t buffers)
+{
+    manager.configure(buffers, samplingrate, channels, framesize, sizeof(int16_t));
+    if (manager.reserve(buffers)) {
+        return -1;
+    }
+    mixer.set_room(id);
+    return mixer.configure(samplingrate, channels, framesize, bitrate, maxqueue, maxparticipants);
+}
+
+audioroom::~audioroom()
+{
+    if (recorder.recording()) {
+        AUDIO_INFO("room %u recording closed records=%lu bytes=%lu dropped=%lu",
+                   id, recorder.n_records.load(), recorder.bytes(), recorder.n_dropped.load());
+        recorder.close();
+    }
+}
+
+int
+audioroom::mix(int worker, audiosocket& audiosock)
+{
+    if (owner.load(std::memory_order_acquire) != worker) {
+        return -1;
+    }
+    int t = target.load(std::memory_order_relaxed);
+    if (t != worker) {
+        // the mixer state goes along with the release, the new worker mixes the next tick
+        owner.store(t, std::memory_order_release);
+        AUDIO_INFO("room %u moved from worker %d to worker %d", id, worker, t);
+        return -1;
+    }
+
+    mixer.mix(audiosock);
+
+    double c = cost.load(std::memory_order_relaxed);
+    cost.store(c ? c + (mixer.last_cost() - c) / 16.0 : mixer.last_cost(), std::memory_order_relaxed);
+    return 0;
+}
+
+double
+audioroom::load()
+{
+    double c = cost.load(std::memory_order_relaxed);
+    return c ? c : participants() * AUDIO_ROOM_COST_MS;
+}
+
+audiorooms::shared_room
+audiorooms::find(uint16_t id)
+{
+    std::shared_lock<std::shared_mutex> guard(mMutex);
+    auto it = table.find(id);
+    return (it != table.end()) ? it->second : nullptr;
+}
+
+audiorooms::shared_room
+audiorooms::room(uint16_t id)
+{
+    size_t open;
+    {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        auto it = table.find(id);
+        if (it != table.end()) {
+            return it->second;
+        }
+        open = table.size();
+    }
+
+    // the housekeeping thread builds the room, its frames are dropped until then
+    {
+        std::lock_guard<std::mutex> g(openMutex);
+        if (std::find(requested.begin(), requested.end(), id) != requested.end()) {
+            return nullptr;
+        }
+        if (open + requested.size() >= maxrooms) {
+            AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "no room left for room %u rooms=%lu", id, open);
+            return nullptr;
+        }
+        requested.push_back(id);
+    }
+    openCond.notify_one();
+    return nullptr;
+}
+
+int
+audiorooms::open(uint16_t id)
+{
+    shared_room r = std::make_shared<audioroom>(id);
+    if (r->configure(samplingrate, channels, framesize, bitrate, maxqueue, maxparticipants, buffers)) {
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "cannot allocate room %u", id);
+        return -1;
+    }
+    if (stats) {
+        r->mixer.set_stats(stats);
+    }
+    if (!recorddir.empty()) {
+        char stamp[32];
+        time_t now = time(0);
+        struct tm local;
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+        std::string path = recorddir + "/room-" + std::to_string(id) + "-" + stamp + ".rec";
+        // the room works without its recording
+        if (!r->recorder.open(path.c_str(), id, samplingrate, channels, framesize)) {
+            AUDIO_INFO("room %u recording to %s", id, path.c_str());
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> guard(mMutex);
+    if (table.count(id)) {
+        return 0;
+    }
+    if (table.size() >= maxrooms) {
+        AUDIO_LOG_RATE(AUDIO_LOG_ERROR, 1, "no room left for room %u rooms=%lu", id, table.size());
+        return -1;
+    }
+    int worker = place();
+    r->target.store(worker, std::memory_order_relaxed);
+    r->owner.store(worker, std::memory_order_release);
+    table.emplace(id, r);
+    AUDIO_INFO("room %u opened on worker %d rooms=%lu", id, worker, table.size());
+    return 0;
+}
+
+int
+audiorooms::place()
+{
+    std::vector<double> loads(workers, 0);
+    std::vector<size_t> members(workers, 0);
+    for (auto& it : table) {
+        int w = it.second->target.load(std::memory_order_relaxed);
+        loads[w] += it.second->load();
+        members[w] += it.second->participants();
+    }
+
+    int best = 0;
+    for (int w = 1; w < workers; ++w) {
+        if ((loads[w] < loads[best]) ||
+            ((loads[w] == loads[best]) && (members[w] < members[best]))) {
+            best = w;
+        }
+    }
+    return best;
+}
+
+int
+audiorooms::mix(int worker, audiosocket& audiosock)
+{
+    std::vector<shared_room>& mine = owned[worker];
+    mine.clear();
+    {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        for (auto& it : table) {
+            if (it.second->owner.load(std::memory_order_relaxed) == worker) {
+                mine.push_back(it.second);
+            }
+        }
+    }
+
+    int mixed = 0;
+    for (auto& r : mine) {
+        if (!r->mix(worker, audiosock)) {
+            mixed++;
+        }
+    }
+    return mixed;
+}
+
+size_t
+audiorooms::sweep(uint64_t idle_ms)
+{
+    const uint64_t now = audioclock::now();
+    size_t participants = 0;
+    size_t depth = 0;
+    size_t queued = 0;
+    size_t inflight = 0;
+    std::vector<uint16_t> empty;
+    {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        for (auto& it : table) {
+            audioroom& r = *it.second;
+            r.mixer.evict(idle_ms);
+            size_t n = r.participants();
+            // a new room gets the same grace as a session before it closes
+            if (!n && (now - r.created > idle_ms * 1000000ull)) {
+                empty.push_back(it.first);
+            }
+            participants += n;
+            depth = std::max(depth, r.mixer.queue_depth());
+            queued += r.manager.queued();
+            inflight += r.manager.inflight();
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> guard(mMutex);
+    for (uint16_t id : empty) {
+        auto it = table.find(id);
+        if ((it != table.end()) && !it->second->participants()) {
+            // the owner may still hold it for one tick, the last reference frees slab and arena
+            table.erase(it);
+            AUDIO_INFO("room %u closed rooms=%lu", id, table.size());
+        }
+    }
+
+    if (stats) {
+        stats->set(audiostats::eParticipants, participants);
+        stats->set(audiostats::eQueueDepth, depth);
+        stats->set(audiostats::eBuffersQueued, queued);
+        stats->set(audiostats::eBuffersInflight, inflight);
+    }
+    return table.size();
+}
+
+void
+audiorooms::housekeeping(uint64_t wait_ms)
+{
+    std::vector<uint16_t> opening;
+    {
+        std::unique_lock<std::mutex> g(openMutex);
+        openCond.wait_for(g, std::chrono::milliseconds(wait_ms), [this] { return !requested.empty(); });
+        opening = requested;
+    }
+
+    // slab, codec arena and recording are built here, the workers only look rooms up
+    for (uint16_t id : opening) {
+        open(id);
+    }
+    if (!opening.empty()) {
+        // requested until open, so a receive worker does not ask again meanwhile
+        std::lock_guard<std::mutex> g(openMutex);
+        requested.erase(requested.begin(), requested.begin() + opening.size());
+    }
+
+    // grow the files without the table lock, rooms keep opening meanwhile
+    std::vector<shared_room> recording;
+    {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        for (auto& it : table) {
+            if (it.second->recorder.recording()) {
+                recording.push_back(it.second);
+            }
+        }
+    }
+    for (auto& r : recording) {
+        r->recorder.grow();
+    }
+}
+
+int
+audiorooms::rebalance()
+{
+    if (workers < 2) {
+        return 0;
+    }
+
+    std::shared_lock<std::shared_mutex> guard(mMutex);
+    std::vector<double> loads(workers, 0);
+    for (auto& it : table) {
+        loads[it.second->target.load(std::memory_order_relaxed)] += it.second->load();
+    }
+
+    int hi = 0;
+    int lo = 0;
+    for (int w = 1; w < workers; ++w) {
+        if (loads[w] > loads[hi]) {
+            hi = w;
+        }
+        if (loads[w] < loads[lo]) {
+            lo = w;
+        }
+    }
+    double gap = loads[hi] - loads[lo];
+    if ((gap < AUDIO_ROOM_MIN_SKEW_MS) || (gap < AUDIO_ROOM_SKEW * loads[hi])) {
+        return 0;
+    }
+
+    // a room lighter than the gap lowers the maximum, the one closest to half of it evens out best
+    shared_room best;
+    double best_distance = 0;
+    const uint64_t now = audioclock::now();
+    for (auto& it : table) {
+        audioroom& r = *it.second;
+        if ((r.owner.load(std::memory_order_relaxed) != hi) || (r.target.load(std::memory_order_relaxed) != hi)) {
+            continue;
+        }
+        if (now - r.placed.load(std::memory_order_relaxed) < AUDIO_ROOM_SETTLE_MS * 1000000ull) {
+            continue;
+        }
+        double l = r.load();
+        if ((l <= 0) || (l >= gap)) {
+            continue;
+        }
+        double distance = fabs(gap / 2 - l);
+        if (!best || (distance < best_distance)) {
+            best = it.second;
+            best_distance = distance;
+        }
+    }
+    if (!best) {
+        return 0;
+    }
+
+    AUDIO_INFO("room %u migrates from worker %d (%.3f ms) to worker %d (%.3f ms)",
+               best->id, hi, loads[hi], lo, loads[lo]);
+    best->placed.store(now, std::memory_order_relaxed);
+    best->target.store(lo, std::memory_order_relaxed);
+    n_migrations++;
+    return 1;
+}
@@ -0,0 +1,169 @@
+//
+//  audioroom.hpp
+//
+//  Rooms of audioSERV: every room mixes its own participants with its own
+//  buffer slab and codec arena. The rooms are placed on the mix workers by
+//  their load and migrate to another worker when the load skews.
+//
+
+#ifndef audioroom_hpp
+#define audioroom_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "audiobuffer.hpp"
+#include "audiomixer.hpp"
+#include "audiorecord.hpp"
+#include "audiostats.hpp"
+
+#define AUDIO_ROOM_COST_MS    0.02    // assumed mix cost per participant until a room is measured
+#define AUDIO_ROOM_SKEW       0.25    // relative load difference between two workers that moves a room
+#define AUDIO_ROOM_MIN_SKEW_MS 0.05   // ... but only if it is worth it in ms per tick
+#define AUDIO_ROOM_SETTLE_MS  5000    // a room stays at least this long on a worker
+
+class audioroom {
+public:
+    audioroom(uint16_t _id) : id(_id), mixer(manager), owner(-1), target(-1), cost(0), created(audioclock::now()), placed(created) {}
+
+    // the last reference closes the recording, no receive worker can append any more
+    virtual ~audioroom();
+
+    // slab of <buffers> frames and codec states for <maxparticipants>, returns 0 or -1
+    int configure(size_t samplingrate,
+                  int channels,
+                  size_t framesize,
+                  int bitrate,
+                  size_t maxqueue,
+                  size_t maxparticipants,
+                  size_t buffers);
+
+    // mix one tick if <worker> owns the room; a pending migration hands the
+    // room over instead. Returns 0 if mixed, -1 otherwise.
+    int mix(int worker, audiosocket& audiosock);
+
+    // measured mix cost per tick in ms, estimated from the participants until then
+    double load();
+
+    size_t participants() { return mixer.participants(); }
+
+    const uint16_t id;
+    audiobuffermanager manager;  // declared before the mixer, whose participants hold its frames
+    audiomixer mixer;
+    audiorecorder recorder;      // idle unless the rooms are recorded
+
+    std::atomic<int> owner;      // worker mixing the room, only it changes the owner
+    std::atomic<int> target;     // worker the room migrates to, == owner when settled
+    std::atomic<double> cost;    // mix cost per tick in ms, exponential average
+    const uint64_t created;
+    std::atomic<uint64_t> placed;  // when the room was opened or last moved, against ping-pong
+};
+
+class audiorooms {
+public:
+    audiorooms() : workers(1), maxrooms(64), samplingrate(48000), channels(2), framesize(120), bitrate(192000),
+                   maxqueue(8), maxparticipants(32), buffers(1024), stats(0), n_migrations(0) {}
+
+    virtual ~audiorooms() {}
+
+    typedef std::shared_ptr<audioroom> shared_room;
+
+    // the parameters of every room, placed on <workers> mix workers
+    void configure(int _workers,
+                   size_t _maxrooms,
+                   size_t _samplingrate,
+                   int _channels,
+                   size_t _framesize,
+                   int _bitrate,
+                   size_t _maxqueue,
+                   size_t _maxparticipants,
+                   size_t _buffers)
+    {
+        workers = (_workers < 1) ? 1 : _workers;
+        maxrooms = _maxrooms;
+        samplingrate = _samplingrate;
+        channels = _channels;
+        framesize = _framesize;
+        bitrate = _bitrate;
+        maxqueue = _maxqueue;
+        maxparticipants = _maxparticipants;
+        buffers = _buffers;
+        owned.resize(workers);
+        table.reserve(maxrooms);
+    }
+
+    // record every room to <dir>/room-<id>-<date>-<time>.rec, nullptr or "" to stop recording new rooms
+    void set_recording(const char* dir) {
+        recorddir = dir ? dir : "";
+    }
+
+    // histograms of every room's mixer, the gauges are summed up by sweep()
+    void set_stats(audiostats* _stats) {
+        stats = _stats;
+    }
+
+    // receive path: O(1) lookup; the first audio frame of a room that is not open
+    // asks the housekeeping thread to open it and gets nullptr, like every frame
+    // until the room is ready
+    shared_room room(uint16_t id);
+
+    // receive path: O(1) lookup only, nullptr if the room is not open
+    shared_room find(uint16_t id);
+
+    // mix path: one tick of all rooms owned by <worker>, returns how many were mixed
+    int mix(int worker, audiosocket& audiosock);
+
+    // housekeeping: evict idle sessions, close empty rooms, update the gauges;
+    // returns the number of rooms left
+    size_t sweep(uint64_t idle_ms = AUDIO_SESSION_TIMEOUT_MS);
+
+    // housekeeping, off the receive and mix path: waits up to <wait_ms> for requested rooms,
+    // opens them on the least loaded worker with their recordings, and preallocates ahead
+    // of every room's recording
+    void housekeeping(uint64_t wait_ms);
+
+    // move at most one room from the most to the least loaded worker, returns 1 if one moves
+    int rebalance();
+
+    size_t rooms() {
+        std::shared_lock<std::shared_mutex> guard(mMutex);
+        return table.size();
+    }
+
+    uint64_t migrations() { return n_migrations; }
+
+private:
+    // build room <id> and add it to the table, returns 0 or -1
+    int open(uint16_t id);
+
+    // least loaded worker by load, then participants; called with the lock held
+    int place();
+
+    std::shared_mutex mMutex;
+    std::unordered_map<uint16_t, shared_room> table;
+    std::vector<std::vector<shared_room>> owned;  // per worker, touched only by that worker
+
+    int workers;
+    size_t maxrooms;
+    size_t samplingrate;
+    int channels;
+    size_t framesize;
+    int bitrate;
+    size_t maxqueue;
+    size_t maxparticipants;
+    size_t buffers;
+    audiostats* stats;
+    std::string recorddir;
+    std::mutex openMutex;
+    std::condition_variable openCond;
+    std::vector<uint16_t> requested;  // rooms a receive worker asked for, not open yet
+    std::atomic<uint64_t> n_migrations;
+};
+
+#endif /* audioroom_hpp */
@@ -0,0 +1,187 @@
+//
+//  audiostats.cpp
+//
+//  Shared memory export of the latency histograms and counters
+//
+
+#include "audiostats.hpp"
+#include "audioclock.hpp"
+#include <memory>
+#include <new>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* stage_names[audiostats::eStages] = {
+    "capture", "capture-wait", "encode", "send", "receive", "decode", "queue-wait", "playout", "mix"
+};
+
+static const char* counter_names[audiostats::eCounters] = {
+    "buffers-queued", "buffers-inflight", "queue-depth", "underruns", "drops", "overruns", "concealed", "participants"
+};
+
+uint64_t
+audiohistogram::percentile(double q) const
+{
+    uint64_t n = total.load(std::memory_order_relaxed);
+    if (!n) {
+        return 0;
+    }
+    // counts and total are read unsynchronised, a concurrent record() may be missing
+    uint64_t rank = (uint64_t) (q * n);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < AUDIO_HIST_BUCKETS; ++b) {
+        seen += counts[b].load(std::memory_order_relaxed);
+        if (seen > rank) {
+            uint64_t upper = (b + 1 < AUDIO_HIST_BUCKETS) ? lower(b + 1) - 1 : lower(b);
+            uint64_t m = max.load(std::memory_order_relaxed);
+            return (upper < m) ? upper : m;
+        }
+    }
+    return max.load(std::memory_order_relaxed);
+}
+
+int
+audiostats::open(const char* name)
+{
+    close();
+    path = std::string("/") + name;
+    writer = true;
+
+    int fd = shm_open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if ((fd >= 0) && !ftruncate(fd, sizeof(segment))) {
+        void* p = mmap(0, sizeof(segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            // the fresh pages are zero, which is a valid state for all atomics
+            seg = (segment*) p;
+            shared = true;
+        }
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+
+    if (!seg) {
+        fprintf(stderr,"warning: cannot export statistics to /dev/shm%s, keeping them in process\n", path.c_str());
+        seg = new (std::nothrow) segment();
+        if (!seg) {
+            return -1;
+        }
+        memset((void*) seg, 0, sizeof(segment));
+    }
+
+    seg->version = AUDIO_STATS_VERSION;
+    seg->size = sizeof(segment);
+    seg->pid = getpid();
+    seg->started = audioclock::now();
+    // readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    seg->magic = AUDIO_STATS_MAGIC;
+    return 0;
+}
+
+int
+audiostats::attach(const char* name)
+{
+    close();
+    path = std::string("/") + name;
+    writer = false;
+
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr,"error: no statistics segment /dev/shm%s\n", path.c_str());
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || ((size_t) st.st_size < sizeof(segment))) {
+        fprintf(stderr,"error: statistics segment /dev/shm%s has the wrong size\n", path.c_str());
+        ::close(fd);
+        return -1;
+    }
+    void* p = mmap(0, sizeof(segment), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr,"error: cannot map /dev/shm%s\n", path.c_str());
+        return -1;
+    }
+    seg = (segment*) p;
+    shared = true;
+    if ((seg->magic != AUDIO_STATS_MAGIC) || (seg->version != AUDIO_STATS_VERSION) || (seg->size != sizeof(segment))) {
+        fprintf(stderr,"error: /dev/shm%s is not a compatible statistics segment\n", path.c_str());
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+void
+audiostats::close()
+{
+    if (!seg) {
+        return;
+    }
+    if (shared) {
+        munmap((void*) seg, sizeof(segment));
+        if (writer) {
+            shm_unlink(path.c_str());
+        }
+    } else {
+        delete seg;
+    }
+    seg = 0;
+    shared = false;
+}
+
+void
+audiostats::merge(Stage s, audiohistogram& h)
+{
+    h.clear();
+    if (!seg) {
+        return;
+    }
+    for (size_t t = 0; t < AUDIO_STATS_THREADS; ++t) {
+        h.add(seg->stages[t][s]);
+    }
+}
+
+void
+audiostats::print(FILE* out)
+{
+    if (!seg) {
+        return;
+    }
+    // the merged histogram is too large for a small thread stack
+    std::unique_ptr<audiohistogram> merged(new audiohistogram());
+    audiohistogram& h = *merged;
+    for (int s = 0; s < eStages; ++s) {
+        merge((Stage) s, h);
+        if (!h.total.load(std::memory_order_relaxed)) {
+            continue;
+        }
+        fprintf(out,"%-10s n=%lu avg=%.03f p50=%.03f p99=%.03f p99.9=%.03f max=%.03f [us]\n",
+                stage_name(s),
+                h.total.load(std::memory_order_relaxed),
+                h.avg() / 1000.0,
+                h.percentile(0.5) / 1000.0,
+                h.percentile(0.99) / 1000.0,
+                h.percentile(0.999) / 1000.0,
+                h.max.load(std::memory_order_relaxed) / 1000.0);
+    }
+    for (int c = 0; c < eCounters; ++c) {
+        fprintf(out,"%s=%lu%s", counter_name(c), seg->counters[c].load(std::memory_order_relaxed), (c + 1 < eCounters) ? " " : "\n");
+    }
+}
+
+const char*
+audiostats::stage_name(int s)
+{
+    return ((s >= 0) && (s < eStages)) ? stage_names[s] : "unknown";
+}
+
+const char*
+audiostats::counter_name(int c)
+{
+    return ((c >= 0) && (c < eCounters)) ? counter_names[c] : "unknown";
+}
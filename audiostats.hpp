@@ -0,0 +1,183 @@
+//
+//  audiostats.hpp
+//
+//  Per-stage latency histograms and counters in a shared memory segment.
+//  Every thread records into histograms of its own slot, so the audio
+//  threads only do uncontended relaxed atomic increments; an external tool
+//  (audioSTAT) maps the segment read-only, sums the slots and scrapes it at
+//  any time.
+//
+
+#ifndef audiostats_hpp
+#define audiostats_hpp
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#define AUDIO_STATS_MAGIC    0x41535431  /* "AST1" */
+#define AUDIO_STATS_VERSION  2
+#define AUDIO_STATS_THREADS  64          /* histogram slots, later threads share the last one */
+#define AUDIO_HIST_SUB_BITS  4           /* 16 linear sub-buckets per power of two, ~6% resolution */
+#define AUDIO_HIST_SUB       (1 << AUDIO_HIST_SUB_BITS)
+#define AUDIO_HIST_RANGE     40          /* powers of two above the linear range, up to 2^44 ns (~5h) */
+#define AUDIO_HIST_BUCKETS   ((AUDIO_HIST_RANGE + 1) * AUDIO_HIST_SUB)
+
+// HDR style log-linear histogram of ns values. Lives in shared memory, so
+// plain data only; record() is wait-free and may be called by several threads.
+struct alignas(64) audiohistogram {
+    std::atomic<uint64_t> counts[AUDIO_HIST_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+
+    void record(uint64_t ns) {
+        counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(ns, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t m = max.load(std::memory_order_relaxed);
+        while ((ns > m) && !max.compare_exchange_weak(m, ns, std::memory_order_relaxed)) {}
+    }
+
+    static size_t bucket(uint64_t v) {
+        if (v < AUDIO_HIST_SUB) {
+            return v;
+        }
+        int e = 63 - __builtin_clzll(v);
+        size_t b = (e - AUDIO_HIST_SUB_BITS + 1) * AUDIO_HIST_SUB + ((v >> (e - AUDIO_HIST_SUB_BITS)) & (AUDIO_HIST_SUB - 1));
+        return (b < AUDIO_HIST_BUCKETS) ? b : AUDIO_HIST_BUCKETS - 1;
+    }
+
+    // smallest value falling into bucket <b>
+    static uint64_t lower(size_t b) {
+        if (b < AUDIO_HIST_SUB) {
+            return b;
+        }
+        int e = b / AUDIO_HIST_SUB + AUDIO_HIST_SUB_BITS - 1;
+        return (uint64_t) (AUDIO_HIST_SUB + b % AUDIO_HIST_SUB) << (e - AUDIO_HIST_SUB_BITS);
+    }
+
+    // value below which a fraction <q> of the samples fall, upper bucket bound
+    uint64_t percentile(double q) const;
+
+    // reader side: accumulate <h> into this one
+    void add(const audiohistogram& h) {
+        for (size_t b = 0; b < AUDIO_HIST_BUCKETS; ++b) {
+            counts[b].fetch_add(h.counts[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        sum.fetch_add(h.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        total.fetch_add(h.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t m = h.max.load(std::memory_order_relaxed);
+        if (m > max.load(std::memory_order_relaxed)) {
+            max.store(m, std::memory_order_relaxed);
+        }
+    }
+
+    void clear() {
+        for (size_t b = 0; b < AUDIO_HIST_BUCKETS; ++b) {
+            counts[b].store(0, std::memory_order_relaxed);
+        }
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+
+    double avg() const {
+        uint64_t n = total.load(std::memory_order_relaxed);
+        return n ? (double) sum.load(std::memory_order_relaxed) / n : 0;
+    }
+};
+
+class audiostats {
+public:
+    enum Stage {
+        eCapture,     // audio callback copying into the capture ring
+        eCaptureWait, // capture ring until the encoder thread takes the period
+        eEncode,
+        eSend,
+        eReceive,     // one receive batch: parse, split, queue
+        eDecode,
+        eQueueWait,   // frame arrival (or capture) until the consumer picks it up
+        ePlayout,     // audio callback producing one period
+        eMix,         // one server tick
+        eStages
+    };
+
+    enum Counter {
+        eBuffersQueued,    // audiobuffermanager::queued()
+        eBuffersInflight,  // audiobuffermanager::inflight()
+        eQueueDepth,       // jitter buffer depth, or the deepest participant queue
+        eUnderruns,
+        eDrops,            // late, overflow or dropped to bound the latency
+        eOverruns,         // capture periods the encoder could not take
+        eConcealed,        // frames rebuilt by FEC or PLC
+        eParticipants,
+        eCounters
+    };
+
+    struct segment {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t size;
+        uint32_t pid;
+        uint64_t started;  // CLOCK_MONOTONIC ns
+        std::atomic<uint32_t> threads;  // slots handed out so far
+        audiohistogram stages[AUDIO_STATS_THREADS][eStages];
+        std::atomic<uint64_t> counters[eCounters];
+    };
+
+    audiostats() : seg(0), shared(false), writer(false) {}
+
+    virtual ~audiostats() { close(); }
+
+    // writer: create /dev/shm/<name>; falls back to process memory if that fails
+    int open(const char* name);
+
+    // reader: map an existing segment read-only, returns 0 or -1
+    int attach(const char* name);
+
+    void close();
+
+    // audio threads, no-ops until opened
+    void record(Stage s, uint64_t ns) {
+        if (seg) seg->stages[slot()][s].record(ns);
+    }
+
+    void set(Counter c, uint64_t v) {
+        if (seg) seg->counters[c].store(v, std::memory_order_relaxed);
+    }
+
+    void add(Counter c, uint64_t n = 1) {
+        if (seg) seg->counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    const segment* get() { return seg; }
+
+    // reader: stage <s> summed over all thread slots into <h>
+    void merge(Stage s, audiohistogram& h);
+
+    // percentiles and counters, one line per stage
+    void print(FILE* out);
+
+    static const char* stage_name(int s);
+    static const char* counter_name(int c);
+
+private:
+    // the calling thread's histogram slot, handed out on its first record()
+    size_t slot() {
+        static thread_local int index = -1;
+        if (index < 0) {
+            uint32_t n = seg->threads.fetch_add(1, std::memory_order_relaxed);
+            index = (n < AUDIO_STATS_THREADS) ? n : AUDIO_STATS_THREADS - 1;
+        }
+        return index;
+    }
+
+    segment* seg;
+    std::string path;
+    bool shared;
+    bool writer;
+};
+
+#endif /* audiostats_hpp */
@@ -0,0 +1,420 @@
+//
+//  audiowire.hpp
+//
+//  Versioned wire format of an audio datagram. All fields are in network
+//  byte order:
+//
+//   0      1      2             4                    8                   12
+//  +------+------+-------------+--------------------+-------------------+---------
+//  | ver  | flags| participant | sequence (wraps)   | media time (wraps)| payload
+//  +------+------+-------------+--------------------+-------------------+---------
+//
+//  The payload length is the datagram length minus the header.
+//
+//  With AUDIO_WIRE_FLAG_REPORT the payload is a receiver report about the
+//  stream flowing the other way (the id is the one of the reporter):
+//
+//   0      1             4               8              12             16
+//  +------+-------------+---------------+--------------+--------------+--------------+
+//  | loss | reserved    | lost (total)  | highest seq  | jitter (us)  | late (total) |
+//  +------+-------------+---------------+--------------+--------------+--------------+
+//
+//  loss is the fraction lost since the previous report in 1/256.
+//
+//  With AUDIO_WIRE_FLAG_ROOM the first 2 bytes after the header are the
+//  room the datagram belongs to; without it the datagram belongs to the
+//  default room 0.
+//
+//  With AUDIO_WIRE_FLAG_TIME the next 8 bytes are the capture time of the
+//  (first) frame in ns on the server's monotonic clock, the payload follows.
+//
+//  AUDIO_WIRE_FLAG_DTX marks a keepalive without payload: the sender is
+//  silent and skipped the frames up to and including <sequence> on purpose.
+//  It repeats every AUDIO_DTX_KEEPALIVE_MS until the audio resumes.
+//
+//  AUDIO_WIRE_FLAG_PING/PONG carry CLOCK_MONOTONIC stamps in ns for the
+//  clock synchronisation: t1 client send, t2 server receive, t3 server
+//  send (8 bytes each, a ping only fills t1).
+//
+//  With AUDIO_WIRE_FLAG_MULTI the payload aggregates k consecutive frames,
+//  the header carries sequence and media time of the first one:
+//
+//   0      1                  1+2k
+//  +------+------------------+---------+---------+-----
+//  |  k   | k x length (16)  | frame 0 | frame 1 | ...
+//  +------+------------------+---------+---------+-----
+//
+
+#ifndef audiowire_hpp
+#define audiowire_hpp
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define AUDIO_WIRE_VERSION 1
+#define AUDIO_WIRE_HEADER  12
+#define AUDIO_WIRE_PAYLOAD 1440
+#define AUDIO_WIRE_MAX     (AUDIO_WIRE_HEADER + AUDIO_WIRE_PAYLOAD)
+
+// participant id used by the server for the mixes it sends
+#define AUDIO_WIRE_SERVER_ID 0
+
+// header flags
+#define AUDIO_WIRE_FLAG_REPORT 0x01
+#define AUDIO_WIRE_FLAG_MULTI  0x02
+#define AUDIO_WIRE_FLAG_PING   0x04
+#define AUDIO_WIRE_FLAG_PONG   0x08
+#define AUDIO_WIRE_FLAG_TIME   0x10
+#define AUDIO_WIRE_FLAG_ROOM   0x20
+#define AUDIO_WIRE_FLAG_DTX    0x40
+#define AUDIO_WIRE_ROOM        2
+#define AUDIO_WIRE_TIME        8
+#define AUDIO_WIRE_CLOCK       24
+#define AUDIO_WIRE_REPORT      20
+#define AUDIO_WIRE_MAX_FRAMES  8     /* frames per aggregated datagram */
+#define AUDIO_DTX_KEEPALIVE_MS 100   /* keepalive interval while silent, below the receiver's jump tolerance */
+
+// one datagram as it is sent or received
+struct audiopacket_t {
+    audiopacket_t() : bytes(0) { memset(&peer, 0, sizeof(peer)); }
+    unsigned char data[AUDIO_WIRE_MAX];
+    size_t bytes;
+    struct sockaddr_in peer;
+};
+
+// parsed header, the payload points into the datagram (no copy)
+struct audiowire_t {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t id;
+    uint16_t room;        // 0 without AUDIO_WIRE_FLAG_ROOM
+    uint32_t seq;
+    uint32_t timestamp;   // media clock in samples
+    uint64_t capture;     // capture time in ns on the server clock, 0 if unknown
+    const unsigned char* payload;
+    size_t len;
+};
+
+// receiver report, see above
+struct audioreport_t {
+    uint8_t fraction_lost;
+    uint32_t lost;
+    uint32_t highest;
+    uint32_t jitter_us;
+    uint32_t late;
+};
+
+// clock synchronisation stamps, see above
+struct audioclock_t {
+    uint64_t t1;
+    uint64_t t2;
+    uint64_t t3;
+};
+
+class audiowire {
+public:
+    // write header and payload into <packet>, returns the datagram length or -1
+    static int encode(audiopacket_t* packet,
+                      uint8_t flags,
+                      uint16_t id,
+                      uint32_t seq,
+                      uint32_t timestamp,
+                      const unsigned char* payload,
+                      size_t len,
+                      uint64_t capture = 0,
+                      uint16_t room = 0)
+    {
+        size_t ext = extensions(flags, capture, room);
+        if (len + ext > AUDIO_WIRE_PAYLOAD) {
+            return -1;
+        }
+        header(packet->data, flags, id, seq, timestamp);
+        unsigned char* p = extend(packet->data, capture, room);
+        memcpy(p, payload, len);
+        packet->bytes = AUDIO_WIRE_HEADER + ext + len;
+        return packet->bytes;
+    }
+
+    // aggregate <k> consecutive frames, <seq> and <timestamp> are the ones of the first
+    static int encode(audiopacket_t* packet,
+                      uint8_t flags,
+                      uint16_t id,
+                      uint32_t seq,
+                      uint32_t timestamp,
+                      const unsigned char* const* payloads,
+                      const size_t* lens,
+                      int k,
+                      uint64_t capture = 0,
+                      uint16_t room = 0)
+    {
+        if ((k < 1) || (k > AUDIO_WIRE_MAX_FRAMES)) {
+            return -1;
+        }
+        flags |= AUDIO_WIRE_FLAG_MULTI;
+        size_t ext = extensions(flags, capture, room);
+        size_t len = ext + 1 + 2*k;
+        for (int i = 0; i < k; ++i) {
+            len += lens[i];
+        }
+        if (len > AUDIO_WIRE_PAYLOAD) {
+            return -1;
+        }
+        header(packet->data, flags, id, seq, timestamp);
+        unsigned char* p = extend(packet->data, capture, room);
+        *p++ = (unsigned char) k;
+        for (int i = 0; i < k; ++i) {
+            uint16_t n16 = htons((uint16_t) lens[i]);
+            memcpy(p, &n16, 2);
+            p += 2;
+        }
+        for (int i = 0; i < k; ++i) {
+            memcpy(p, payloads[i], lens[i]);
+            p += lens[i];
+        }
+        packet->bytes = AUDIO_WIRE_HEADER + len;
+        return packet->bytes;
+    }
+
+    // DTX keepalive, the frames up to <seq> were skipped on purpose
+    static int keepalive(audiopacket_t* packet, uint16_t id, uint32_t seq, uint32_t timestamp, uint16_t room = 0)
+    {
+        return encode(packet, AUDIO_WIRE_FLAG_DTX, id, seq, timestamp, packet->data, 0, 0, room);
+    }
+
+    // validate and parse, returns 0 or -1 for a malformed or unknown datagram
+    static int parse(const unsigned char* data, size_t bytes, audiowire_t& wire)
+    {
+        if ((bytes < AUDIO_WIRE_HEADER) || (bytes > AUDIO_WIRE_MAX)) {
+            return -1;
+        }
+        if (data[0] != AUDIO_WIRE_VERSION) {
+            return -1;
+        }
+        uint16_t n16;
+        uint32_t n32;
+        wire.version = data[0];
+        wire.flags = data[1];
+        memcpy(&n16, data + 2, 2);
+        wire.id = ntohs(n16);
+        memcpy(&n32, data + 4, 4);
+        wire.seq = ntohl(n32);
+        memcpy(&n32, data + 8, 4);
+        wire.timestamp = ntohl(n32);
+        wire.payload = data + AUDIO_WIRE_HEADER;
+        wire.len = bytes - AUDIO_WIRE_HEADER;
+        wire.room = 0;
+        wire.capture = 0;
+        if (wire.flags & AUDIO_WIRE_FLAG_ROOM) {
+            if (wire.len < AUDIO_WIRE_ROOM) {
+                return -1;
+            }
+            memcpy(&n16, wire.payload, 2);
+            wire.room = ntohs(n16);
+            wire.payload += AUDIO_WIRE_ROOM;
+            wire.len -= AUDIO_WIRE_ROOM;
+        }
+        if (wire.flags & AUDIO_WIRE_FLAG_TIME) {
+            if (wire.len < AUDIO_WIRE_TIME) {
+                return -1;
+            }
+            wire.capture = get64(wire.payload);
+            wire.payload += AUDIO_WIRE_TIME;
+            wire.len -= AUDIO_WIRE_TIME;
+        }
+        return 0;
+    }
+
+    static int parse(const audiopacket_t* packet, audiowire_t& wire)
+    {
+        return parse(packet->data, packet->bytes, wire);
+    }
+
+    // one audiowire_t per frame, a plain datagram yields itself; returns the count or -1
+    static int split(const audiowire_t& wire, audiowire_t* frames, int max, uint32_t samples_per_frame, uint64_t ns_per_frame = 0)
+    {
+        if (!(wire.flags & AUDIO_WIRE_FLAG_MULTI)) {
+            if (max < 1) {
+                return -1;
+            }
+            frames[0] = wire;
+            return 1;
+        }
+        if (wire.len < 1) {
+            return -1;
+        }
+        int k = wire.payload[0];
+        if ((k < 1) || (k > max) || (k > AUDIO_WIRE_MAX_FRAMES)) {
+            return -1;
+        }
+        size_t offset = 1 + 2*k;
+        if (offset > wire.len) {
+            return -1;
+        }
+        for (int i = 0; i < k; ++i) {
+            uint16_t n16;
+            memcpy(&n16, wire.payload + 1 + 2*i, 2);
+            size_t len = ntohs(n16);
+            if (offset + len > wire.len) {
+                return -1;
+            }
+            frames[i] = wire;
+            frames[i].flags &= ~AUDIO_WIRE_FLAG_MULTI;
+            frames[i].seq = wire.seq + i;
+            frames[i].timestamp = wire.timestamp + i * samples_per_frame;
+            frames[i].capture = wire.capture ? wire.capture + i * ns_per_frame : 0;
+            frames[i].payload = wire.payload + offset;
+            frames[i].len = len;
+            offset += len;
+        }
+        return k;
+    }
+
+    static int encode(audiopacket_t* packet, uint16_t id, uint32_t seq, const audioreport_t& report, uint16_t room = 0)
+    {
+        unsigned char payload[AUDIO_WIRE_REPORT];
+        uint32_t n32;
+        memset(payload, 0, sizeof(payload));
+        payload[0] = report.fraction_lost;
+        n32 = htonl(report.lost);
+        memcpy(payload + 4, &n32, 4);
+        n32 = htonl(report.highest);
+        memcpy(payload + 8, &n32, 4);
+        n32 = htonl(report.jitter_us);
+        memcpy(payload + 12, &n32, 4);
+        n32 = htonl(report.late);
+        memcpy(payload + 16, &n32, 4);
+        return encode(packet, AUDIO_WIRE_FLAG_REPORT, id, seq, 0, payload, sizeof(payload), 0, room);
+    }
+
+    // returns 0 or -1 if <wire> is not a receiver report
+    static int parse(const audiowire_t& wire, audioreport_t& report)
+    {
+        if (!(wire.flags & AUDIO_WIRE_FLAG_REPORT) || (wire.len < AUDIO_WIRE_REPORT)) {
+            return -1;
+        }
+        uint32_t n32;
+        report.fraction_lost = wire.payload[0];
+        memcpy(&n32, wire.payload + 4, 4);
+        report.lost = ntohl(n32);
+        memcpy(&n32, wire.payload + 8, 4);
+        report.highest = ntohl(n32);
+        memcpy(&n32, wire.payload + 12, 4);
+        report.jitter_us = ntohl(n32);
+        memcpy(&n32, wire.payload + 16, 4);
+        report.late = ntohl(n32);
+        return 0;
+    }
+
+    // ping (t2 = t3 = 0) or pong
+    static int encode(audiopacket_t* packet, uint16_t id, uint32_t seq, const audioclock_t& clock)
+    {
+        unsigned char payload[AUDIO_WIRE_CLOCK];
+        put64(payload, clock.t1);
+        put64(payload + 8, clock.t2);
+        put64(payload + 16, clock.t3);
+        uint8_t flags = clock.t2 ? AUDIO_WIRE_FLAG_PONG : AUDIO_WIRE_FLAG_PING;
+        return encode(packet, flags, id, seq, 0, payload, sizeof(payload));
+    }
+
+    // returns 0 or -1 if <wire> is neither ping nor pong
+    static int parse(const audiowire_t& wire, audioclock_t& clock)
+    {
+        if (!(wire.flags & (AUDIO_WIRE_FLAG_PING | AUDIO_WIRE_FLAG_PONG)) || (wire.len < AUDIO_WIRE_CLOCK)) {
+            return -1;
+        }
+        clock.t1 = get64(wire.payload);
+        clock.t2 = get64(wire.payload + 8);
+        clock.t3 = get64(wire.payload + 16);
+        return 0;
+    }
+
+    // extend a wrapping 32-bit sequence to 64 bit, closest to <reference>
+    static uint64_t unwrap(uint32_t seq, uint64_t reference)
+    {
+        uint64_t candidate = (reference & ~0xffffffffull) | seq;
+        if ((candidate > reference) && (candidate - reference > 0x80000000ull) && (candidate >= 0x100000000ull)) {
+            candidate -= 0x100000000ull;
+        } else if ((candidate < reference) && (reference - candidate > 0x80000000ull)) {
+            candidate += 0x100000000ull;
+        }
+        return candidate;
+    }
+
+    // stable participant id derived from a name (FNV-1a folded to 16 bit)
+    static uint16_t id(const std::string& name)
+    {
+        uint32_t h = 2166136261u;
+        for (unsigned char c : name) {
+            h ^= c;
+            h *= 16777619u;
+        }
+        uint16_t id = (h >> 16) ^ (h & 0xffff);
+        return (id == AUDIO_WIRE_SERVER_ID) ? 1 : id;
+    }
+
+private:
+    // sets the extension flags, returns their size
+    static size_t extensions(uint8_t& flags, uint64_t capture, uint16_t room)
+    {
+        size_t ext = 0;
+        if (room) {
+            flags |= AUDIO_WIRE_FLAG_ROOM;
+            ext += AUDIO_WIRE_ROOM;
+        }
+        if (capture) {
+            flags |= AUDIO_WIRE_FLAG_TIME;
+            ext += AUDIO_WIRE_TIME;
+        }
+        return ext;
+    }
+
+    // writes the extensions behind the header, returns where the payload starts
+    static unsigned char* extend(unsigned char* data, uint64_t capture, uint16_t room)
+    {
+        unsigned char* p = data + AUDIO_WIRE_HEADER;
+        if (room) {
+            uint16_t n16 = htons(room);
+            memcpy(p, &n16, 2);
+            p += AUDIO_WIRE_ROOM;
+        }
+        if (capture) {
+            put64(p, capture);
+            p += AUDIO_WIRE_TIME;
+        }
+        return p;
+    }
+
+    static void put64(unsigned char* p, uint64_t v)
+    {
+        uint32_t n32 = htonl((uint32_t) (v >> 32));
+        memcpy(p, &n32, 4);
+        n32 = htonl((uint32_t) v);
+        memcpy(p + 4, &n32, 4);
+    }
+
+    static uint64_t get64(const unsigned char* p)
+    {
+        uint32_t hi, lo;
+        memcpy(&hi, p, 4);
+        memcpy(&lo, p + 4, 4);
+        return ((uint64_t) ntohl(hi) << 32) | ntohl(lo);
+    }
+
+    static void header(unsigned char* p, uint8_t flags, uint16_t id, uint32_t seq, uint32_t timestamp)
+    {
+        uint16_t n16 = htons(id);
+        uint32_t n32;
+        p[0] = AUDIO_WIRE_VERSION;
+        p[1] = flags;
+        memcpy(p + 2, &n16, 2);
+        n32 = htonl(seq);
+        memcpy(p + 4, &n32, 4);
+        n32 = htonl(timestamp);
+        memcpy(p + 8, &n32, 4);
+    }
+};
+
+#endif /* audiowire_hpp */
@@ -0,0 +1,312 @@
+//
+//  jitterbuffer.cpp
+//
+//  Adaptive playout buffer keyed on the frame sequence number
+//
+
+#include "jitterbuffer.hpp"
+#include <math.h>
+
+static double elapsed_ms(struct timespec& ts1, struct timespec& ts2)
+{
+    return ((ts2.tv_sec-ts1.tv_sec)*1000000000.0 + (ts2.tv_nsec-ts1.tv_nsec))/1000000.0;
+}
+
+void
+jitterbuffer::reset()
+{
+    n_played = n_missing = n_late = n_duplicate = n_overflow = n_skipped = n_underrun = 0;
+    n_recovered = n_concealed = n_lost = n_silent = 0;
+    highest = 0;
+    received = 0;
+    jitter = 0;
+    resync = false;
+    silent_until = 0;
+    dtx = false;
+    have_arrival = false;
+    last_frame = 0;
+    playhead = 0;
+    playing = false;
+    current = 0;
+    empty_run = 0;
+    outcome = eIdle;
+}
+
+int
+jitterbuffer::put(audiobuffermanager::shared_buffer audio)
+{
+    if (resync.load(std::memory_order_acquire)) {
+        // the playout side has not yet flushed after a stream restart
+        return -1;
+    }
+
+    uint64_t frame = audio->frame();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (have_arrival) {
+        uint64_t h = highest.load(std::memory_order_relaxed);
+        if ((frame + slots.size() < h) || (frame > h + slots.size())) {
+            // sender restarted or jumped: start over
+            have_arrival = false;
+            received.store(0, std::memory_order_relaxed);
+            resync.store(true, std::memory_order_release);
+            return -1;
+        }
+    }
+
+    // RFC 3550 style inter-arrival jitter, drives the target playout depth
+    if (have_arrival && (frame > last_frame)) {
+        double d = elapsed_ms(last_arrival, now) - (frame - last_frame) * period_ms;
+        double j = jitter.load(std::memory_order_relaxed);
+        j += (fabs(d) - j) / 16.0;
+        jitter.store(j, std::memory_order_relaxed);
+
+        size_t t = 1 + (size_t) ceil(3.0 * j / period_ms);
+        if (t < floor) t = floor;
+        if (t > ceiling) t = ceiling;
+        target.store(t, std::memory_order_relaxed);
+    }
+
+    if (!have_arrival || (frame > last_frame)) {
+        last_frame = frame;
+        last_arrival = now;
+        have_arrival = true;
+    }
+
+    if (dtx.load(std::memory_order_relaxed) && (frame >= silent_until.load(std::memory_order_relaxed))) {
+        // the sender is back
+        dtx.store(false, std::memory_order_release);
+        if (playing.load(std::memory_order_acquire) && (frame < playhead.load(std::memory_order_acquire))) {
+            // the playhead ran ahead of the sender's clock during the silence: buffer again
+            received.store(0, std::memory_order_relaxed);
+            resync.store(true, std::memory_order_release);
+            return -1;
+        }
+    }
+
+    if (playing.load(std::memory_order_acquire)) {
+        uint64_t p = playhead.load(std::memory_order_acquire);
+        if (frame < p) {
+            n_late++;
+            return -1;
+        }
+        if (frame >= p + slots.size()) {
+            n_overflow++;
+            return -1;
+        }
+    }
+
+    slot& s = slots[frame % slots.size()];
+    uint64_t state = s.state.load(std::memory_order_acquire);
+    if (state) {
+        if (state - 1 == frame) {
+            n_duplicate++;
+        } else {
+            n_overflow++;
+        }
+        return -1;
+    }
+
+    // the slot belongs to us: recycle what the playout side left behind
+    if (s.audio) {
+        manager.put_buffer(s.audio);
+    }
+    s.audio = audio;
+    s.state.store(frame + 1, std::memory_order_release);
+
+    if (!received.load(std::memory_order_relaxed) || (frame > highest.load(std::memory_order_relaxed))) {
+        highest.store(frame, std::memory_order_release);
+    }
+    received.fetch_add(1, std::memory_order_release);
+    return 0;
+}
+
+void
+jitterbuffer::silence(uint64_t frame)
+{
+    if (resync.load(std::memory_order_acquire)) {
+        return;
+    }
+    if (have_arrival && (frame <= last_frame)) {
+        // reordered keepalive
+        return;
+    }
+
+    // the keepalive stands in for the skipped frames: no jitter sample, the next frame measures from here
+    clock_gettime(CLOCK_MONOTONIC, &last_arrival);
+    last_frame = frame;
+    have_arrival = true;
+
+    if (!received.load(std::memory_order_relaxed) || (frame > highest.load(std::memory_order_relaxed))) {
+        highest.store(frame, std::memory_order_release);
+    }
+    silent_until.store(frame + 1, std::memory_order_release);
+    dtx.store(true, std::memory_order_release);
+}
+
+audiobuffermanager::shared_buffer
+jitterbuffer::get()
+{
+    // hand the frame played in the previous period back to the receive thread
+    if (current) {
+        current->state.store(0, std::memory_order_release);
+        current = 0;
+    }
+    outcome = eIdle;
+
+    if (resync.load(std::memory_order_acquire)) {
+        for (auto& s : slots) {
+            s.state.store(0, std::memory_order_release);
+        }
+        playing.store(false, std::memory_order_release);
+        resync.store(false, std::memory_order_release);
+        return nullptr;
+    }
+
+    uint64_t h = highest.load(std::memory_order_acquire);
+    uint64_t p = playhead.load(std::memory_order_relaxed);
+    size_t t = target.load(std::memory_order_relaxed);
+
+    if (!playing.load(std::memory_order_relaxed)) {
+        // buffering: start once we have the target depth
+        if (received.load(std::memory_order_acquire) < t) {
+            return nullptr;
+        }
+        p = (h + 1 >= t) ? (h + 1 - t) : 0;
+        for (auto& s : slots) {
+            uint64_t state = s.state.load(std::memory_order_acquire);
+            if (state && (state - 1 < p)) {
+                s.state.store(0, std::memory_order_release);
+            }
+        }
+        playhead.store(p, std::memory_order_release);
+        playing.store(true, std::memory_order_release);
+        empty_run = 0;
+    }
+
+    // too deep: drop one frame per period until we are back at the target
+    if ((h >= p) && (h - p + 1 > t + 2)) {
+        slot& s = slots[p % slots.size()];
+        if (s.state.load(std::memory_order_acquire)) {
+            s.state.store(0, std::memory_order_release);
+        }
+        playhead.store(++p, std::memory_order_release);
+        n_skipped++;
+    }
+
+    slot& s = slots[p % slots.size()];
+    uint64_t state = s.state.load(std::memory_order_acquire);
+
+    if (state && (state - 1 == p)) {
+        current = &s;
+        playhead.store(p + 1, std::memory_order_release);
+        n_played++;
+        empty_run = 0;
+        outcome = eFrame;
+        return s.audio;
+    }
+
+    if (state && (state - 1 < p)) {
+        // stale frame we jumped over
+        s.state.store(0, std::memory_order_release);
+    }
+
+    if (dtx.load(std::memory_order_acquire) || (p < silent_until.load(std::memory_order_acquire))) {
+        // skipped on purpose: the playhead keeps moving in real time, so the
+        // first frame after the silence plays at the usual depth
+        n_silent++;
+        empty_run = 0;
+        outcome = eSilent;
+        playhead.store(p + 1, std::memory_order_release);
+        return nullptr;
+    }
+
+    if (p > h) {
+        // nothing newer arrived: hold the playhead, this stretches the buffer
+        n_underrun++;
+        outcome = eUnderrun;
+        if (++empty_run > slots.size() * 4) {
+            // the sender went away, buffer again when it comes back
+            playing.store(false, std::memory_order_release);
+            received.store(0, std::memory_order_release);
+            outcome = eIdle;
+        }
+    } else {
+        // a hole in the sequence: lost or reordered beyond the playout point
+        n_missing++;
+        outcome = eHole;
+        playhead.store(p + 1, std::memory_order_release);
+    }
+    return nullptr;
+}
+
+audiobuffer*
+jitterbuffer::peek()
+{
+    uint64_t p = playhead.load(std::memory_order_relaxed);
+    slot& s = slots[p % slots.size()];
+    uint64_t state = s.state.load(std::memory_order_acquire);
+    // a filled slot stays with the playout side until get() releases it
+    return (state && (state - 1 == p)) ? s.audio.get() : 0;
+}
+
+audiobuffermanager::shared_buffer
+jitterbuffer::playout(audiodecoder& decoder)
+{
+    audiobuffermanager::shared_buffer audio = get();
+    uint64_t t1 = audioclock::now();
+
+    if (audio) {
+        if (stats && (audio->type == audiobuffer::eMPEG)) {
+            stats->record(audiostats::eQueueWait, t1 - audio->stored());
+        }
+        // decode in sequence order, so the decoder state stays consistent
+        if ((audio->type == audiobuffer::eWAV) ||
+            ((audio->type == audiobuffer::eMPEG) && (audio->mpeg2wav(decoder) == (int)audio->getFramesize()))) {
+            if (stats) {
+                stats->record(audiostats::eDecode, audioclock::now() - t1);
+            }
+            return audio;
+        }
+        // undecodable, treat it like a lost frame
+        outcome = eHole;
+    }
+
+    if ((outcome == eIdle) || (outcome == eSilent)) {
+        return nullptr;
+    }
+    audiobuffermanager::shared_buffer rebuilt = conceal(decoder);
+    if (stats && rebuilt) {
+        stats->record(audiostats::eDecode, audioclock::now() - t1);
+    }
+    return rebuilt;
+}
+
+audiobuffermanager::shared_buffer
+jitterbuffer::conceal(audiodecoder& decoder)
+{
+    if (!scratch) {
+        scratch = manager.get_buffer();
+        if (!scratch) {
+            n_lost++;
+            return nullptr;
+        }
+    }
+
+    if (outcome == eHole) {
+        audiobuffer* next = peek();
+        if (next && (scratch->fec2wav(decoder, *next) > 0)) {
+            n_recovered++;
+            return scratch;
+        }
+    }
+
+    if (scratch->plc2wav(decoder) > 0) {
+        n_concealed++;
+        return scratch;
+    }
+
+    n_lost++;
+    return nullptr;
+}
@@ -0,0 +1,139 @@
+//
+//  jitterbuffer.hpp
+//
+//  Adaptive playout buffer keyed on the frame sequence number of the
+//  received packets. One receive thread puts, one playout callback gets.
+//
+
+#ifndef jitterbuffer_hpp
+#define jitterbuffer_hpp
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include "audiobuffer.hpp"
+#include "audiostats.hpp"
+
+class jitterbuffer {
+public:
+    jitterbuffer(audiobuffermanager& _manager,
+                 size_t _slots = 64) : manager(_manager), stats(0), slots(_slots)
+    {
+        configure(2, 40, 2.5);
+        reset();
+    }
+
+    virtual ~jitterbuffer() {}
+
+    // depth limits in frames, frame period in ms
+    void configure(size_t _floor,
+                   size_t _ceiling,
+                   double _period_ms)
+    {
+        floor = _floor ? _floor : 1;
+        ceiling = _ceiling < slots.size()/2 ? _ceiling : slots.size()/2;
+        if (ceiling < floor) {
+            ceiling = floor;
+        }
+        period_ms = _period_ms;
+        target = floor;
+    }
+
+    // decode and queue wait histograms of playout()
+    void set_stats(audiostats* _stats) {
+        stats = _stats;
+    }
+
+    // receive thread: insert an encoded frame; returns 0 if the buffer took ownership
+    int put(audiobuffermanager::shared_buffer audio);
+
+    // receive thread: the sender skipped the frames up to <frame> on purpose (DTX);
+    // they play as silence, not as loss, until the next frame arrives
+    void silence(uint64_t frame);
+
+    // playout callback: next frame in sequence or nullptr (missing/buffering), never blocks
+    audiobuffermanager::shared_buffer get();
+
+    // playout callback: next frame as PCM. A missing frame is rebuilt from the
+    // in-band FEC of the following packet or concealed; nullptr means silence.
+    audiobuffermanager::shared_buffer playout(audiodecoder& decoder);
+
+    size_t depth() {
+        uint64_t h = highest.load(std::memory_order_acquire);
+        uint64_t p = playhead.load(std::memory_order_acquire);
+        return (h >= p) ? (h - p + 1) : 0;
+    }
+
+    size_t target_depth() { return target.load(std::memory_order_relaxed); }
+    bool silent() { return dtx.load(std::memory_order_acquire); }
+    double jitter_ms() { return jitter.load(std::memory_order_relaxed); }
+
+    // statistics
+    std::atomic<uint64_t> n_played;
+    std::atomic<uint64_t> n_missing;
+    std::atomic<uint64_t> n_late;
+    std::atomic<uint64_t> n_duplicate;
+    std::atomic<uint64_t> n_overflow;
+    std::atomic<uint64_t> n_skipped;
+    std::atomic<uint64_t> n_underrun;
+    std::atomic<uint64_t> n_recovered;   // rebuilt from FEC
+    std::atomic<uint64_t> n_concealed;   // filled by PLC
+    std::atomic<uint64_t> n_lost;        // played as silence
+    std::atomic<uint64_t> n_silent;      // skipped by the sender (DTX), played as silence
+
+private:
+    void reset();
+
+    // playout side: rebuild the frame at a hole or underrun from FEC or PLC
+    audiobuffermanager::shared_buffer conceal(audiodecoder& decoder);
+
+    // playout side: the frame at the playhead if it already arrived
+    audiobuffer* peek();
+
+    // why the last get() returned what it did
+    enum Outcome {
+        eIdle,      // buffering or restarting
+        eFrame,
+        eHole,      // lost or reordered beyond the playout point
+        eUnderrun,  // playing, but nothing newer arrived yet
+        eSilent     // the sender is in DTX
+    };
+
+    struct slot {
+        slot() : state(0) {}
+        // 0: owned by the receive thread, otherwise frame+1 and owned by the playout side
+        std::atomic<uint64_t> state;
+        audiobuffermanager::shared_buffer audio;
+    };
+
+    audiobuffermanager& manager;
+    audiostats* stats;
+    std::vector<slot> slots;
+
+    size_t floor;
+    size_t ceiling;
+    double period_ms;
+
+    // written by the receive thread
+    std::atomic<uint64_t> highest;
+    std::atomic<uint64_t> received;
+    std::atomic<size_t> target;
+    std::atomic<double> jitter;
+    std::atomic<bool> resync;
+    std::atomic<uint64_t> silent_until;  // frames below were skipped by the sender
+    std::atomic<bool> dtx;               // the sender is silent, no newer frame arrived since
+    bool have_arrival;
+    uint64_t last_frame;
+    struct timespec last_arrival;
+
+    // written by the playout side
+    std::atomic<uint64_t> playhead;
+    std::atomic<bool> playing;
+    slot* current;
+    size_t empty_run;
+    Outcome outcome;
+    audiobuffermanager::shared_buffer scratch;  // PCM of rebuilt frames
+};
+
+#endif /* jitterbuffer_hpp */